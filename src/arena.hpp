@@ -0,0 +1,340 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <new>
+#include <cstdio>
+#include <cstddef>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+#include <stdint.h>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+// What the memory of a scene is used for, reported separately
+enum ArenaCategory
+{
+    kArenaGeometry = 0,  //!< Triangle and sphere arrays
+    kArenaAccel,         //!< Acceleration structure nodes
+    kArenaLights,
+    kArenaMaterials,
+    kArenaCategoryCount
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Scene lifetime memory
+//
+// Bump allocation from large blocks, never freed one by one: everything
+// goes at once in Release (or the destructor), after the destructors of
+// the objects made with New ran in reverse order. With huge pages, blocks
+// are whole 2MB pages: reserved ones (MAP_HUGETLB) when the system has
+// them, transparent ones (MADV_HUGEPAGE) otherwise. Not thread-safe; a
+// scene is built by one thread.
+class MemoryArena
+{
+public:
+
+    static constexpr size_t kBlockSize     = 256 * 1024;
+    static constexpr size_t kHugePageSize  = 2 * 1024 * 1024;
+    static constexpr size_t kCacheLineSize = 64;
+
+    struct CategoryStats
+    {
+        uint64_t mCount; //!< Allocations
+        uint64_t mBytes; //!< Requested, without alignment padding
+    };
+
+    explicit MemoryArena(bool aHugePages = false) :
+        mHugePages(aHugePages),
+        mCurrent(NULL),
+        mEnd(NULL)
+    {
+        for(int i=0; i<kArenaCategoryCount; i++)
+            mStats[i].mCount = mStats[i].mBytes = 0;
+    }
+
+    ~MemoryArena()
+    {
+        Release();
+    }
+
+    MemoryArena(const MemoryArena&) = delete;
+    MemoryArena& operator=(const MemoryArena&) = delete;
+
+    void* Allocate(
+        size_t        aBytes,
+        size_t        aAlignment,
+        ArenaCategory aCategory)
+    {
+        mStats[aCategory].mCount++;
+        mStats[aCategory].mBytes += aBytes;
+
+        // Large requests get a block of their own, so that the rest of the
+        // current block is not wasted
+        const size_t blockSize = mHugePages ? kHugePageSize : kBlockSize;
+        if(aBytes > blockSize / 4)
+            return Align(NewBlock(aBytes + aAlignment), aAlignment);
+
+        char *data = mCurrent ? Align(mCurrent, aAlignment) : NULL;
+        if(!data || data + aBytes > mEnd)
+        {
+            mCurrent = NewBlock(blockSize);
+            mEnd     = mCurrent + mBlocks.back().mSize;
+            data     = Align(mCurrent, aAlignment);
+        }
+
+        mCurrent = data + aBytes;
+        return data;
+    }
+
+    // Constructs an object in the arena; its destructor runs on Release
+    template<typename T, typename... Args>
+    T* New(
+        ArenaCategory aCategory,
+        Args&&...     aArgs)
+    {
+        T *object = new(Allocate(sizeof(T), alignof(T), aCategory)) T(std::forward<Args>(aArgs)...);
+
+        if(!std::is_trivially_destructible<T>::value)
+            mDestructors.push_back(Destructor{ &Destroy<T>, object });
+        return object;
+    }
+
+    // Destroys the objects and frees all memory; the arena can be used again
+    void Release()
+    {
+        for(size_t i=mDestructors.size(); i-- > 0; )
+            mDestructors[i].mFunction(mDestructors[i].mObject);
+        mDestructors.clear();
+
+        for(size_t i=0; i<mBlocks.size(); i++)
+            FreeBlock(mBlocks[i]);
+        mBlocks.clear();
+
+        mCurrent = mEnd = NULL;
+        for(int i=0; i<kArenaCategoryCount; i++)
+            mStats[i].mCount = mStats[i].mBytes = 0;
+    }
+
+    bool UsesHugePages() const { return mHugePages; }
+
+    const CategoryStats& GetStats(ArenaCategory aCategory) const { return mStats[aCategory]; }
+
+    int GetBlockCount() const { return int(mBlocks.size()); }
+
+    uint64_t GetReservedBytes() const
+    {
+        uint64_t bytes = 0;
+        for(size_t i=0; i<mBlocks.size(); i++)
+            bytes += mBlocks[i].mSize;
+        return bytes;
+    }
+
+    int GetHugePageBlockCount() const
+    {
+        int count = 0;
+        for(size_t i=0; i<mBlocks.size(); i++)
+            count += mBlocks[i].mMapped ? 1 : 0;
+        return count;
+    }
+
+    // One line summary of the used categories, allocations and bytes each, e.g.
+    // "geometry 24 allocs 1.2 MB, lights 2 allocs 96 B, 2.0 MB in 3 block(s)"
+    std::string Describe() const
+    {
+        static const char *names[kArenaCategoryCount] = { "geometry", "accel", "lights", "materials" };
+
+        std::string text;
+        for(int i=0; i<kArenaCategoryCount; i++)
+        {
+            if(mStats[i].mCount > 0)
+            {
+                text += names[i] + std::string(" ") + std::to_string(mStats[i].mCount) +
+                    " allocs " + FormatBytes(mStats[i].mBytes) + ", ";
+            }
+        }
+
+        text += FormatBytes(GetReservedBytes()) + " in " + std::to_string(GetBlockCount()) + " block(s)";
+        if(mHugePages)
+            text += ", " + std::to_string(GetHugePageBlockCount()) + " on huge pages";
+        return text;
+    }
+
+    // e.g. "512 B", "1.5 KB", "2.0 MB"
+    static std::string FormatBytes(uint64_t aBytes)
+    {
+        char text[32];
+        if(aBytes < 1024)
+            snprintf(text, sizeof(text), "%d B", int(aBytes));
+        else if(aBytes < 1024 * 1024)
+            snprintf(text, sizeof(text), "%.1f KB", aBytes / 1024.0);
+        else
+            snprintf(text, sizeof(text), "%.1f MB", aBytes / (1024.0 * 1024.0));
+        return text;
+    }
+
+private:
+
+    struct Block
+    {
+        char   *mData;
+        size_t mSize;
+        bool   mMapped; //!< By mmap, on huge pages
+    };
+
+    struct Destructor
+    {
+        void (*mFunction)(void*);
+        void *mObject;
+    };
+
+    template<typename T>
+    static void Destroy(void *aObject)
+    {
+        static_cast<T*>(aObject)->~T();
+    }
+
+    static char* Align(
+        char   *aPointer,
+        size_t aAlignment)
+    {
+        return reinterpret_cast<char*>((uintptr_t(aPointer) + aAlignment - 1) & ~uintptr_t(aAlignment - 1));
+    }
+
+    // Adds a block of at least aBytes, returns its start
+    char* NewBlock(size_t aBytes)
+    {
+        Block block;
+        block.mData   = NULL;
+        block.mSize   = aBytes;
+        block.mMapped = false;
+
+#if defined(__linux__)
+        if(mHugePages)
+        {
+            block.mSize = (aBytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+
+            void *data = mmap(NULL, block.mSize, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+            if(data == MAP_FAILED)
+            {
+                // Transparent huge pages need 2MB aligned ranges: map one
+                // page more and unmap what lies outside the aligned range
+                const size_t size = block.mSize + kHugePageSize;
+                char *mapped = static_cast<char*>(mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+
+                if(mapped != MAP_FAILED)
+                {
+                    char *aligned = Align(mapped, kHugePageSize);
+                    if(aligned > mapped)
+                        munmap(mapped, aligned - mapped);
+                    if(mapped + size > aligned + block.mSize)
+                        munmap(aligned + block.mSize, mapped + size - aligned - block.mSize);
+
+                    madvise(aligned, block.mSize, MADV_HUGEPAGE);
+                    data = aligned;
+                }
+            }
+
+            if(data != MAP_FAILED)
+            {
+                block.mData   = static_cast<char*>(data);
+                block.mMapped = true;
+            }
+            else
+                block.mSize = aBytes;
+        }
+#endif
+
+        if(!block.mData)
+            block.mData = static_cast<char*>(::operator new(block.mSize, std::align_val_t(kCacheLineSize)));
+
+        mBlocks.push_back(block);
+        return block.mData;
+    }
+
+    static void FreeBlock(const Block &aBlock)
+    {
+#if defined(__linux__)
+        if(aBlock.mMapped)
+        {
+            munmap(aBlock.mData, aBlock.mSize);
+            return;
+        }
+#endif
+        ::operator delete(aBlock.mData, std::align_val_t(kCacheLineSize));
+    }
+
+private:
+
+    bool                    mHugePages;
+    std::vector<Block>      mBlocks;
+    std::vector<Destructor> mDestructors;
+    char                    *mCurrent;  //!< Free part of the last small block
+    char                    *mEnd;
+    CategoryStats           mStats[kArenaCategoryCount];
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Standard allocator on a MemoryArena, for the arrays of a scene
+//
+// Without an arena it is the plain heap. Freeing into an arena does
+// nothing, so a growing array leaves its old storage behind: reserve the
+// final size where it is known. Copy assignment keeps the arena of the
+// target, which is how a scene is copied into another arena (Clone).
+template<typename T>
+class ArenaAllocator
+{
+public:
+
+    typedef T               value_type;
+    typedef std::true_type  propagate_on_container_move_assignment;
+    typedef std::true_type  propagate_on_container_swap;
+    typedef std::false_type propagate_on_container_copy_assignment;
+
+    ArenaAllocator(
+        MemoryArena   *aArena    = NULL,
+        ArenaCategory aCategory = kArenaGeometry) :
+        mArena(aArena),
+        mCategory(aCategory)
+    {}
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U> &aOther) :
+        mArena(aOther.mArena),
+        mCategory(aOther.mCategory)
+    {}
+
+    T* allocate(size_t aCount)
+    {
+        if(mArena)
+        {
+            return static_cast<T*>(mArena->Allocate(aCount * sizeof(T),
+                std::max(alignof(T), MemoryArena::kCacheLineSize), mCategory));
+        }
+        return static_cast<T*>(::operator new(aCount * sizeof(T)));
+    }
+
+    void deallocate(T *aData, size_t)
+    {
+        if(!mArena)
+            ::operator delete(aData);
+    }
+
+    template<typename U>
+    bool operator==(const ArenaAllocator<U> &aOther) const { return mArena == aOther.mArena; }
+
+    template<typename U>
+    bool operator!=(const ArenaAllocator<U> &aOther) const { return mArena != aOther.mArena; }
+
+    MemoryArena   *mArena;
+    ArenaCategory mCategory;
+};
+
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T> >;
@@ -0,0 +1,1039 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+#include "math.hpp"
+#include "ray.hpp"
+#include "geometry.hpp"
+#include "arena.hpp"
+#include "stats.hpp"
+
+//////////////////////////////////////////////////////////////////////////
+// Bounding volume hierarchy over the primitives of a GeometryList
+//
+// Built top-down with binned SAH, then stored in one of two forms:
+//  - full precision: binary nodes with float boxes, 32 bytes each, whose
+//    leaves refer to the primitives of the list
+//  - compressed: the same tree with up to four children per node, their
+//    boxes in 8 bits per coordinate relative to the node's box (10 bytes a
+//    child), and leaf triangles as 16-bit vertices relative to the leaf box
+//    with 8-bit indices, shared within the leaf
+// All quantization is rounded outwards, and the test against a quantized
+// triangle widens its edge tests by the worst case error, so it never
+// rejects a triangle that the full precision test hits. The triangles that
+// pass are tested again with their vertices in the list, so the distances
+// and hits are exactly those of the full precision path; traversal only
+// reads the list for these candidates and for spheres.
+class Bvh : public AbstractGeometry
+{
+public:
+
+    enum Precision
+    {
+        kFullPrecision = 0,
+        kCompressed
+    };
+
+    static const int kMaxLeafSize = 8; //!< Primitives, at most 3 * 8 vertices fit the 8-bit indices
+
+    /**
+     * Builds the hierarchy over aList, which it refers to but does not own
+     * Arguments:
+     *  - aArena = where the nodes go, e.g. the scene's, or NULL for the heap
+     *  - aList = the primitives; NULL for an empty hierarchy to copy into (see Clone)
+     */
+    Bvh(
+        MemoryArena  *aArena,
+        GeometryList *aList = NULL,
+        Precision    aPrecision = kFullPrecision) :
+        mList(aList),
+        mPrecision(aPrecision),
+        mBinaryNodeCount(0),
+        mNodes(ArenaAllocator<Node>(aArena, kArenaAccel)),
+        mCompressedNodes(ArenaAllocator<CompressedNode>(aArena, kArenaAccel)),
+        mLeaves(ArenaAllocator<Leaf>(aArena, kArenaAccel)),
+        mPrimitives(ArenaAllocator<int>(aArena, kArenaAccel)),
+        mVertices(ArenaAllocator<uint16_t>(aArena, kArenaAccel)),
+        mIndices(ArenaAllocator<uint8_t>(aArena, kArenaAccel))
+    {
+        if(aList)
+            Build();
+    }
+
+    virtual bool Intersect(
+        const Ray    &aRay,
+        Intersection &oResult) const
+    {
+        const int primitive = (mPrecision == kCompressed) ?
+            TraverseCompressed<false>(aRay, oResult.distance) : TraverseFull<false>(aRay, oResult.distance);
+
+        if(primitive < 0)
+            return false;
+
+        oResult.primitiveID  = primitive;
+        oResult.barycentrics = mList->PrimitiveBarycentrics(aRay, primitive);
+        return true;
+    }
+
+    // Records the distance and primitive only, as GeometryList::IntersectP
+    virtual bool IntersectP(
+        const Ray    &aRay,
+        Intersection &oResult) const
+    {
+        const int primitive = (mPrecision == kCompressed) ?
+            TraverseCompressed<true>(aRay, oResult.distance) : TraverseFull<true>(aRay, oResult.distance);
+
+        if(primitive < 0)
+            return false;
+
+        oResult.primitiveID = primitive;
+        return true;
+    }
+
+    virtual bool Occluded(
+        const Ray &aRay,
+        float     aMaxDistance,
+        int       *aoLastOccluder) const
+    {
+        if(aoLastOccluder && mList->HitsPrimitive(aRay, *aoLastOccluder, aMaxDistance))
+            return true;
+
+        Intersection isect(aMaxDistance);
+        const bool occluded = IntersectP(aRay, isect);
+
+        if(aoLastOccluder)
+            *aoLastOccluder = occluded ? isect.primitiveID : -1;
+        return occluded;
+    }
+
+    virtual void ComputeSurfaceInteraction(
+        const Ray    &aRay,
+        Intersection &aoResult) const
+    {
+        mList->ComputeSurfaceInteraction(aRay, aoResult);
+    }
+
+    virtual void GrowBBox(
+        Vec3f &aoBBoxMin,
+        Vec3f &aoBBoxMax)
+    {
+        mList->GrowBBox(aoBBoxMin, aoBBoxMax);
+    }
+
+    // Copies the list too, both into the given arena
+    virtual AbstractGeometry* Clone(MemoryArena &aoArena) const
+    {
+        // Copy assignment keeps the arena of the new hierarchy
+        Bvh *bvh = aoArena.New<Bvh>(kArenaAccel, &aoArena);
+        *bvh = *this;
+        bvh->mList = static_cast<GeometryList*>(mList->Clone(aoArena));
+        return bvh;
+    }
+
+    Precision GetPrecision() const { return mPrecision; }
+
+    int GetNodeCount() const
+    {
+        return int(mPrecision == kCompressed ? mCompressedNodes.size() : mNodes.size());
+    }
+
+    /**
+     * Bytes a traversal reads: nodes, leaves and the primitive data they are
+     * tested with. The full precision triangles read by the compressed form
+     * for the candidates are not counted, as they stay out of the cache.
+     */
+    uint64_t GetTraversalBytes() const
+    {
+        if(mPrecision == kFullPrecision)
+            return GetFullPrecisionBytes();
+
+        return mCompressedNodes.size() * sizeof(CompressedNode) + mLeaves.size() * sizeof(Leaf) +
+            mPrimitives.size() * sizeof(int) + mIndices.size() + mVertices.size() * sizeof(uint16_t) +
+            uint64_t(mList->GetSphereCount()) * kSphereBytes;
+    }
+
+    // GetTraversalBytes of the same tree in full precision
+    uint64_t GetFullPrecisionBytes() const
+    {
+        return uint64_t(mBinaryNodeCount) * sizeof(Node) + uint64_t(mList->GetTriangleCount()) * kTriangleBytes +
+            uint64_t(mList->GetSphereCount()) * (sizeof(int) + kSphereBytes) +
+            uint64_t(mList->GetTriangleCount()) * sizeof(int);
+    }
+
+    // One line summary, e.g. "compressed BVH, 2470 nodes, 1.1 MB of traversal data (3.4x less than full precision)"
+    std::string Describe() const
+    {
+        std::string text = std::string(mPrecision == kCompressed ? "compressed BVH, " : "BVH, ") +
+            std::to_string(GetNodeCount()) + " nodes, " + MemoryArena::FormatBytes(GetTraversalBytes()) +
+            " of traversal data";
+
+        if(mPrecision == kCompressed)
+        {
+            char ratio[64];
+            snprintf(ratio, sizeof(ratio), " (%.1fx less than full precision)",
+                double(GetFullPrecisionBytes()) / std::max<uint64_t>(1, GetTraversalBytes()));
+            text += ratio;
+        }
+        return text;
+    }
+
+private:
+
+    static const int kBinCount   = 16;
+    static const int kStackSize  = 256;
+    static const int kSahDepth   = 32;  //!< Deeper nodes are split at the median, which bounds the depth
+    static const int kTriangleBytes = 12 * sizeof(float); //!< Vertices and normal in the list
+    static const int kSphereBytes   = 4 * sizeof(float);  //!< Center and radius in the list
+
+    // Full precision node; the two children of an interior node are adjacent
+    struct Node
+    {
+        float mMin[3];
+        int   mOffset; //!< First child of an interior node, first entry of mPrimitives of a leaf
+        float mMax[3];
+        int   mCount;  //!< Primitives of a leaf, 0 for an interior node
+    };
+
+    // Compressed node. Its own box is known from its parent (or is the root
+    // box): child boxes are given in steps of 2^mExponent from its minimum
+    struct CompressedNode
+    {
+        uint8_t  mLo[3][4];      //!< Per axis and child, rounded down
+        uint8_t  mHi[3][4];      //!< Rounded up
+        int8_t   mExponent[3];
+        uint8_t  mChildCount;
+        uint8_t  mInteriorCount; //!< Interior children come first, then leaves
+        uint8_t  mPad[3];
+        uint32_t mFirstNode;     //!< Interior children are consecutive nodes
+        uint32_t mFirstLeaf;     //!< Leaf children are consecutive leaves
+    };
+
+    // Primitives of a compressed leaf, triangles first. Vertices are given in
+    // steps of 2^mExponent from the minimum of the leaf box
+    struct Leaf
+    {
+        uint32_t mFirstPrimitive; //!< In mPrimitives, and times 3 in mIndices
+        uint32_t mFirstVertex;    //!< Times 3 in mVertices
+        int8_t   mExponent[3];
+        uint8_t  mTriangleCount;
+        uint8_t  mPrimitiveCount;
+        uint8_t  mPad[3];
+    };
+
+    // Temporary binary tree of the build
+    struct BuildNode
+    {
+        Vec3f mMin, mMax;
+        int   mLeft;  //!< First of the two adjacent children, -1 for a leaf
+        int   mFirst; //!< Range of the build order
+        int   mCount;
+    };
+
+    //////////////////////////////////////////////////////////////////////////
+    // Quantization, the same in the build and the traversal
+
+    // 2^aExponent, for exponents of normal floats
+    static float Pow2(int aExponent)
+    {
+        const uint32_t bits = uint32_t(aExponent + 127) << 23;
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    // Exact product, so one rounding whether or not it is fused
+    static float Dequantize(
+        float    aOrigin,
+        uint32_t aSteps,
+        float    aStep)
+    {
+        return aOrigin + float(aSteps) * aStep;
+    }
+
+    // Smallest power of two step of which aStepCount steps reach from aLo to aHi
+    static int StepExponent(
+        float aLo,
+        float aHi,
+        int   aStepCount)
+    {
+        int exponent = -126;
+        if(aHi > aLo)
+            std::frexp((double(aHi) - double(aLo)) / aStepCount, &exponent);
+
+        exponent = std::max(-126, std::min(127, exponent));
+        while(exponent < 127 && Dequantize(aLo, aStepCount, Pow2(exponent)) < aHi)
+            exponent++;
+        return exponent;
+    }
+
+    static uint32_t QuantizeDown(
+        float aValue,
+        float aOrigin,
+        float aStep,
+        int   aMaxSteps)
+    {
+        double steps = std::floor((double(aValue) - aOrigin) / aStep);
+        uint32_t q = uint32_t(std::max(0.0, std::min(double(aMaxSteps), steps)));
+
+        while(q > 0 && Dequantize(aOrigin, q, aStep) > aValue)
+            q--;
+        return q;
+    }
+
+    static uint32_t QuantizeUp(
+        float aValue,
+        float aOrigin,
+        float aStep,
+        int   aMaxSteps)
+    {
+        double steps = std::ceil((double(aValue) - aOrigin) / aStep);
+        uint32_t q = uint32_t(std::max(0.0, std::min(double(aMaxSteps), steps)));
+
+        while(q < uint32_t(aMaxSteps) && Dequantize(aOrigin, q, aStep) < aValue)
+            q++;
+        return q;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Build
+
+    void Build()
+    {
+        const int triangleCount  = mList->GetTriangleCount();
+        const int primitiveCount = triangleCount + mList->GetSphereCount();
+        if(primitiveCount == 0)
+            return;
+
+        std::vector<Vec3f> boxMin(primitiveCount), boxMax(primitiveCount), centroids(primitiveCount);
+        std::vector<int>   order(primitiveCount);
+
+        for(int i=0; i<primitiveCount; i++)
+        {
+            boxMin[i] = Vec3f(INFINITY);
+            boxMax[i] = Vec3f(-INFINITY);
+
+            if(i < triangleCount)
+                mList->GetTriangle(i).GrowBBox(boxMin[i], boxMax[i]);
+            else
+                mList->GetSphere(i - triangleCount).GrowBBox(boxMin[i], boxMax[i]);
+
+            centroids[i] = (boxMin[i] + boxMax[i]) * 0.5f;
+            order[i]     = i;
+        }
+
+        std::vector<BuildNode> nodes;
+        BuildTree(boxMin, boxMax, centroids, order, nodes);
+        mBinaryNodeCount = int(nodes.size());
+
+        if(mPrecision == kFullPrecision)
+            EmitFull(nodes, order);
+        else
+            EmitCompressed(nodes, order);
+    }
+
+    void BuildTree(
+        const std::vector<Vec3f> &aBoxMin,
+        const std::vector<Vec3f> &aBoxMax,
+        const std::vector<Vec3f> &aCentroids,
+        std::vector<int>         &aoOrder,
+        std::vector<BuildNode>   &oNodes) const
+    {
+        struct Task { int mNode, mDepth; };
+        std::vector<Task> tasks;
+
+        oNodes.push_back(BuildNode());
+        oNodes[0].mFirst = 0;
+        oNodes[0].mCount = int(aoOrder.size());
+        tasks.push_back(Task{ 0, 0 });
+
+        while(!tasks.empty())
+        {
+            const Task task = tasks.back();
+            tasks.pop_back();
+
+            BuildNode &node = oNodes[task.mNode];
+            node.mLeft = -1;
+
+            // Bounds of the primitives and of their centroids
+            Vec3f centroidMin(INFINITY), centroidMax(-INFINITY);
+            node.mMin = Vec3f(INFINITY);
+            node.mMax = Vec3f(-INFINITY);
+
+            for(int i=node.mFirst; i<node.mFirst + node.mCount; i++)
+            {
+                const int p = aoOrder[i];
+                for(int k=0; k<3; k++)
+                {
+                    node.mMin.Get(k) = std::min(node.mMin.Get(k), aBoxMin[p].Get(k));
+                    node.mMax.Get(k) = std::max(node.mMax.Get(k), aBoxMax[p].Get(k));
+                    centroidMin.Get(k) = std::min(centroidMin.Get(k), aCentroids[p].Get(k));
+                    centroidMax.Get(k) = std::max(centroidMax.Get(k), aCentroids[p].Get(k));
+                }
+            }
+
+            if(node.mCount <= 2)
+                continue;
+
+            int axis = 0;
+            const Vec3f extent = centroidMax - centroidMin;
+            if(extent.y > extent.Get(axis)) axis = 1;
+            if(extent.z > extent.Get(axis)) axis = 2;
+
+            int *first = &aoOrder[node.mFirst];
+            int *last  = first + node.mCount;
+            int *middle = NULL;
+
+            if(extent.Get(axis) > 0.f && task.mDepth < kSahDepth)
+            {
+                // Binned SAH; a leaf when that is cheaper (and small enough)
+                const float scale = kBinCount / extent.Get(axis);
+                auto binOf = [&](int aPrimitive)
+                {
+                    return std::min(kBinCount - 1, int((aCentroids[aPrimitive].Get(axis) - centroidMin.Get(axis)) * scale));
+                };
+
+                int   binCounts[kBinCount] = { 0 };
+                Vec3f binMin[kBinCount], binMax[kBinCount];
+                for(int b=0; b<kBinCount; b++)
+                {
+                    binMin[b] = Vec3f(INFINITY);
+                    binMax[b] = Vec3f(-INFINITY);
+                }
+
+                for(int *p=first; p<last; p++)
+                {
+                    const int b = binOf(*p);
+                    binCounts[b]++;
+                    for(int k=0; k<3; k++)
+                    {
+                        binMin[b].Get(k) = std::min(binMin[b].Get(k), aBoxMin[*p].Get(k));
+                        binMax[b].Get(k) = std::max(binMax[b].Get(k), aBoxMax[*p].Get(k));
+                    }
+                }
+
+                // Area times count of everything left of each split, then right of it
+                float leftCost[kBinCount];
+                Vec3f boundsMin(INFINITY), boundsMax(-INFINITY);
+                int   count = 0;
+                for(int b=0; b<kBinCount - 1; b++)
+                {
+                    Grow(boundsMin, boundsMax, binMin[b], binMax[b]);
+                    count += binCounts[b];
+                    leftCost[b] = count > 0 ? HalfArea(boundsMin, boundsMax) * count : 0.f;
+                }
+
+                float bestCost = INFINITY;
+                int   bestSplit = -1;
+                boundsMin = Vec3f(INFINITY);
+                boundsMax = Vec3f(-INFINITY);
+                count = 0;
+                for(int b=kBinCount - 1; b>0; b--)
+                {
+                    Grow(boundsMin, boundsMax, binMin[b], binMax[b]);
+                    count += binCounts[b];
+
+                    const float cost = leftCost[b - 1] + (count > 0 ? HalfArea(boundsMin, boundsMax) * count : 0.f);
+                    if(count > 0 && count < node.mCount && cost < bestCost)
+                    {
+                        bestCost  = cost;
+                        bestSplit = b;
+                    }
+                }
+
+                // Costs relative to one primitive test, a node visit counts as one too
+                const float nodeArea = HalfArea(node.mMin, node.mMax);
+                const float splitCost = 1.f + (nodeArea > 0.f ? bestCost / nodeArea : 0.f);
+                if(node.mCount <= kMaxLeafSize && (bestSplit < 0 || float(node.mCount) <= splitCost))
+                    continue;
+
+                if(bestSplit > 0)
+                    middle = std::partition(first, last, [&](int aPrimitive) { return binOf(aPrimitive) < bestSplit; });
+            }
+            else if(node.mCount <= kMaxLeafSize && extent.Get(axis) <= 0.f)
+                continue; // all centroids in one point, splitting does not help
+
+            if(!middle || middle == first || middle == last)
+            {
+                // Object median, for deep nodes and when the bins do not separate
+                middle = first + node.mCount / 2;
+                std::nth_element(first, middle, last, [&](int aA, int aB)
+                {
+                    return aCentroids[aA].Get(axis) < aCentroids[aB].Get(axis);
+                });
+            }
+
+            const int left  = int(oNodes.size());
+            const int split = int(middle - first);
+            const int depth = task.mDepth;
+
+            BuildNode child;
+            child.mFirst = node.mFirst;
+            child.mCount = split;
+            oNodes.push_back(child);
+            child.mFirst = oNodes[task.mNode].mFirst + split;
+            child.mCount = oNodes[task.mNode].mCount - split;
+            oNodes.push_back(child);
+
+            oNodes[task.mNode].mLeft = left; // node is invalid after push_back
+            tasks.push_back(Task{ left + 1, depth + 1 });
+            tasks.push_back(Task{ left, depth + 1 });
+        }
+    }
+
+    // The binary tree as it is
+    void EmitFull(
+        const std::vector<BuildNode> &aNodes,
+        const std::vector<int>       &aOrder)
+    {
+        mNodes.reserve(aNodes.size());
+        for(size_t i=0; i<aNodes.size(); i++)
+        {
+            Node node;
+            for(int k=0; k<3; k++)
+            {
+                node.mMin[k] = aNodes[i].mMin.Get(k);
+                node.mMax[k] = aNodes[i].mMax.Get(k);
+            }
+            node.mOffset = aNodes[i].mLeft >= 0 ? aNodes[i].mLeft : aNodes[i].mFirst;
+            node.mCount  = aNodes[i].mLeft >= 0 ? 0 : aNodes[i].mCount;
+            mNodes.push_back(node);
+        }
+
+        mPrimitives.assign(aOrder.begin(), aOrder.end());
+    }
+
+    // Subtrees of at most kMaxLeafSize primitives become one compressed leaf:
+    // the quantized tests are cheap, and larger leaves share more vertices
+    static bool IsCompressedInterior(const BuildNode &aNode)
+    {
+        return aNode.mLeft >= 0 && aNode.mCount > kMaxLeafSize;
+    }
+
+    // Up to four children per node, by opening the largest interior children
+    void EmitCompressed(
+        const std::vector<BuildNode> &aNodes,
+        const std::vector<int>       &aOrder)
+    {
+        struct Task { int mNode, mBuildNode; Vec3f mMin, mMax; };
+
+        std::vector<CompressedNode> nodes(1);
+        std::vector<Leaf>           leaves;
+        std::vector<int>            primitives;
+        std::vector<uint16_t>       vertices;
+        std::vector<uint8_t>        indices;
+
+        mRootMin = aNodes[0].mMin;
+        mRootMax = aNodes[0].mMax;
+
+        std::vector<Task> tasks;
+        tasks.push_back(Task{ 0, 0, mRootMin, mRootMax });
+
+        while(!tasks.empty())
+        {
+            const Task task = tasks.back();
+            tasks.pop_back();
+
+            // A leaf at the root becomes the only child of the root
+            int children[4];
+            int childCount = 0;
+            if(!IsCompressedInterior(aNodes[task.mBuildNode]))
+                children[childCount++] = task.mBuildNode;
+            else
+            {
+                children[childCount++] = aNodes[task.mBuildNode].mLeft;
+                children[childCount++] = aNodes[task.mBuildNode].mLeft + 1;
+            }
+
+            while(childCount < 4)
+            {
+                int largest = -1;
+                for(int c=0; c<childCount; c++)
+                {
+                    const BuildNode &child = aNodes[children[c]];
+                    if(IsCompressedInterior(child) && (largest < 0 ||
+                        HalfArea(child.mMin, child.mMax) > HalfArea(aNodes[children[largest]].mMin, aNodes[children[largest]].mMax)))
+                        largest = c;
+                }
+
+                if(largest < 0)
+                    break;
+
+                const int opened = children[largest];
+                children[largest]         = aNodes[opened].mLeft;
+                children[childCount++]    = aNodes[opened].mLeft + 1;
+            }
+
+            std::stable_partition(children, children + childCount, [&](int aChild) { return IsCompressedInterior(aNodes[aChild]); });
+
+            CompressedNode node;
+            memset(&node, 0, sizeof(node));
+            node.mChildCount = uint8_t(childCount);
+            node.mFirstNode  = uint32_t(nodes.size());
+            node.mFirstLeaf  = uint32_t(leaves.size());
+
+            float step[3];
+            for(int k=0; k<3; k++)
+            {
+                node.mExponent[k] = int8_t(StepExponent(task.mMin.Get(k), task.mMax.Get(k), 255));
+                step[k] = Pow2(node.mExponent[k]);
+            }
+
+            for(int c=0; c<childCount; c++)
+            {
+                const BuildNode &child = aNodes[children[c]];
+
+                // The box as the traversal decodes it, around the child's primitives
+                Vec3f childMin, childMax;
+                for(int k=0; k<3; k++)
+                {
+                    node.mLo[k][c] = uint8_t(QuantizeDown(child.mMin.Get(k), task.mMin.Get(k), step[k], 255));
+                    node.mHi[k][c] = uint8_t(QuantizeUp(child.mMax.Get(k), task.mMin.Get(k), step[k], 255));
+                    childMin.Get(k) = Dequantize(task.mMin.Get(k), node.mLo[k][c], step[k]);
+                    childMax.Get(k) = Dequantize(task.mMin.Get(k), node.mHi[k][c], step[k]);
+                }
+
+                if(IsCompressedInterior(child))
+                {
+                    node.mInteriorCount++;
+                    tasks.push_back(Task{ int(nodes.size()), children[c], childMin, childMax });
+                    nodes.push_back(CompressedNode());
+                }
+                else
+                    EmitLeaf(child, aOrder, childMin, childMax, leaves, primitives, vertices, indices);
+            }
+
+            nodes[task.mNode] = node;
+        }
+
+        AssignExact(mCompressedNodes, nodes);
+        AssignExact(mLeaves, leaves);
+        AssignExact(mPrimitives, primitives);
+        AssignExact(mVertices, vertices);
+        AssignExact(mIndices, indices);
+    }
+
+    void EmitLeaf(
+        const BuildNode       &aNode,
+        const std::vector<int> &aOrder,
+        const Vec3f           &aMin,
+        const Vec3f           &aMax,
+        std::vector<Leaf>     &aoLeaves,
+        std::vector<int>      &aoPrimitives,
+        std::vector<uint16_t> &aoVertices,
+        std::vector<uint8_t>  &aoIndices) const
+    {
+        const int triangleCount = mList->GetTriangleCount();
+
+        Leaf leaf;
+        memset(&leaf, 0, sizeof(leaf));
+        leaf.mFirstPrimitive = uint32_t(aoPrimitives.size());
+        leaf.mFirstVertex    = uint32_t(aoVertices.size() / 3);
+        leaf.mPrimitiveCount = uint8_t(aNode.mCount);
+
+        float step[3];
+        for(int k=0; k<3; k++)
+        {
+            leaf.mExponent[k] = int8_t(StepExponent(aMin.Get(k), aMax.Get(k), 65535));
+            step[k] = Pow2(leaf.mExponent[k]);
+        }
+
+        // Triangles first, then spheres
+        for(int pass=0; pass<2; pass++)
+        {
+            for(int i=aNode.mFirst; i<aNode.mFirst + aNode.mCount; i++)
+            {
+                const int  primitive  = aOrder[i];
+                const bool isTriangle = primitive < triangleCount;
+                if(isTriangle != (pass == 0))
+                    continue;
+
+                aoPrimitives.push_back(primitive);
+                if(!isTriangle)
+                {
+                    aoIndices.insert(aoIndices.end(), 3, uint8_t(0));
+                    continue;
+                }
+
+                leaf.mTriangleCount++;
+                const Triangle triangle = mList->GetTriangle(primitive);
+
+                // Nearest steps; vertices that quantize alike are stored once
+                for(int v=0; v<3; v++)
+                {
+                    uint16_t q[3];
+                    for(int k=0; k<3; k++)
+                    {
+                        const double steps = std::floor((double(triangle.p[v].Get(k)) - aMin.Get(k)) / step[k] + 0.5);
+                        q[k] = uint16_t(std::max(0.0, std::min(65535.0, steps)));
+                    }
+
+                    const size_t first = size_t(leaf.mFirstVertex) * 3;
+                    size_t index = 0;
+                    while(first + index * 3 < aoVertices.size() && memcmp(&aoVertices[first + index * 3], q, sizeof(q)) != 0)
+                        index++;
+
+                    if(first + index * 3 == aoVertices.size())
+                        aoVertices.insert(aoVertices.end(), q, q + 3);
+                    aoIndices.push_back(uint8_t(index));
+                }
+            }
+        }
+
+        aoLeaves.push_back(leaf);
+    }
+
+    template<typename T>
+    static void AssignExact(
+        ArenaVector<T>       &aoTarget,
+        const std::vector<T> &aSource)
+    {
+        aoTarget.reserve(aSource.size());
+        aoTarget.assign(aSource.begin(), aSource.end());
+    }
+
+    static float HalfArea(
+        const Vec3f &aMin,
+        const Vec3f &aMax)
+    {
+        const Vec3f d = aMax - aMin;
+        return d.x * d.y + d.y * d.z + d.z * d.x;
+    }
+
+    static void Grow(
+        Vec3f       &aoMin,
+        Vec3f       &aoMax,
+        const Vec3f &aOtherMin,
+        const Vec3f &aOtherMax)
+    {
+        for(int k=0; k<3; k++)
+        {
+            aoMin.Get(k) = std::min(aoMin.Get(k), aOtherMin.Get(k));
+            aoMax.Get(k) = std::max(aoMax.Get(k), aOtherMax.Get(k));
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Traversal
+
+    // Distance at which the ray enters the box, INFINITY when it misses it or
+    // enters beyond aMaxDistance. The slab distances are rounded outwards, so
+    // that hits on the faces (e.g. at shared edges) and rays along them are
+    // not lost; a NaN slab (origin on a face, the ray parallel to it) does
+    // not clip
+    static float BoxEntry(
+        const Vec3f &aOrigin,
+        const Vec3f &aInvDirection,
+        const float *aMin,
+        const float *aMax,
+        float       aMaxDistance)
+    {
+        const float roundDown = 1.f - 4.f * FLT_EPSILON;
+        const float roundUp   = 1.f + 4.f * FLT_EPSILON;
+
+        float tNear = 0.f;
+        float tFar  = aMaxDistance;
+        for(int k=0; k<3; k++)
+        {
+            const float t0 = (aMin[k] - aOrigin.Get(k)) * aInvDirection.Get(k);
+            const float t1 = (aMax[k] - aOrigin.Get(k)) * aInvDirection.Get(k);
+            if((t0 != t0) | (t1 != t1))
+                continue;
+
+            const float slabNear = std::min(t0, t1) * roundDown;
+            const float slabFar  = std::max(t0, t1) * roundUp;
+
+            tNear = slabNear > tNear ? slabNear : tNear;
+            tFar  = slabFar  < tFar  ? slabFar  : tFar;
+        }
+
+        return tNear <= tFar ? tNear : INFINITY;
+    }
+
+    static Vec3f InvDirection(const Ray &aRay)
+    {
+        return Vec3f(1.f / aRay.direction.x, 1.f / aRay.direction.y, 1.f / aRay.direction.z);
+    }
+
+    /**
+     * Closest hit (or with tAnyHit any hit) closer than aoDistance
+     * Returns:
+     *  - the primitive, -1 for none; aoDistance becomes its distance
+     */
+    template<bool tAnyHit>
+    int TraverseFull(
+        const Ray &aRay,
+        float     &aoDistance) const
+    {
+        if(mNodes.empty())
+            return -1;
+
+        const Vec3f invDirection = InvDirection(aRay);
+        if(BoxEntry(aRay.origin, invDirection, mNodes[0].mMin, mNodes[0].mMax, aoDistance) == INFINITY)
+            return -1;
+
+        struct Entry { int mNode; float mDistance; };
+        Entry stack[kStackSize];
+        int   stackSize = 0;
+        int   node = 0;
+        int   hit  = -1;
+
+        for(;;)
+        {
+            const Node &current = mNodes[node];
+            PG3_STAT_ADD(kStatNodeVisits, 1);
+
+            if(current.mCount > 0)
+            {
+                PG3_STAT_ADD(kStatPrimitiveTests, current.mCount);
+
+                for(int i=0; i<current.mCount; i++)
+                {
+                    const int   primitive = mPrimitives[current.mOffset + i];
+                    const float distance  = mList->PrimitiveDistance(aRay, primitive);
+
+                    if((distance > aRay.offset) & (distance < aoDistance))
+                    {
+                        aoDistance = distance;
+                        hit = primitive;
+                        if(tAnyHit)
+                            return hit;
+                    }
+                }
+            }
+            else
+            {
+                const Node  &left  = mNodes[current.mOffset];
+                const Node  &right = mNodes[current.mOffset + 1];
+                const float tLeft  = BoxEntry(aRay.origin, invDirection, left.mMin, left.mMax, aoDistance);
+                const float tRight = BoxEntry(aRay.origin, invDirection, right.mMin, right.mMax, aoDistance);
+
+                if(tLeft != INFINITY && tRight != INFINITY)
+                {
+                    // The nearer first, the other later unless a hit comes before it
+                    const bool leftFirst = tLeft <= tRight;
+                    stack[stackSize++] = Entry{ current.mOffset + (leftFirst ? 1 : 0), leftFirst ? tRight : tLeft };
+                    node = current.mOffset + (leftFirst ? 0 : 1);
+                    continue;
+                }
+
+                if(tLeft != INFINITY || tRight != INFINITY)
+                {
+                    node = current.mOffset + (tLeft != INFINITY ? 0 : 1);
+                    continue;
+                }
+            }
+
+            do
+            {
+                if(stackSize == 0)
+                    return hit;
+                stackSize--;
+            }
+            while(stack[stackSize].mDistance >= aoDistance);
+
+            node = stack[stackSize].mNode;
+        }
+    }
+
+    // As TraverseFull, over the compressed nodes
+    template<bool tAnyHit>
+    int TraverseCompressed(
+        const Ray &aRay,
+        float     &aoDistance) const
+    {
+        if(mCompressedNodes.empty())
+            return -1;
+
+        const Vec3f invDirection = InvDirection(aRay);
+        if(BoxEntry(aRay.origin, invDirection, &mRootMin.x, &mRootMax.x, aoDistance) == INFINITY)
+            return -1;
+
+        // Nodes carry the minimum of their box, the origin of their quantization
+        struct Entry { uint32_t mNode; float mDistance; Vec3f mMin; };
+        Entry    stack[kStackSize];
+        int      stackSize = 0;
+        uint32_t node = 0;
+        Vec3f    nodeMin = mRootMin;
+        int      hit = -1;
+
+        for(;;)
+        {
+            const CompressedNode &current = mCompressedNodes[node];
+            PG3_STAT_ADD(kStatNodeVisits, 1);
+
+            const float step[3] = { Pow2(current.mExponent[0]), Pow2(current.mExponent[1]), Pow2(current.mExponent[2]) };
+
+            float childMin[4][3], childMax[4][3], entry[4];
+            for(int c=0; c<current.mChildCount; c++)
+            {
+                for(int k=0; k<3; k++)
+                {
+                    childMin[c][k] = Dequantize(nodeMin.Get(k), current.mLo[k][c], step[k]);
+                    childMax[c][k] = Dequantize(nodeMin.Get(k), current.mHi[k][c], step[k]);
+                }
+                entry[c] = BoxEntry(aRay.origin, invDirection, childMin[c], childMax[c], aoDistance);
+            }
+
+            // Leaves first, a hit there culls the nodes
+            for(int c=current.mInteriorCount; c<current.mChildCount; c++)
+            {
+                if(entry[c] >= aoDistance)
+                    continue;
+
+                const Leaf &leaf = mLeaves[current.mFirstLeaf + c - current.mInteriorCount];
+                if(IntersectLeaf<tAnyHit>(aRay, leaf, childMin[c], childMax[c], aoDistance, hit) && tAnyHit)
+                    return hit;
+            }
+
+            // Interior children nearest first: the others go on the stack, farthest at the bottom
+            int order[4];
+            int count = 0;
+            for(int c=0; c<current.mInteriorCount; c++)
+            {
+                if(entry[c] >= aoDistance)
+                    continue;
+
+                int i = count++;
+                for(; i>0 && entry[order[i - 1]] < entry[c]; i--)
+                    order[i] = order[i - 1];
+                order[i] = c;
+            }
+
+            for(int i=0; i<count - 1; i++)
+            {
+                const int c = order[i];
+                stack[stackSize++] = Entry{ current.mFirstNode + c, entry[c],
+                    Vec3f(childMin[c][0], childMin[c][1], childMin[c][2]) };
+            }
+
+            if(count > 0)
+            {
+                const int c = order[count - 1];
+                node    = current.mFirstNode + c;
+                nodeMin = Vec3f(childMin[c][0], childMin[c][1], childMin[c][2]);
+                continue;
+            }
+
+            do
+            {
+                if(stackSize == 0)
+                    return hit;
+                stackSize--;
+            }
+            while(stack[stackSize].mDistance >= aoDistance);
+
+            node    = stack[stackSize].mNode;
+            nodeMin = stack[stackSize].mMin;
+        }
+    }
+
+    /**
+     * Tests the primitives of a compressed leaf with box aMin, aMax
+     * Returns:
+     *  - whether a closer hit was found; it is in aoDistance and aoHit
+     */
+    template<bool tAnyHit>
+    bool IntersectLeaf(
+        const Ray   &aRay,
+        const Leaf  &aLeaf,
+        const float *aMin,
+        const float *aMax,
+        float       &aoDistance,
+        int         &aoHit) const
+    {
+        PG3_STAT_ADD(kStatPrimitiveTests, aLeaf.mPrimitiveCount);
+
+        const float step[3] = { Pow2(aLeaf.mExponent[0]), Pow2(aLeaf.mExponent[1]), Pow2(aLeaf.mExponent[2]) };
+
+        // Bound of the error of a vertex coordinate: half a step from the
+        // rounding to the nearest step, and the rounding of the dequantization
+        float magnitude = 0.f;
+        for(int k=0; k<3; k++)
+            magnitude = std::max(magnitude, std::max(std::abs(aMin[k]), std::abs(aMax[k])));
+        const float error = std::max(step[0], std::max(step[1], step[2])) + magnitude * (2.f * FLT_EPSILON);
+
+        const float directionNorm = std::abs(aRay.direction.x) + std::abs(aRay.direction.y) + std::abs(aRay.direction.z);
+
+        // Largest difference of an edge test of the quantized triangle from the full precision one,
+        // for the vertices aA and aB relative to the ray origin with L1 norms aNormA and aNormB:
+        // the first and second order terms of the vertex errors and a margin for the float rounding
+        // of both tests
+        auto tolerance = [error, directionNorm](float aNormA, float aNormB)
+        {
+            return directionNorm * (error * (aNormA + aNormB) + 2.f * error * error +
+                (16.f * FLT_EPSILON) * (aNormA + 3.f * error) * (aNormB + 3.f * error));
+        };
+
+        bool found = false;
+        const uint16_t *vertices = mVertices.data() + size_t(aLeaf.mFirstVertex) * 3;
+        const uint8_t  *indices  = mIndices.data() + size_t(aLeaf.mFirstPrimitive) * 3;
+
+        for(int i=0; i<aLeaf.mPrimitiveCount; i++)
+        {
+            const int primitive = mPrimitives[aLeaf.mFirstPrimitive + i];
+
+            if(i < aLeaf.mTriangleCount)
+            {
+                float p[3][3], norm[3];
+                for(int v=0; v<3; v++)
+                {
+                    const uint16_t *q = &vertices[indices[i * 3 + v] * 3];
+                    norm[v] = 0.f;
+                    for(int k=0; k<3; k++)
+                    {
+                        p[v][k] = Dequantize(aMin[k], q[k], step[k]);
+                        norm[v] += std::abs(p[v][k] - aRay.origin.Get(k));
+                    }
+                }
+
+                float v0d, v1d, v2d;
+                TriangleEdgeTests(aRay, p[0][0], p[0][1], p[0][2], p[1][0], p[1][1], p[1][2],
+                    p[2][0], p[2][1], p[2][2], v0d, v1d, v2d);
+
+                // v0d is made of the 2nd and 3rd vertex, and so on
+                const float t0 = tolerance(norm[1], norm[2]);
+                const float t1 = tolerance(norm[0], norm[1]);
+                const float t2 = tolerance(norm[0], norm[2]);
+
+                const bool candidate =
+                    ((v0d <= t0) & (v1d <= t1) & (v2d <= t2)) |
+                    ((v0d >= -t0) & (v1d >= -t1) & (v2d >= -t2));
+
+                if(!candidate)
+                    continue;
+            }
+
+            const float distance = mList->PrimitiveDistance(aRay, primitive);
+            if((distance > aRay.offset) & (distance < aoDistance))
+            {
+                aoDistance = distance;
+                aoHit = primitive;
+                found = true;
+                if(tAnyHit)
+                    return true;
+            }
+        }
+
+        return found;
+    }
+
+private:
+
+    GeometryList *mList;
+    Precision    mPrecision;
+    int          mBinaryNodeCount; //!< Of the build, for GetFullPrecisionBytes
+    Vec3f        mRootMin;         //!< Box of all primitives, for the compressed nodes
+    Vec3f        mRootMax;
+
+    ArenaVector<Node>           mNodes;           //!< Full precision, the root first
+    ArenaVector<CompressedNode> mCompressedNodes; //!< Compressed, the root first
+    ArenaVector<Leaf>           mLeaves;
+    ArenaVector<int>            mPrimitives;      //!< Primitive IDs of the list, leaf after leaf
+    ArenaVector<uint16_t>       mVertices;        //!< x, y, z of the compressed leaves
+    ArenaVector<uint8_t>        mIndices;         //!< 3 per entry of mPrimitives, into the leaf's vertices
+};
@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <cmath>
+#include <algorithm>
 #include "math.hpp"
 #include "ray.hpp"
 
@@ -48,6 +49,13 @@ public:
 
         const float tanHalfAngle = std::tan(aHorizontalFOV * PI_F / 360.f);
         mPixelArea = 4.f * Sqr(tanHalfAngle) / Sqr(aResolution.x);
+
+        // Raster positions map to points on the near plane, so the ray direction (before
+        // normalization) is affine in them: no matrix transform nor projective divide per ray
+        const Vec3f corner = RasterToWorld(Vec2f(0.f, 0.f));
+        mDirectionBase = corner - aPosition;
+        mDirectionDx   = (RasterToWorld(Vec2f(aResolution.x, 0.f)) - corner) * (1.f / aResolution.x);
+        mDirectionDy   = (RasterToWorld(Vec2f(0.f, aResolution.y)) - corner) * (1.f / aResolution.y);
     }
 
     int RasterToIndex(const Vec2f &aPixelCoords) const
@@ -82,15 +90,134 @@ public:
 
     Ray GenerateRay(const Vec2f &aRasterXY) const
     {
-        const Vec3f worldRaster = RasterToWorld(aRasterXY);
+        float length;
 
         Ray res;
         res.origin  = mPosition;
-        res.direction  = Normalize(worldRaster - mPosition);
+        res.direction  = RasterToDirection(aRasterXY, length);
         res.offset = 0;
         return res;
     }
 
+    // Also returns the derivatives of the direction per pixel
+    Ray GenerateRay(
+        const Vec2f     &aRasterXY,
+        RayDifferential &oDifferential) const
+    {
+        float length;
+
+        Ray res;
+        res.origin  = mPosition;
+        res.direction  = RasterToDirection(aRasterXY, length);
+        res.offset = 0;
+
+        oDifferential.directionDx = DirectionDerivative(res.direction, mDirectionDx, length);
+        oDifferential.directionDy = DirectionDerivative(res.direction, mDirectionDy, length);
+        return res;
+    }
+
+    /**
+     * Generates the rays through many raster positions at once, e.g. the samples of a row or a tile,
+     * with the same results as GenerateRay with differentials
+     * Arguments:
+     *  - aRasterX, aRasterY = aCount raster positions
+     *  - aoRays = gets the rays at indices 0 .. aCount - 1, grown when too small
+     */
+    void GenerateRays(
+        const float *aRasterX,
+        const float *aRasterY,
+        int         aCount,
+        RayBuffer   &aoRays) const
+    {
+        if(aoRays.Size() < aCount)
+            aoRays.Resize(aCount);
+
+        const int kBlockSize = 64;
+
+        for(int first=0; first<aCount; first+=kBlockSize)
+        {
+            const int count = std::min(kBlockSize, aCount - first);
+
+            const float *x = aRasterX + first;
+            const float *y = aRasterY + first;
+
+            float *ox  = &aoRays.mOriginX[first],     *oy  = &aoRays.mOriginY[first],     *oz  = &aoRays.mOriginZ[first];
+            float *dx  = &aoRays.mDirectionX[first],  *dy  = &aoRays.mDirectionY[first],  *dz  = &aoRays.mDirectionZ[first];
+            float *dxx = &aoRays.mDirectionDxX[first], *dxy = &aoRays.mDirectionDxY[first], *dxz = &aoRays.mDirectionDxZ[first];
+            float *dyx = &aoRays.mDirectionDyX[first], *dyy = &aoRays.mDirectionDyY[first], *dyz = &aoRays.mDirectionDyZ[first];
+            float *offset = &aoRays.mOffset[first];
+
+            float lengths[kBlockSize];
+
+#pragma omp simd
+            for(int i=0; i<count; i++)
+            {
+                dx[i] = mDirectionBase.x + mDirectionDx.x * x[i] + mDirectionDy.x * y[i];
+                dy[i] = mDirectionBase.y + mDirectionDx.y * x[i] + mDirectionDy.y * y[i];
+                dz[i] = mDirectionBase.z + mDirectionDx.z * x[i] + mDirectionDy.z * y[i];
+
+                lengths[i] = dx[i] * dx[i] + dy[i] * dy[i] + dz[i] * dz[i];
+            }
+
+            // Kept apart, as a square root with errno semantics does not vectorize
+            for(int i=0; i<count; i++)
+                lengths[i] = std::sqrt(lengths[i]);
+
+#pragma omp simd
+            for(int i=0; i<count; i++)
+            {
+                dx[i] = dx[i] / lengths[i];
+                dy[i] = dy[i] / lengths[i];
+                dz[i] = dz[i] / lengths[i];
+
+                const float dotDx = dx[i] * mDirectionDx.x + dy[i] * mDirectionDx.y + dz[i] * mDirectionDx.z;
+                const float dotDy = dx[i] * mDirectionDy.x + dy[i] * mDirectionDy.y + dz[i] * mDirectionDy.z;
+
+                dxx[i] = (mDirectionDx.x - dx[i] * dotDx) / lengths[i];
+                dxy[i] = (mDirectionDx.y - dy[i] * dotDx) / lengths[i];
+                dxz[i] = (mDirectionDx.z - dz[i] * dotDx) / lengths[i];
+                dyx[i] = (mDirectionDy.x - dx[i] * dotDy) / lengths[i];
+                dyy[i] = (mDirectionDy.y - dy[i] * dotDy) / lengths[i];
+                dyz[i] = (mDirectionDy.z - dz[i] * dotDy) / lengths[i];
+
+                ox[i] = mPosition.x;
+                oy[i] = mPosition.y;
+                oz[i] = mPosition.z;
+                offset[i] = 0.f;
+            }
+        }
+    }
+
+private:
+
+    // Normalized direction through the raster position, with the length it had before.
+    // Written out per component, in the order of the vectorized loops of GenerateRays
+    Vec3f RasterToDirection(
+        const Vec2f &aRasterXY,
+        float       &oLength) const
+    {
+        const float x = mDirectionBase.x + mDirectionDx.x * aRasterXY.x + mDirectionDy.x * aRasterXY.y;
+        const float y = mDirectionBase.y + mDirectionDx.y * aRasterXY.x + mDirectionDy.y * aRasterXY.y;
+        const float z = mDirectionBase.z + mDirectionDx.z * aRasterXY.x + mDirectionDy.z * aRasterXY.y;
+
+        oLength = std::sqrt(x * x + y * y + z * z);
+        return Vec3f(x / oLength, y / oLength, z / oLength);
+    }
+
+    // Derivative of the normalized direction aDirection when its unnormalized form changes by aChange
+    static Vec3f DirectionDerivative(
+        const Vec3f &aDirection,
+        const Vec3f &aChange,
+        float       aLength)
+    {
+        const float dot = aDirection.x * aChange.x + aDirection.y * aChange.y + aDirection.z * aChange.z;
+
+        return Vec3f(
+            (aChange.x - aDirection.x * dot) / aLength,
+            (aChange.y - aDirection.y * dot) / aLength,
+            (aChange.z - aDirection.z * dot) / aLength);
+    }
+
 public:
 
     Vec3f mPosition;
@@ -99,4 +226,7 @@ public:
     Mat4f mRasterToWorld;
     Mat4f mWorldToRaster;
     float mPixelArea;
+    Vec3f mDirectionBase; //!< Unnormalized direction through raster position (0, 0)
+    Vec3f mDirectionDx;   //!< Its change per raster pixel in x
+    Vec3f mDirectionDy;   //!< And in y
 };
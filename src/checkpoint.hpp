@@ -0,0 +1,272 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <string.h>
+#include <stdint.h>
+#include <condition_variable>
+#include "renderer.hpp"
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// Periodic checkpoints of the render state
+//
+// A checkpoint holds the state of every renderer (accumulated framebuffer,
+// iteration count, random generator) and a hash of the configuration. The
+// renderers are independent, so each one is captured at its own iteration
+// boundary; the protocol is the same as in PreviewWriter. A thread that
+// has run out of iterations leaves its final state, which then answers all
+// later requests. Files are written to a temporary name, synced and renamed,
+// so a checkpoint on disk is always complete.
+class Checkpointer
+{
+public:
+
+    /**
+     * Arguments:
+     *  - aSlotCount = number of render threads (renderers)
+     *  - aConfigHash = refuses checkpoints of different setups on load
+     *  - aInterval = seconds between two checkpoints
+     */
+    Checkpointer(
+        int               aSlotCount,
+        uint64_t          aConfigHash,
+        const std::string &aFilename,
+        float             aInterval) :
+        mSlots(aSlotCount),
+        mConfigHash(aConfigHash),
+        mFilename(aFilename),
+        mInterval(aInterval),
+        mRequest(0),
+        mStop(false),
+        mCheckpointCount(0)
+    {
+        for(size_t i=0; i<mSlots.size(); i++)
+            mSlots[i].mPublished.store(0);
+    }
+
+    ~Checkpointer()
+    {
+        Stop();
+    }
+
+    void Start()
+    {
+        mThread = std::thread(&Checkpointer::Run, this);
+    }
+
+    // Stops the background thread, a checkpoint in progress is still finished
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mWakeUp.notify_all();
+
+        if(mThread.joinable())
+            mThread.join();
+    }
+
+    // Called by render thread aSlot after each iteration
+    void Poll(
+        int                    aSlot,
+        const AbstractRenderer &aRenderer)
+    {
+        Slot &slot = mSlots[aSlot];
+        const int request = mRequest.load(std::memory_order_acquire);
+
+        if(request == slot.mPublished.load(std::memory_order_relaxed))
+            return;
+
+        slot.mState = Serialize(aRenderer);
+        slot.mPublished.store(request, std::memory_order_release);
+    }
+
+    // Called by render thread aSlot when it has no more iterations to run
+    void Finish(
+        int                    aSlot,
+        const AbstractRenderer &aRenderer)
+    {
+        // A separate buffer, the background thread may be reading mState right now
+        Slot &slot = mSlots[aSlot];
+        slot.mFinalState = Serialize(aRenderer);
+        slot.mPublished.store(kFinished, std::memory_order_release);
+    }
+
+    int GetCheckpointCount() const { return mCheckpointCount; }
+
+    /**
+     * Restores renderers from a checkpoint file
+     * Returns:
+     *  - false when the file is missing, damaged, or from a different configuration;
+     *    the renderers may then be partially overwritten and must be set up again
+     */
+    static bool Load(
+        const std::string &aFilename,
+        uint64_t          aConfigHash,
+        AbstractRenderer  **aoRenderers,
+        int               aRendererCount)
+    {
+        std::ifstream file(aFilename.c_str(), std::ios::binary);
+
+        char     magic[sizeof(kMagic)];
+        uint64_t configHash = 0;
+        int32_t  count = 0;
+
+        file.read(magic, sizeof(magic));
+        file.read(reinterpret_cast<char*>(&configHash), sizeof(configHash));
+        file.read(reinterpret_cast<char*>(&count), sizeof(count));
+
+        if(!file || memcmp(magic, kMagic, sizeof(kMagic)) != 0 ||
+            configHash != aConfigHash || count != aRendererCount)
+            return false;
+
+        for(int i=0; i<aRendererCount; i++)
+        {
+            uint64_t size = 0;
+            file.read(reinterpret_cast<char*>(&size), sizeof(size));
+            if(!file)
+                return false;
+
+            std::string state(size_t(size), '\0');
+            file.read(&state[0], std::streamsize(size));
+
+            std::istringstream stream(state);
+            if(!file || !aoRenderers[i]->LoadState(stream))
+                return false;
+        }
+
+        return true;
+    }
+
+private:
+
+    static const int  kFinished = -1;
+    static constexpr char kMagic[8] = { 'P', 'G', '3', 'C', 'K', 'P', 'T', '2' };
+
+    static std::string Serialize(const AbstractRenderer &aRenderer)
+    {
+        std::ostringstream stream;
+        aRenderer.SaveState(stream);
+        return stream.str();
+    }
+
+    void Run()
+    {
+        const auto interval = std::chrono::duration<float>(mInterval);
+        const auto poll     = std::chrono::milliseconds(1);
+
+        std::unique_lock<std::mutex> lock(mMutex);
+
+        for(int request=1; ; request++)
+        {
+            if(mWakeUp.wait_for(lock, interval, [this]{ return mStop; }))
+                return;
+
+            mRequest.store(request, std::memory_order_release);
+
+            // Slots fill in at the next iteration boundary of each thread
+            while(!AllPublished(request))
+            {
+                if(mWakeUp.wait_for(lock, poll, [this]{ return mStop; }))
+                    return;
+            }
+
+            lock.unlock();
+            if(Write())
+                mCheckpointCount++;
+            else
+                printf("\nCannot write checkpoint %s\n", mFilename.c_str());
+            lock.lock();
+        }
+    }
+
+    bool AllPublished(int aRequest) const
+    {
+        for(size_t i=0; i<mSlots.size(); i++)
+        {
+            const int published = mSlots[i].mPublished.load(std::memory_order_acquire);
+            if(published != aRequest && published != kFinished)
+                return false;
+        }
+
+        return true;
+    }
+
+    bool Write()
+    {
+        std::string data(kMagic, sizeof(kMagic));
+        data.append(reinterpret_cast<const char*>(&mConfigHash), sizeof(mConfigHash));
+
+        const int32_t count = int32_t(mSlots.size());
+        data.append(reinterpret_cast<const char*>(&count), sizeof(count));
+
+        for(size_t i=0; i<mSlots.size(); i++)
+        {
+            const bool finished = mSlots[i].mPublished.load(std::memory_order_acquire) == kFinished;
+            const std::string &state = finished ? mSlots[i].mFinalState : mSlots[i].mState;
+
+            const uint64_t size = state.size();
+            data.append(reinterpret_cast<const char*>(&size), sizeof(size));
+            data.append(state);
+        }
+
+        // The old checkpoint is only replaced once the new one is safely on disk
+        const std::string tempName = mFilename + ".tmp";
+
+        FILE *file = fopen(tempName.c_str(), "wb");
+        if(!file)
+            return false;
+
+        bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+        ok = ok && fflush(file) == 0;
+#if defined(_WIN32)
+        ok = ok && _commit(_fileno(file)) == 0;
+#else
+        ok = ok && fsync(fileno(file)) == 0;
+#endif
+        ok = (fclose(file) == 0) && ok;
+
+#if defined(_WIN32)
+        // rename does not replace existing files on Windows
+        remove(mFilename.c_str());
+#endif
+        return ok && rename(tempName.c_str(), mFilename.c_str()) == 0;
+    }
+
+private:
+
+    // Written by one render thread, padded so that slots do not share cache lines
+    struct alignas(64) Slot
+    {
+        std::string      mState;      //!< Renderer state answering mPublished
+        std::string      mFinalState; //!< Renderer state after its last iteration
+        std::atomic<int> mPublished;  //!< Request the slot content answers, or kFinished
+    };
+
+    std::vector<Slot>       mSlots;
+    uint64_t                mConfigHash;
+    std::string             mFilename;
+    float                   mInterval;
+
+    std::atomic<int>        mRequest;
+    bool                    mStop;            //!< Guarded by mMutex
+    int                     mCheckpointCount;
+
+    std::thread             mThread;
+    std::mutex              mMutex;
+    std::condition_variable mWakeUp;
+};
@@ -4,6 +4,7 @@
 #include <cmath>
 #include <time.h>
 #include <cstdlib>
+#include <stdint.h>
 #include "math.hpp"
 #include "ray.hpp"
 #include "geometry.hpp"
@@ -12,9 +13,10 @@
 #include "scene.hpp"
 #include "pathtracer.hpp"
 
-#include <omp.h>
 #include <string>
 #include <set>
+#include <map>
+#include <tuple>
 #include <sstream>
 
 // Renderer configuration, holds algorithm, scene, and all other settings
@@ -24,22 +26,118 @@ struct Config
     int         mIterations;
     Framebuffer *mFramebuffer;
     int         mNumThreads;
+    TaskSystem::PinMode mPinThreads; // Binds the render threads to CPUs or NUMA nodes
+    bool        mHugePages;      // Scene data on 2MB pages, see MemoryArena
+    Scene::AccelType mAccel;     // Acceleration structure of the scene
     int         mBaseSeed;
     uint        mMaxPathLength;
     uint        mMinPathLength;
     std::string mOutputName;
     Vec2i       mResolution;
+    uint        mChannelMask;    // Framebuffer channels (AOVs) to render, see FramebufferChannel
+    bool        mExrHalf;        // Store color-like EXR channels as half floats
+    ExrWriter::Compression mExrCompression;
+    int         mDenoisePasses;  // 0 disables the denoiser
+    std::string mReferenceName;  // PFM image to compute RMSE against
+    std::string mStatsName;      // JSON file for ray statistics (builds with PG3_STATS)
+    std::string mTraceName;      // Chrome trace JSON of the render phases
+    Tonemapper  mTonemapper;     // Used by the 8-bit outputs (.bmp, .png, .ppm)
+    float       mPreviewInterval; // Seconds between preview images, 0 disables previews
+    float       mCheckpointInterval; // Seconds between checkpoints, 0 disables checkpoints
+    bool        mResume;         // Continue from the checkpoint of a previous run
+    int         mWorkerIndex;    // >= 0 renders only this worker's share into a partial accumulation (.acc)
+    int         mWorkerCount;
+    int         mProcessCount;   // > 1 splits the render over local worker processes
+    std::vector<std::string> mMergeNames; // Partial accumulations to merge instead of rendering
+    bool        mServer;         // Serve render jobs from stdin instead of rendering once
+    bool        mShowProgress;   // Print the progress bar while rendering
+    bool        mProgressJson;   // Progress as JSON lines on stderr instead of the bar
+    float       mTimeLimit;      // Seconds, > 0 stops rendering when they have passed (before -i iterations)
+    std::string mConvergenceDir; // Reference images; runs the convergence harness instead of rendering
+    int         mConvergenceScene; // Scene of the convergence harness, -1 for all
+    std::vector<float> mBudgets; // Time budgets of the convergence harness, in seconds
+    std::string mBaselineName;   // Earlier convergence results to compare with
+    float       mTolerance;      // Allowed relative efficiency drop against the baseline
+    int         mStressPrimitives; // Primitive count of the procedural stress scenes
+    int         mStressLights;   // Emissive triangles of the many-lights stress scene
 };
 
-// Utility function, essentially a renderer factory
+// Utility function, essentially a renderer factory. The renderer reads
+// the copy of the scene on the NUMA node of the calling thread.
 AbstractRenderer* CreateRenderer(
     const Config& aConfig,
     const int     aSeed)
 {
-    const Scene& scene = *aConfig.mScene;
+    const Scene& scene = aConfig.mScene->GetNodeReplica(NumaTopology::Get().GetCurrentNode());
     return new PathTracer(scene, aSeed);
 }
 
+// Hash of everything that decides the rendered image, a checkpoint is
+// only resumed by the very same setup
+uint64_t ConfigHash(const Config &aConfig)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&hash](const void *aData, size_t aSize)
+    {
+        const unsigned char *bytes = static_cast<const unsigned char*>(aData);
+        for(size_t i=0; i<aSize; i++)
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+    };
+
+    const std::string &sceneName = aConfig.mScene->mSceneName;
+    const bool denoise = aConfig.mDenoisePasses > 0;
+
+    add(sceneName.data(), sceneName.size());
+    add(&aConfig.mScene->mCamera.mResolution, sizeof(Vec2f));
+    add(&aConfig.mIterations, sizeof(aConfig.mIterations));
+    add(&aConfig.mNumThreads, sizeof(aConfig.mNumThreads));
+    add(&aConfig.mBaseSeed, sizeof(aConfig.mBaseSeed));
+    add(&aConfig.mMaxPathLength, sizeof(aConfig.mMaxPathLength));
+    add(&aConfig.mMinPathLength, sizeof(aConfig.mMinPathLength));
+    add(&aConfig.mChannelMask, sizeof(aConfig.mChannelMask));
+    add(&denoise, sizeof(denoise));
+
+    return hash;
+}
+
+// Whether SaveImage knows the format given by the extension of aFilename
+bool IsImageFormat(const std::string &aFilename)
+{
+    const std::string extension = aFilename.substr(aFilename.length() - 3, 3);
+
+    return extension == "bmp" || extension == "png" || extension == "ppm" ||
+        extension == "hdr" || extension == "pfm" || extension == "exr";
+}
+
+// Saves the framebuffer in the format given by the extension of aFilename,
+// returns false for an unknown extension or when the file cannot be written
+bool SaveImage(
+    Framebuffer       &aFramebuffer,
+    const std::string &aFilename,
+    const Config      &aConfig)
+{
+    const std::string extension = aFilename.substr(aFilename.length() - 3, 3);
+
+    if(extension == "bmp")
+        return aFramebuffer.SaveBMP(aFilename.c_str(), aConfig.mTonemapper);
+    else if(extension == "png")
+        return aFramebuffer.SavePNG(aFilename.c_str(), aConfig.mTonemapper);
+    else if(extension == "ppm")
+        return aFramebuffer.SavePPM(aFilename.c_str(), aConfig.mTonemapper);
+    else if(extension == "hdr")
+        return aFramebuffer.SaveHDR(aFilename.c_str());
+    else if(extension == "pfm")
+        return aFramebuffer.SavePFM(aFilename.c_str());
+    else if(extension == "exr")
+        return aFramebuffer.SaveEXR(aFilename.c_str(), aConfig.mExrHalf, aConfig.mExrCompression);
+    else
+        return false;
+}
+
+const int kDefaultStressPrimitives = 10000;
+const int kDefaultStressLights     = 1000;
+
 // Scene configurations
 uint g_SceneConfigs[] = {
     Scene::kLightPoint   | Scene::kWalls | Scene::kSpheres | Scene::kWallsDiffuse | Scene::kSpheresDiffuse,
@@ -98,26 +196,165 @@ void PrintHelp(const char *argv[])
 
     for(int i = 0; i < SizeOfArray(g_SceneConfigs); i++)
         printf("          %d    %s\n", i, Scene::GetSceneName(g_SceneConfigs[i]).c_str());
+    printf("          %d    stress: random spheres (--primitives)\n",        SizeOfArray(g_SceneConfigs) + Scene::kStressSpheres);
+    printf("          %d    stress: subdivided mesh (--primitives)\n",       SizeOfArray(g_SceneConfigs) + Scene::kStressMesh);
+    printf("          %d    stress: many emissive triangles (--lights)\n",   SizeOfArray(g_SceneConfigs) + Scene::kStressLights);
+    printf("          %d    stress: grid of mesh copies (--primitives)\n",   SizeOfArray(g_SceneConfigs) + Scene::kStressGrid);
 
     printf("    -i  Number of iterations to run the algorithm (default 1)\n");
-    printf("    -o  User specified output name, with extension .hdr, .pfm, or .bmp (default .hdr)\n");
+    printf("    -o  User specified output name, with extension .hdr, .pfm, .bmp, .png, .ppm, or .exr (default .hdr)\n");
+    printf("    --aov <list>          Comma separated channels to render besides color, all saved into .exr output:\n");
+    printf("                         ");
+    for(int c=kChannelColor+1; c<kChannelCount; c++)
+        printf(" %s", GetChannelInfo(c).mName);
+    printf("\n");
+    printf("    --exr-float           Stores all .exr channels as 32-bit floats (default is half for color-like channels)\n");
+    printf("    --exr-compression <c> Compression of .exr output: none, zips, or zip (default zip)\n");
+    printf("    --denoise <passes>    Runs the a-trous denoiser with given number of passes after rendering (default 0 = off, 5 is typical)\n");
+    printf("    --reference <file>    Reports RMSE of the result against the given .pfm reference image\n");
+    printf("    --stats <file>        Writes ray statistics as JSON (needs a build with -DPG3_STATS)\n");
+    printf("    --trace <file>        Writes a timeline of the render phases and iterations per thread as a Chrome trace\n");
+    printf("                          (open in chrome://tracing or ui.perfetto.dev)\n");
+    printf("    --exposure <stops>    Exposure adjustment of 8-bit outputs (default 0)\n");
+    printf("    --tonemap <curve>     Tone curve of 8-bit outputs: clamp, reinhard, filmic, or aces (default clamp)\n");
+    printf("    --srgb                Encodes 8-bit outputs with the sRGB curve instead of gamma 2.2\n");
+    printf("    --preview <seconds>   Periodically overwrites the output with the image rendered so far (default 0 = off)\n");
+    printf("    --checkpoint <seconds> Periodically saves the render state to <output_name>.ckpt (default 0 = off)\n");
+    printf("    --resume              Continues from <output_name>.ckpt, the result is identical to an uninterrupted run\n");
+    printf("    --resolution <w>x<h>  Image resolution (default 512x512)\n");
+    printf("    --progress-json       Reports progress as JSON lines on stderr (iterations, eta, samples_per_sec, rays_per_sec)\n");
+    printf("    --server              Serves render jobs from stdin, one per line with the options above (-s, -i, -o, ...);\n");
+    printf("                          scenes and renderers are kept between jobs, each job answers ok or failed on stdout\n");
+    printf("    --pin-threads         Binds each render thread to its own logical CPU, filling one NUMA node after another (Linux)\n");
+    printf("    --pin-nodes           Binds each render thread to the CPUs of a NUMA node, in the same order (Linux)\n");
+    printf("    --huge-pages          Allocates the scene data on 2MB pages, reserved or transparent ones (Linux)\n");
+    printf("    --accel <type>        Acceleration structure: list, bvh, or compressed (a BVH 3-4x smaller, default list)\n");
+    printf("    --processes <count>   Splits the render over the given number of local worker processes (default 1)\n");
+    printf("    --worker <index> <count> Renders only the share of worker <index> out of <count> into a partial\n");
+    printf("                          accumulation, the output name gets extension .acc\n");
+    printf("    --merge <files>       Merges partial accumulations (.acc) into the output instead of rendering, no -s needed\n");
+    printf("    --time <seconds>      Stops rendering after the given time, or after -i iterations when that comes first;\n");
+    printf("                          at least one iteration is always rendered\n");
+    printf("    --convergence <dir>   Renders all scenes (or the one given by -s) with increasing time budgets and reports\n");
+    printf("                          RMSE, relMSE and efficiency 1/(relMSE*time) against <dir>/<default name>.pfm references;\n");
+    printf("                          results go to the output name (default convergence.json); the renders use other\n");
+    printf("                          seeds than the reference, so they do not repeat its samples\n");
+    printf("    --budgets <list>      Comma separated time budgets of --convergence in seconds (default 1,2,4,8)\n");
+    printf("    --baseline <file>     Results of an earlier --convergence run, the run fails when the efficiency of a scene\n");
+    printf("                          dropped by more than the tolerance\n");
+    printf("    --tolerance <frac>    Allowed efficiency drop against --baseline (default 0.1)\n");
+    printf("    --primitives <count>  Spheres or triangles of the stress scenes (default %d)\n", kDefaultStressPrimitives);
+    printf("    --lights <count>      Emissive triangles of the many-lights stress scene (default %d)\n", kDefaultStressLights);
 }
 
-// Parses command line, setting up config
-void ParseCommandline(int argc, const char *argv[], Config &oConfig)
+// Scene IDs after the Cornell box configurations select the stress scenes
+Scene* CreateScene(
+    int          aSceneID,
+    const Vec2i  &aResolution,
+    int          aStressPrimitives,
+    int          aStressLights,
+    bool         aHugePages,
+    Scene::AccelType aAccel)
+{
+    Scene *scene = new Scene(aHugePages);
+
+    if(aSceneID < SizeOfArray(g_SceneConfigs))
+        scene->LoadCornellBox(aResolution, g_SceneConfigs[aSceneID]);
+    else
+        scene->LoadStressScene(aResolution, Scene::StressScene(aSceneID - SizeOfArray(g_SceneConfigs)),
+            aStressPrimitives, aStressLights);
+
+    scene->BuildAccel(aAccel);
+    return scene;
+}
+
+// Scenes by scene ID, resolution, stress scene size, memory and acceleration structure, built once and kept for later requests
+class SceneCache
+{
+public:
+
+    ~SceneCache()
+    {
+        for(auto it=mScenes.begin(); it!=mScenes.end(); ++it)
+            delete it->second;
+    }
+
+    const Scene* Get(
+        int          aSceneID,
+        const Vec2i  &aResolution,
+        int          aStressPrimitives = kDefaultStressPrimitives,
+        int          aStressLights = kDefaultStressLights,
+        bool         aHugePages = false,
+        Scene::AccelType aAccel = Scene::kAccelList)
+    {
+        const Key key(aSceneID, aResolution.x, aResolution.y, aStressPrimitives, aStressLights, aHugePages, aAccel);
+
+        auto it = mScenes.find(key);
+        if(it != mScenes.end())
+            return it->second;
+
+        Scene *scene = CreateScene(aSceneID, aResolution, aStressPrimitives, aStressLights, aHugePages, aAccel);
+        mScenes[key] = scene;
+        return scene;
+    }
+
+private:
+
+    typedef std::tuple<int, int, int, int, int, bool, Scene::AccelType> Key;
+
+    std::map<Key, Scene*> mScenes;
+};
+
+// Parses command line, setting up config. With aSceneCache the scene comes
+// from (and stays owned by) the cache instead of being loaded anew.
+void ParseCommandline(
+    int         argc,
+    const char  *argv[],
+    Config      &oConfig,
+    SceneCache  *aSceneCache = NULL)
 {
     // Parameters marked with [cmd] can be change from command line
     oConfig.mScene         = NULL;                  // [cmd] When NULL, renderer will not run
     oConfig.mIterations    = 1;                     // [cmd]
     oConfig.mOutputName    = "";                    // [cmd]
     oConfig.mNumThreads    = 0;
+    oConfig.mPinThreads    = TaskSystem::kPinNone;  // [cmd]
+    oConfig.mHugePages     = false;                 // [cmd]
+    oConfig.mAccel         = Scene::kAccelList;     // [cmd]
     oConfig.mBaseSeed      = 1234;
     oConfig.mMaxPathLength = 10;
     oConfig.mMinPathLength = 0;
     oConfig.mResolution    = Vec2i(512, 512);
+    oConfig.mChannelMask   = kChannelMaskColor;     // [cmd]
+    oConfig.mExrHalf       = true;                  // [cmd]
+    oConfig.mExrCompression = ExrWriter::kZipCompression; // [cmd]
+    oConfig.mDenoisePasses = 0;                     // [cmd]
+    oConfig.mReferenceName = "";                    // [cmd]
+    oConfig.mStatsName     = "";                    // [cmd]
+    oConfig.mTraceName     = "";                    // [cmd]
+    oConfig.mTonemapper    = Tonemapper();          // [cmd]
+    oConfig.mPreviewInterval = 0.f;                 // [cmd]
+    oConfig.mCheckpointInterval = 0.f;              // [cmd]
+    oConfig.mResume        = false;                 // [cmd]
+    oConfig.mWorkerIndex   = -1;                    // [cmd]
+    oConfig.mWorkerCount   = 1;                     // [cmd]
+    oConfig.mProcessCount  = 1;                     // [cmd]
+    oConfig.mMergeNames.clear();                    // [cmd]
+    oConfig.mServer        = false;                 // [cmd]
+    oConfig.mShowProgress  = true;
+    oConfig.mProgressJson  = false;                 // [cmd]
+    oConfig.mTimeLimit     = 0.f;                   // [cmd]
+    oConfig.mConvergenceDir = "";                   // [cmd]
+    oConfig.mConvergenceScene = -1;
+    oConfig.mBudgets       = { 1.f, 2.f, 4.f, 8.f }; // [cmd]
+    oConfig.mBaselineName  = "";                    // [cmd]
+    oConfig.mTolerance     = 0.1f;                  // [cmd]
+    oConfig.mStressPrimitives = kDefaultStressPrimitives; // [cmd]
+    oConfig.mStressLights  = kDefaultStressLights;  // [cmd]
     //oConfig.mFramebuffer   = NULL; // this is never set by any parameter
 
     int sceneID    = -1; // defaults to no scene
+    std::vector<std::string> mergeNames;
 
     // Load arguments
     for(int i=1; i<argc; i++)
@@ -146,7 +383,7 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
             std::istringstream iss(argv[i]);
             iss >> sceneID;
 
-            if(iss.fail() || sceneID < 0 || sceneID >= SizeOfArray(g_SceneConfigs))
+            if(iss.fail() || sceneID < 0 || sceneID >= SizeOfArray(g_SceneConfigs) + Scene::kStressCount)
             {
                 printf("Invalid <sceneID> argument, please see help (-h)\n");
                 return;
@@ -185,32 +422,468 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
                 return;
             }
         }
+        else if(arg == "--aov") // additional framebuffer channels
+        {
+            if(++i == argc)
+            {
+                printf("Missing <list> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            std::string name;
+
+            while(std::getline(iss, name, ','))
+            {
+                const int channel = FindChannel(name);
+
+                if(channel < 0)
+                {
+                    printf("Invalid <list> argument, unknown channel %s, please see help (-h)\n", name.c_str());
+                    return;
+                }
+
+                oConfig.mChannelMask |= 1u << channel;
+            }
+        }
+        else if(arg == "--exr-float") // full precision exr
+        {
+            oConfig.mExrHalf = false;
+        }
+        else if(arg == "--exr-compression") // exr compression method
+        {
+            if(++i == argc)
+            {
+                printf("Missing <c> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::string compression(argv[i]);
+
+            if(compression == "none")
+                oConfig.mExrCompression = ExrWriter::kNoCompression;
+            else if(compression == "zips")
+                oConfig.mExrCompression = ExrWriter::kZipsCompression;
+            else if(compression == "zip")
+                oConfig.mExrCompression = ExrWriter::kZipCompression;
+            else
+            {
+                printf("Invalid <c> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--denoise") // number of denoiser passes
+        {
+            if(++i == argc)
+            {
+                printf("Missing <passes> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mDenoisePasses;
+
+            if(iss.fail() || oConfig.mDenoisePasses < 0)
+            {
+                printf("Invalid <passes> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--reference") // reference image for error reporting
+        {
+            if(++i == argc)
+            {
+                printf("Missing <file> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mReferenceName = argv[i];
+        }
+        else if(arg == "--stats") // ray statistics dump
+        {
+            if(++i == argc)
+            {
+                printf("Missing <file> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mStatsName = argv[i];
+        }
+        else if(arg == "--trace") // timeline of the render
+        {
+            if(++i == argc)
+            {
+                printf("Missing <file> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mTraceName = argv[i];
+        }
+        else if(arg == "--exposure") // exposure of 8-bit outputs
+        {
+            if(++i == argc)
+            {
+                printf("Missing <stops> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mTonemapper.mExposure;
+
+            if(iss.fail())
+            {
+                printf("Invalid <stops> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--tonemap") // tone curve of 8-bit outputs
+        {
+            if(++i == argc)
+            {
+                printf("Missing <curve> argument, please see help (-h)\n");
+                return;
+            }
+
+            if(!Tonemapper::ParseCurve(argv[i], oConfig.mTonemapper.mCurve))
+            {
+                printf("Invalid <curve> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--srgb") // sRGB encoding of 8-bit outputs
+        {
+            oConfig.mTonemapper.mEncoding = Tonemapper::kEncodingSRGB;
+        }
+        else if(arg == "--preview") // preview interval
+        {
+            if(++i == argc)
+            {
+                printf("Missing <seconds> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mPreviewInterval;
+
+            if(iss.fail() || oConfig.mPreviewInterval < 0.f)
+            {
+                printf("Invalid <seconds> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--checkpoint") // checkpoint interval
+        {
+            if(++i == argc)
+            {
+                printf("Missing <seconds> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mCheckpointInterval;
+
+            if(iss.fail() || oConfig.mCheckpointInterval < 0.f)
+            {
+                printf("Invalid <seconds> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--resume") // continue from checkpoint
+        {
+            oConfig.mResume = true;
+        }
+        else if(arg == "--resolution") // image resolution
+        {
+            if(++i == argc)
+            {
+                printf("Missing <w>x<h> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            char separator = 0;
+            iss >> oConfig.mResolution.x >> separator >> oConfig.mResolution.y;
+
+            if(iss.fail() || separator != 'x' || oConfig.mResolution.x < 1 || oConfig.mResolution.y < 1)
+            {
+                printf("Invalid <w>x<h> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--progress-json") // machine readable progress
+        {
+            oConfig.mProgressJson = true;
+        }
+        else if(arg == "--server") // serve render jobs from stdin
+        {
+            oConfig.mServer = true;
+        }
+        else if(arg == "--pin-threads") // thread affinity
+        {
+            oConfig.mPinThreads = TaskSystem::kPinCpus;
+        }
+        else if(arg == "--pin-nodes") // thread affinity by NUMA node
+        {
+            oConfig.mPinThreads = TaskSystem::kPinNodes;
+        }
+        else if(arg == "--huge-pages") // scene memory on huge pages
+        {
+            oConfig.mHugePages = true;
+        }
+        else if(arg == "--accel") // acceleration structure
+        {
+            if(++i == argc)
+            {
+                printf("Missing <type> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::string type(argv[i]);
+
+            int accel = 0;
+            while(accel < Scene::kAccelCount && type != Scene::GetAccelName(Scene::AccelType(accel)))
+                accel++;
+
+            if(accel == Scene::kAccelCount)
+            {
+                printf("Invalid <type> argument, please see help (-h)\n");
+                return;
+            }
+            oConfig.mAccel = Scene::AccelType(accel);
+        }
+        else if(arg == "--processes") // number of local worker processes
+        {
+            if(++i == argc)
+            {
+                printf("Missing <count> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mProcessCount;
+
+            if(iss.fail() || oConfig.mProcessCount < 1)
+            {
+                printf("Invalid <count> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--worker") // share of a distributed render
+        {
+            if(i + 2 >= argc)
+            {
+                printf("Missing <index> <count> arguments, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream issIndex(argv[++i]);
+            std::istringstream issCount(argv[++i]);
+            issIndex >> oConfig.mWorkerIndex;
+            issCount >> oConfig.mWorkerCount;
+
+            if(issIndex.fail() || issCount.fail() || oConfig.mWorkerCount < 1 ||
+                oConfig.mWorkerIndex < 0 || oConfig.mWorkerIndex >= oConfig.mWorkerCount)
+            {
+                printf("Invalid <index> <count> arguments, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--time") // time limit
+        {
+            if(++i == argc)
+            {
+                printf("Missing <seconds> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mTimeLimit;
+
+            if(iss.fail() || oConfig.mTimeLimit <= 0.f)
+            {
+                printf("Invalid <seconds> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--convergence") // convergence harness
+        {
+            if(++i == argc)
+            {
+                printf("Missing <dir> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mConvergenceDir = argv[i];
+        }
+        else if(arg == "--budgets") // time budgets of the convergence harness
+        {
+            if(++i == argc)
+            {
+                printf("Missing <list> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mBudgets.clear();
+
+            std::istringstream list(argv[i]);
+            std::string item;
+            while(std::getline(list, item, ','))
+            {
+                std::istringstream iss(item);
+                float budget = 0.f;
+                iss >> budget;
+
+                if(iss.fail() || budget <= 0.f)
+                {
+                    printf("Invalid <list> argument, please see help (-h)\n");
+                    return;
+                }
+
+                oConfig.mBudgets.push_back(budget);
+            }
+
+            if(oConfig.mBudgets.empty())
+            {
+                printf("Invalid <list> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--baseline") // earlier convergence results
+        {
+            if(++i == argc)
+            {
+                printf("Missing <file> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mBaselineName = argv[i];
+        }
+        else if(arg == "--tolerance") // allowed efficiency drop
+        {
+            if(++i == argc)
+            {
+                printf("Missing <frac> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mTolerance;
+
+            if(iss.fail() || oConfig.mTolerance < 0.f || oConfig.mTolerance >= 1.f)
+            {
+                printf("Invalid <frac> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--primitives") // size of the stress scenes
+        {
+            if(++i == argc)
+            {
+                printf("Missing <count> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mStressPrimitives;
+
+            if(iss.fail() || oConfig.mStressPrimitives < 1)
+            {
+                printf("Invalid <count> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--lights") // emitters of the many-lights stress scene
+        {
+            if(++i == argc)
+            {
+                printf("Missing <count> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mStressLights;
+
+            if(iss.fail() || oConfig.mStressLights < 1)
+            {
+                printf("Invalid <count> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--merge") // partial accumulations to merge, up to the next option
+        {
+            while(i + 1 < argc && argv[i + 1][0] != '-')
+                mergeNames.push_back(argv[++i]);
+
+            if(mergeNames.empty())
+            {
+                printf("Missing <files> argument, please see help (-h)\n");
+                return;
+            }
+        }
     }
 
-    if (sceneID < 0) {
-        PrintHelp(argv);
+    oConfig.mTonemapper.Setup();
+
+    // The server gets its scenes with each job
+    if (oConfig.mServer)
+        return;
+
+    // The convergence harness loads its scenes itself
+    if (oConfig.mConvergenceDir.length() > 0)
+    {
+        oConfig.mConvergenceScene = sceneID;
+
+        if (oConfig.mOutputName.length() == 0)
+            oConfig.mOutputName = "convergence.json";
         return;
     }
 
-    // Load scene
-    Scene *scene = new Scene;
-    scene->LoadCornellBox(oConfig.mResolution, g_SceneConfigs[sceneID]);
+    // Merging needs no scene, main runs it when there are names to merge
+    if (mergeNames.size() > 0)
+    {
+        oConfig.mMergeNames = mergeNames;
 
-    oConfig.mScene = scene;
+        if (oConfig.mOutputName.length() == 0)
+            oConfig.mOutputName = "merged.hdr";
+    }
+    else if (sceneID < 0) {
+        PrintHelp(argv);
+        return;
+    }
+    else if (aSceneCache)
+        oConfig.mScene = aSceneCache->Get(sceneID, oConfig.mResolution, oConfig.mStressPrimitives, oConfig.mStressLights,
+            oConfig.mHugePages, oConfig.mAccel);
+    else
+    {
+        // Load scene
+        oConfig.mScene = CreateScene(sceneID, oConfig.mResolution, oConfig.mStressPrimitives, oConfig.mStressLights,
+            oConfig.mHugePages, oConfig.mAccel);
+    }
 
     // If no output name is chosen, create a default one
     if(oConfig.mOutputName.length() == 0)
     {
-        oConfig.mOutputName = DefaultFilename(sceneID, g_SceneConfigs[sceneID], *oConfig.mScene);
+        oConfig.mOutputName = DefaultFilename(sceneID,
+            sceneID < SizeOfArray(g_SceneConfigs) ? g_SceneConfigs[sceneID] : 0, *oConfig.mScene);
+    }
+
+    // Workers write partial accumulations
+    if(oConfig.mWorkerIndex >= 0)
+    {
+        if(oConfig.mOutputName.length() <= 4 ||
+            oConfig.mOutputName.substr(oConfig.mOutputName.length() - 4, 4) != ".acc")
+            oConfig.mOutputName += ".acc";
+        return;
     }
 
-    // Check if output name has valid extension (.bmp or .hdr) and if not add .bmp
+    // Check if output name has valid extension (.bmp, .png, .ppm, .hdr, .pfm or .exr) and if not add .hdr
     std::string extension = "";
 
     if(oConfig.mOutputName.length() > 4) // must be at least 1 character before .bmp
         extension = oConfig.mOutputName.substr(
             oConfig.mOutputName.length() - 4, 4);
 
-    if(extension != ".bmp" && extension != ".hdr" && extension != ".pfm")
+    if(extension != ".bmp" && extension != ".png" && extension != ".ppm" &&
+       extension != ".hdr" && extension != ".pfm" && extension != ".exr")
         oConfig.mOutputName += ".hdr";
 }
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <functional>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include "framebuffer.hpp"
+#include "config.hpp"
+
+//////////////////////////////////////////////////////////////////////////
+// Error versus time of the scene configurations
+//
+// Every scene is rendered with increasing time budgets and compared with
+// its high sample count reference, <reference dir>/<default name>.pfm
+// (e.g. 3_ws_c_sdwd.pfm, rendered with many iterations and -o). The
+// efficiency 1 / (relMSE * time) does not depend on the budget for an
+// unbiased estimator, so faster renderers and lower variance estimators
+// are compared on the same scale. The results are compared with those of
+// an earlier run, and a scene whose efficiency (geometric mean over the
+// budgets) dropped by more than the tolerance fails the run. The renders
+// are seeded away from the reference (-o render with the same base seed),
+// otherwise their first iterations would repeat its samples and the error
+// would come out too low.
+class ConvergenceHarness
+{
+public:
+
+    // Renders with the given config (time limit set) into its framebuffer,
+    // returns the time and the number of iterations it managed
+    typedef std::function<float(const Config&, int&)> RenderFunction;
+
+    struct Point
+    {
+        int   mSceneID;
+        float mBudget;     //!< Seconds
+        float mTime;       //!< Seconds actually spent
+        int   mIterations;
+        float mRmse;
+        float mRelMse;
+        float mEfficiency; //!< 1 / (relMSE * time)
+    };
+
+    ConvergenceHarness(
+        const Config   &aConfig,
+        RenderFunction aRender) :
+        mConfig(aConfig),
+        mRender(aRender)
+    {}
+
+    /**
+     * Renders the scene (or all scenes when aSceneID < 0) at all budgets
+     * Returns:
+     *  - false when a reference is missing or does not match the resolution
+     */
+    bool Run(int aSceneID)
+    {
+        bool ok = true;
+        const int first = aSceneID < 0 ? 0 : aSceneID;
+        const int last  = aSceneID < 0 ? SizeOfArray(g_SceneConfigs) - 1 : aSceneID;
+
+        for(int sceneID=first; sceneID<=last; sceneID++)
+        {
+            const Scene *scene = mScenes.Get(sceneID, mConfig.mResolution, mConfig.mStressPrimitives,
+                mConfig.mStressLights, mConfig.mHugePages, mConfig.mAccel);
+
+            std::string name = DefaultFilename(sceneID,
+                sceneID < SizeOfArray(g_SceneConfigs) ? g_SceneConfigs[sceneID] : 0, *scene);
+            name = mConfig.mConvergenceDir + "/" + name.substr(0, name.length() - 4) + ".pfm";
+
+            Framebuffer reference;
+            if(!reference.LoadPFM(name.c_str()) ||
+                reference.GetResX() != mConfig.mResolution.x || reference.GetResY() != mConfig.mResolution.y)
+            {
+                printf("Scene %d:   missing reference %s (at %dx%d)\n", sceneID, name.c_str(),
+                    mConfig.mResolution.x, mConfig.mResolution.y);
+                ok = false;
+                continue;
+            }
+
+            for(size_t b=0; b<mConfig.mBudgets.size(); b++)
+            {
+                Framebuffer framebuffer;
+
+                Config config = mConfig;
+                config.mScene        = scene;
+                config.mFramebuffer  = &framebuffer;
+                config.mTimeLimit    = mConfig.mBudgets[b];
+                config.mIterations   = 1 << 30; // the budget ends the render
+                config.mBaseSeed     = mConfig.mBaseSeed + int(b + 1) * kSeedStride;
+                config.mShowProgress = false;
+
+                int iterations = 0;
+
+                Point point;
+                point.mSceneID    = sceneID;
+                point.mBudget     = mConfig.mBudgets[b];
+                point.mTime       = mRender(config, iterations);
+                point.mIterations = iterations;
+                point.mRmse       = framebuffer.RMSE(reference);
+                point.mRelMse     = framebuffer.RelMSE(reference);
+                point.mEfficiency = point.mRelMse > 0.f && point.mTime > 0.f ?
+                    1.f / (point.mRelMse * point.mTime) : 0.f;
+
+                printf("Scene %d:   %6.2f s budget, %5d iteration(s) in %6.2f s, RMSE %.5f, relMSE %.6f, efficiency %.3f\n",
+                    sceneID, point.mBudget, point.mIterations, point.mTime, point.mRmse, point.mRelMse, point.mEfficiency);
+                fflush(stdout);
+
+                mPoints.push_back(point);
+            }
+        }
+
+        return ok;
+    }
+
+    // One point per line, so that Compare can read it back without a JSON parser
+    bool Save(const std::string &aFilename) const
+    {
+        FILE *file = fopen(aFilename.c_str(), "w");
+        if(!file)
+            return false;
+
+        fprintf(file, "{\"resolution\": [%d, %d], \"threads\": %d, \"points\": [\n",
+            mConfig.mResolution.x, mConfig.mResolution.y, mConfig.mNumThreads);
+
+        for(size_t i=0; i<mPoints.size(); i++)
+        {
+            const Point &p = mPoints[i];
+            fprintf(file, "{\"scene\": %d, \"budget\": %g, \"time\": %g, \"iterations\": %d, "
+                "\"rmse\": %g, \"relmse\": %g, \"efficiency\": %g}%s\n",
+                p.mSceneID, p.mBudget, p.mTime, p.mIterations, p.mRmse, p.mRelMse, p.mEfficiency,
+                i + 1 < mPoints.size() ? "," : "");
+        }
+
+        fprintf(file, "]}\n");
+        return fclose(file) == 0;
+    }
+
+    /**
+     * Compares with the results saved by an earlier run
+     * Returns:
+     *  - number of scenes whose efficiency regressed by more than aTolerance (fraction),
+     *    or -1 when the baseline cannot be read
+     */
+    int Compare(
+        const std::string &aBaselineName,
+        float             aTolerance) const
+    {
+        std::ifstream file(aBaselineName.c_str());
+        if(!file)
+            return -1;
+
+        std::map<int, std::vector<float> > baseline;
+
+        std::string line;
+        while(std::getline(file, line))
+        {
+            int   sceneID;
+            float efficiency;
+
+            const size_t scenePos      = line.find("\"scene\":");
+            const size_t efficiencyPos = line.find("\"efficiency\":");
+
+            if(scenePos == std::string::npos || efficiencyPos == std::string::npos ||
+                sscanf(line.c_str() + scenePos, "\"scene\": %d", &sceneID) != 1 ||
+                sscanf(line.c_str() + efficiencyPos, "\"efficiency\": %f", &efficiency) != 1)
+                continue;
+
+            baseline[sceneID].push_back(efficiency);
+        }
+
+        std::map<int, std::vector<float> > current;
+        for(size_t i=0; i<mPoints.size(); i++)
+            current[mPoints[i].mSceneID].push_back(mPoints[i].mEfficiency);
+
+        // The geometric mean over the budgets evens out the noise of short renders
+        int regressions = 0;
+        for(auto it=current.begin(); it!=current.end(); ++it)
+        {
+            auto base = baseline.find(it->first);
+            if(base == baseline.end())
+                continue;
+
+            const float now    = GeometricMean(it->second);
+            const float before = GeometricMean(base->second);
+            const bool  failed = now < before * (1.f - aTolerance);
+
+            printf("Scene %d:   efficiency %.3f vs. %.3f baseline (%+.1f%%)%s\n", it->first, now, before,
+                before > 0.f ? 100.f * (now / before - 1.f) : 0.f, failed ? " REGRESSION" : "");
+
+            regressions += failed ? 1 : 0;
+        }
+
+        return regressions;
+    }
+
+private:
+
+    // Seeds of each budget are this far apart, and from the reference; beyond
+    // the renderers of a reference rendered by up to 256 workers (kWorkerSeedStride)
+    static const int kSeedStride = 1 << 24;
+
+    static float GeometricMean(const std::vector<float> &aValues)
+    {
+        double logSum = 0.0;
+        int    count  = 0;
+
+        for(size_t i=0; i<aValues.size(); i++)
+        {
+            if(aValues[i] <= 0.f)
+                continue;
+
+            logSum += std::log(double(aValues[i]));
+            count++;
+        }
+
+        return count > 0 ? float(std::exp(logSum / count)) : 0.f;
+    }
+
+private:
+
+    Config             mConfig;
+    RenderFunction     mRender;
+    SceneCache         mScenes;
+    std::vector<Point> mPoints;
+};
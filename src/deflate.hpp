@@ -0,0 +1,603 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+
+//////////////////////////////////////////////////////////////////////////
+// Deflate (RFC 1951) compressor with zlib (RFC 1950) framing
+//
+// Greedy LZ77 matching over a hash chain of bounded length, followed by
+// one dynamic Huffman block per group of symbols. It is meant for image
+// writers, which care far more about speed than about the last percent
+// of compression, so there is no lazy matching. Raw segments can be
+// compressed in parallel and concatenated (see CompressRaw).
+class DeflateCompressor
+{
+public:
+
+    /**
+     * Compresses data into a zlib stream
+     * Arguments:
+     *  - aData, aSize = data to compress
+     *  - aMaxChain = how many earlier positions are tried per match, more is slower and better
+     * Returns:
+     *  - compressed data appended to oCompressed
+     */
+    static void Compress(
+        const uint8_t        *aData,
+        size_t               aSize,
+        std::vector<uint8_t> &oCompressed,
+        int                  aMaxChain = 8)
+    {
+        // zlib header: deflate with 32K window, fastest compression level
+        oCompressed.push_back(0x78);
+        oCompressed.push_back(0x01);
+
+        CompressRaw(aData, aSize, oCompressed, true, aMaxChain);
+
+        // Adler-32 of the uncompressed data, big-endian
+        const uint32_t adler = Adler32(aData, aSize);
+        for(int i=3; i>=0; i--)
+            oCompressed.push_back(uint8_t(adler >> (8 * i)));
+    }
+
+    /**
+     * Compresses data into raw deflate blocks, without zlib framing
+     * Arguments:
+     *  - aFinal = whether this is the end of the stream; otherwise the output
+     *    ends on a byte boundary (empty stored block), so independently
+     *    compressed segments can be concatenated into one stream
+     */
+    static void CompressRaw(
+        const uint8_t        *aData,
+        size_t               aSize,
+        std::vector<uint8_t> &oCompressed,
+        bool                 aFinal,
+        int                  aMaxChain = 8)
+    {
+        BitWriter bits(oCompressed);
+
+        std::vector<uint32_t> symbols;
+        symbols.reserve(kMaxBlockSymbols + 2);
+
+        std::vector<int32_t> head(kHashSize, -1);
+        std::vector<int32_t> prev(kWindowSize, -1);
+
+        size_t pos = 0;
+        do
+        {
+            symbols.clear();
+
+            while(pos < aSize && symbols.size() < kMaxBlockSymbols)
+            {
+                int bestLen = 0, bestDist = 0;
+
+                if(pos + kMinMatch <= aSize)
+                {
+                    const uint32_t hash = Hash(aData + pos);
+                    int32_t candidate = head[hash];
+                    const int maxLen = int(std::min<size_t>(kMaxMatch, aSize - pos));
+
+                    for(int chain=0; chain<aMaxChain && candidate >= 0; chain++)
+                    {
+                        const int dist = int(pos - candidate);
+                        if(dist > kWindowSize)
+                            break;
+
+                        if(aData[candidate + bestLen] == aData[pos + bestLen])
+                        {
+                            int len = 0;
+                            while(len < maxLen && aData[candidate + len] == aData[pos + len])
+                                len++;
+
+                            if(len > bestLen)
+                            {
+                                bestLen  = len;
+                                bestDist = dist;
+
+                                if(len == maxLen)
+                                    break;
+                            }
+                        }
+
+                        const int32_t next = prev[candidate & (kWindowSize - 1)];
+                        candidate = (next < candidate) ? next : -1;
+                    }
+                }
+
+                if(bestLen >= kMinMatch)
+                {
+                    symbols.push_back(kMatchFlag | (uint32_t(bestLen) << 16) | uint32_t(bestDist));
+
+                    for(int i=0; i<bestLen; i++, pos++)
+                        InsertHash(aData, aSize, pos, head, prev);
+                }
+                else
+                {
+                    symbols.push_back(aData[pos]);
+                    InsertHash(aData, aSize, pos, head, prev);
+                    pos++;
+                }
+            }
+
+            WriteBlock(bits, symbols, aFinal && pos >= aSize);
+        }
+        while(pos < aSize);
+
+        if(!aFinal)
+        {
+            // Empty stored block, aligns the stream to a byte boundary
+            bits.Put(0, 3);
+            bits.Flush();
+            const uint8_t stored[4] = { 0x00, 0x00, 0xff, 0xff };
+            oCompressed.insert(oCompressed.end(), stored, stored + 4);
+        }
+        else
+            bits.Flush();
+    }
+
+    // Adler-32 of the concatenation of two blocks, aAdler2 being of a block of aSize2 bytes
+    static uint32_t Adler32Combine(
+        uint32_t aAdler1,
+        uint32_t aAdler2,
+        size_t   aSize2)
+    {
+        const uint32_t base = 65521;
+        const uint32_t rem  = uint32_t(aSize2 % base);
+
+        uint32_t sum1 = aAdler1 & 0xffff;
+        uint32_t sum2 = uint32_t((uint64_t(rem) * sum1) % base);
+        sum1 += (aAdler2 & 0xffff) + base - 1;
+        sum2 += ((aAdler1 >> 16) & 0xffff) + ((aAdler2 >> 16) & 0xffff) + base - rem;
+
+        if(sum1 >= base) sum1 -= base;
+        if(sum1 >= base) sum1 -= base;
+        if(sum2 >= (base << 1)) sum2 -= (base << 1);
+        if(sum2 >= base) sum2 -= base;
+
+        return sum1 | (sum2 << 16);
+    }
+
+    static uint32_t Adler32(
+        const uint8_t *aData,
+        size_t        aSize,
+        uint32_t      aAdler = 1)
+    {
+        uint32_t a = aAdler & 0xffff, b = aAdler >> 16;
+
+        while(aSize > 0)
+        {
+            // 5552 is the largest block that cannot overflow before the modulo
+            const size_t block = std::min<size_t>(aSize, 5552);
+
+            for(size_t i=0; i<block; i++)
+            {
+                a += aData[i];
+                b += a;
+            }
+
+            a %= 65521;
+            b %= 65521;
+            aData += block;
+            aSize -= block;
+        }
+
+        return (b << 16) | a;
+    }
+
+private:
+
+    enum
+    {
+        kWindowSize      = 32768,
+        kHashBits        = 15,
+        kHashSize        = 1 << kHashBits,
+        kMinMatch        = 3,
+        kMaxMatch        = 258,
+        kMaxBlockSymbols = 65536,
+        kLitLenCodes     = 286,
+        kDistCodes       = 30,
+        kCodeLenCodes    = 19
+    };
+
+    // Symbols are literals, or matches packed as flag | length << 16 | distance
+    static const uint32_t kMatchFlag = 0x80000000u;
+
+    class BitWriter
+    {
+    public:
+        BitWriter(std::vector<uint8_t> &aoOut) : mOut(aoOut), mBits(0), mCount(0) {}
+
+        // Deflate fills bytes from the least significant bit
+        void Put(uint32_t aValue, int aCount)
+        {
+            mBits  |= uint64_t(aValue) << mCount;
+            mCount += aCount;
+
+            while(mCount >= 8)
+            {
+                mOut.push_back(uint8_t(mBits));
+                mBits  >>= 8;
+                mCount -= 8;
+            }
+        }
+
+        void PutByte(uint8_t aByte) { Put(aByte, 8); }
+
+        void Flush()
+        {
+            if(mCount > 0)
+                mOut.push_back(uint8_t(mBits));
+
+            mBits  = 0;
+            mCount = 0;
+        }
+
+    private:
+        std::vector<uint8_t> &mOut;
+        uint64_t             mBits;
+        int                  mCount;
+    };
+
+    struct HuffmanCode
+    {
+        uint8_t  mLength[kLitLenCodes];
+        uint16_t mCode[kLitLenCodes]; //!< Already bit-reversed for the LSB-first writer
+    };
+
+    static uint32_t Hash(const uint8_t *aData)
+    {
+        const uint32_t v = uint32_t(aData[0]) | (uint32_t(aData[1]) << 8) | (uint32_t(aData[2]) << 16);
+        return (v * 2654435761u) >> (32 - kHashBits);
+    }
+
+    static void InsertHash(
+        const uint8_t        *aData,
+        size_t               aSize,
+        size_t               aPos,
+        std::vector<int32_t> &aoHead,
+        std::vector<int32_t> &aoPrev)
+    {
+        if(aPos + kMinMatch > aSize)
+            return;
+
+        const uint32_t hash = Hash(aData + aPos);
+        aoPrev[aPos & (kWindowSize - 1)] = aoHead[hash];
+        aoHead[hash] = int32_t(aPos);
+    }
+
+    static void LengthCode(int aLength, int &oCode, int &oExtraBits, int &oExtra)
+    {
+        static const uint16_t base[29] = {
+            3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+        static const uint8_t extra[29] = {
+            0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+
+        // Code of every length, built on first use
+        static const std::vector<uint8_t> table = []()
+        {
+            std::vector<uint8_t> res(kMaxMatch + 1, 0);
+            for(int len=kMinMatch, code=0; len<=kMaxMatch; len++)
+            {
+                while(code < 28 && base[code + 1] <= len)
+                    code++;
+                res[len] = uint8_t(code);
+            }
+            return res;
+        }();
+
+        const int code = table[aLength];
+        oCode      = 257 + code;
+        oExtraBits = extra[code];
+        oExtra     = aLength - base[code];
+    }
+
+    static void DistanceCode(int aDistance, int &oCode, int &oExtraBits, int &oExtra)
+    {
+        static const uint16_t base[30] = {
+            1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,
+            1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+        static const uint8_t extra[30] = {
+            0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+        // Distances up to 256 are looked up directly, longer ones by (distance - 1) >> 7,
+        // codes from 16 up span multiples of 128
+        static const std::vector<uint8_t> table = []()
+        {
+            std::vector<uint8_t> res(512, 0);
+            for(int i=0; i<512; i++)
+            {
+                const int dist = (i < 256) ? i + 1 : ((i - 256) << 7) + 1;
+                int code = 0;
+                while(code < 29 && base[code + 1] <= dist)
+                    code++;
+                res[i] = uint8_t(code);
+            }
+            return res;
+        }();
+
+        const int code = (aDistance <= 256) ? table[aDistance - 1] : table[256 + ((aDistance - 1) >> 7)];
+        oCode      = code;
+        oExtraBits = extra[code];
+        oExtra     = aDistance - base[code];
+    }
+
+    // Huffman code lengths limited to aMaxLength bits
+    static void BuildLengths(
+        const uint32_t *aFreq,
+        int            aCount,
+        int            aMaxLength,
+        uint8_t        *oLengths)
+    {
+        memset(oLengths, 0, aCount);
+
+        std::vector<std::pair<uint32_t, int> > leaves;
+        for(int i=0; i<aCount; i++)
+            if(aFreq[i] > 0)
+                leaves.push_back(std::make_pair(aFreq[i], i));
+
+        if(leaves.empty())
+            return;
+
+        if(leaves.size() == 1)
+        {
+            oLengths[leaves[0].second] = 1;
+            return;
+        }
+
+        std::sort(leaves.begin(), leaves.end());
+
+        // Two-queue construction, leaves are sorted and internal nodes
+        // are created in non-decreasing weight order
+        const int leafCount = int(leaves.size());
+        const int nodeCount = 2 * leafCount - 1;
+        std::vector<uint64_t> weight(nodeCount);
+        std::vector<int>      parent(nodeCount, -1);
+
+        for(int i=0; i<leafCount; i++)
+            weight[i] = leaves[i].first;
+
+        int nextLeaf = 0, nextInner = leafCount;
+        for(int node=leafCount; node<nodeCount; node++)
+        {
+            for(int child=0; child<2; child++)
+            {
+                int pick;
+                if(nextLeaf < leafCount && (nextInner >= node || weight[nextLeaf] <= weight[nextInner]))
+                    pick = nextLeaf++;
+                else
+                    pick = nextInner++;
+
+                weight[node] += weight[pick];
+                parent[pick]  = node;
+            }
+        }
+
+        std::vector<int> depth(nodeCount, 0);
+        for(int i=nodeCount-2; i>=0; i--)
+            depth[i] = depth[parent[i]] + 1;
+
+        // Clamp overlong codes and repair the Kraft sum by lengthening the
+        // deepest codes that still fit
+        std::vector<int> lengthCount(aMaxLength + 1, 0);
+        for(int i=0; i<leafCount; i++)
+            lengthCount[std::min(depth[i], aMaxLength)]++;
+
+        uint32_t kraft = 0;
+        for(int len=1; len<=aMaxLength; len++)
+            kraft += uint32_t(lengthCount[len]) << (aMaxLength - len);
+
+        while(kraft > (1u << aMaxLength))
+        {
+            lengthCount[aMaxLength]--;
+
+            for(int len=aMaxLength-1; len>0; len--)
+            {
+                if(lengthCount[len] > 0)
+                {
+                    lengthCount[len]--;
+                    lengthCount[len + 1] += 2;
+                    break;
+                }
+            }
+
+            kraft--;
+        }
+
+        // The most frequent symbols get the shortest codes
+        int leaf = leafCount - 1;
+        for(int len=1; len<=aMaxLength; len++)
+            for(int i=0; i<lengthCount[len]; i++)
+                oLengths[leaves[leaf--].second] = uint8_t(len);
+    }
+
+    // Canonical code assignment (RFC 1951, 3.2.2)
+    static void BuildCodes(
+        const uint8_t *aLengths,
+        int           aCount,
+        uint16_t      *oCodes)
+    {
+        int lengthCount[16] = { 0 };
+        for(int i=0; i<aCount; i++)
+            lengthCount[aLengths[i]]++;
+        lengthCount[0] = 0;
+
+        int nextCode[16] = { 0 };
+        int code = 0;
+        for(int len=1; len<16; len++)
+        {
+            code = (code + lengthCount[len - 1]) << 1;
+            nextCode[len] = code;
+        }
+
+        for(int i=0; i<aCount; i++)
+        {
+            const int len = aLengths[i];
+            if(len == 0)
+                continue;
+
+            uint32_t value = nextCode[len]++, reversed = 0;
+            for(int b=0; b<len; b++)
+            {
+                reversed = (reversed << 1) | (value & 1);
+                value >>= 1;
+            }
+
+            oCodes[i] = uint16_t(reversed);
+        }
+    }
+
+    static void WriteBlock(
+        BitWriter                   &aoBits,
+        const std::vector<uint32_t> &aSymbols,
+        bool                        aFinal)
+    {
+        uint32_t litFreq[kLitLenCodes] = { 0 };
+        uint32_t distFreq[kDistCodes]  = { 0 };
+
+        for(size_t i=0; i<aSymbols.size(); i++)
+        {
+            const uint32_t symbol = aSymbols[i];
+
+            if(symbol & kMatchFlag)
+            {
+                int code, extraBits, extra;
+                LengthCode((symbol >> 16) & 0x7fff, code, extraBits, extra);
+                litFreq[code]++;
+                DistanceCode(symbol & 0xffff, code, extraBits, extra);
+                distFreq[code]++;
+            }
+            else
+                litFreq[symbol]++;
+        }
+
+        litFreq[256] = 1; // end of block
+
+        // Decoders expect at least one distance code
+        if(std::count(distFreq, distFreq + kDistCodes, 0u) == kDistCodes)
+            distFreq[0] = 1;
+
+        HuffmanCode lit, dist;
+        BuildLengths(litFreq, kLitLenCodes, 15, lit.mLength);
+        BuildLengths(distFreq, kDistCodes, 15, dist.mLength);
+        BuildCodes(lit.mLength, kLitLenCodes, lit.mCode);
+        BuildCodes(dist.mLength, kDistCodes, dist.mCode);
+
+        int litCount = kLitLenCodes;
+        while(litCount > 257 && lit.mLength[litCount - 1] == 0)
+            litCount--;
+
+        int distCount = kDistCodes;
+        while(distCount > 1 && dist.mLength[distCount - 1] == 0)
+            distCount--;
+
+        // Both length sequences are sent as one, run-length encoded with codes 16-18
+        std::vector<uint8_t> lengths(lit.mLength, lit.mLength + litCount);
+        lengths.insert(lengths.end(), dist.mLength, dist.mLength + distCount);
+
+        std::vector<uint16_t> rle; // code | extra << 8
+        for(size_t i=0; i<lengths.size();)
+        {
+            const uint8_t len = lengths[i];
+            size_t run = 1;
+            while(i + run < lengths.size() && lengths[i + run] == len)
+                run++;
+
+            size_t left = run;
+            if(len == 0)
+            {
+                while(left >= 11)
+                {
+                    const size_t n = std::min<size_t>(left, 138);
+                    rle.push_back(uint16_t(18 | ((n - 11) << 8)));
+                    left -= n;
+                }
+                if(left >= 3)
+                {
+                    rle.push_back(uint16_t(17 | ((left - 3) << 8)));
+                    left = 0;
+                }
+            }
+            else
+            {
+                rle.push_back(len);
+                left--;
+                while(left >= 3)
+                {
+                    const size_t n = std::min<size_t>(left, 6);
+                    rle.push_back(uint16_t(16 | ((n - 3) << 8)));
+                    left -= n;
+                }
+            }
+
+            for(; left>0; left--)
+                rle.push_back(len);
+
+            i += run;
+        }
+
+        uint32_t codeLenFreq[kCodeLenCodes] = { 0 };
+        for(size_t i=0; i<rle.size(); i++)
+            codeLenFreq[rle[i] & 0xff]++;
+
+        // A complete code is required here, so it needs at least two symbols
+        if(kCodeLenCodes - std::count(codeLenFreq, codeLenFreq + kCodeLenCodes, 0u) < 2)
+            codeLenFreq[codeLenFreq[0] ? 1 : 0] = 1;
+
+        uint8_t  codeLenLength[kCodeLenCodes];
+        uint16_t codeLenCode[kCodeLenCodes];
+        BuildLengths(codeLenFreq, kCodeLenCodes, 7, codeLenLength);
+        BuildCodes(codeLenLength, kCodeLenCodes, codeLenCode);
+
+        static const uint8_t order[kCodeLenCodes] = {
+            16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+
+        int codeLenCount = kCodeLenCodes;
+        while(codeLenCount > 4 && codeLenLength[order[codeLenCount - 1]] == 0)
+            codeLenCount--;
+
+        // Block header
+        aoBits.Put(aFinal ? 1 : 0, 1);
+        aoBits.Put(2, 2); // dynamic Huffman
+        aoBits.Put(litCount - 257, 5);
+        aoBits.Put(distCount - 1, 5);
+        aoBits.Put(codeLenCount - 4, 4);
+
+        for(int i=0; i<codeLenCount; i++)
+            aoBits.Put(codeLenLength[order[i]], 3);
+
+        static const uint8_t rleExtraBits[3] = { 2, 3, 7 };
+        for(size_t i=0; i<rle.size(); i++)
+        {
+            const int code = rle[i] & 0xff;
+            aoBits.Put(codeLenCode[code], codeLenLength[code]);
+
+            if(code >= 16)
+                aoBits.Put(rle[i] >> 8, rleExtraBits[code - 16]);
+        }
+
+        // Block data
+        for(size_t i=0; i<aSymbols.size(); i++)
+        {
+            const uint32_t symbol = aSymbols[i];
+
+            if(symbol & kMatchFlag)
+            {
+                int code, extraBits, extra;
+                LengthCode((symbol >> 16) & 0x7fff, code, extraBits, extra);
+                aoBits.Put(lit.mCode[code], lit.mLength[code]);
+                aoBits.Put(extra, extraBits);
+
+                DistanceCode(symbol & 0xffff, code, extraBits, extra);
+                aoBits.Put(dist.mCode[code], dist.mLength[code]);
+                aoBits.Put(extra, extraBits);
+            }
+            else
+                aoBits.Put(lit.mCode[symbol], lit.mLength[symbol]);
+        }
+
+        aoBits.Put(lit.mCode[256], lit.mLength[256]);
+    }
+};
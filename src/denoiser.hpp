@@ -0,0 +1,354 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "math.hpp"
+#include "utils.hpp"
+#include "framebuffer.hpp"
+#include "tasks.hpp"
+
+//////////////////////////////////////////////////////////////////////////
+// Edge-avoiding a-trous wavelet denoiser
+//
+// This is the spatial part of SVGF (Schied et al. 2017). The image is
+// stripped of directly visible emission, demodulated by the first hit
+// albedo and filtered by a sequence of 5x5
+// B3-spline passes with doubling tap spacing. The edge-stopping weights
+// come from the normals, the depth and the per-pixel luminance variance.
+// All working buffers are planar and row-major, so the inner loops only touch
+// float arrays; the framebuffer tiles are read and written through PixelToIndex.
+class Denoiser
+{
+public:
+
+    Denoiser() :
+        mPasses(5),
+        mSigmaLuminance(4.f),
+        mSigmaNormal(128.f),
+        mSigmaDepth(1.f)
+    {}
+
+    // Framebuffer channels the denoiser needs
+    static const uint kRequiredChannels =
+        (1u << kChannelAlbedo) | (1u << kChannelNormal) | (1u << kChannelDepth) |
+        (1u << kChannelEmission) | (1u << kChannelSampleCount) | (1u << kChannelLumMoment);
+
+    // Whether the framebuffer has all channels the denoiser needs
+    static bool CanDenoise(const Framebuffer &aFramebuffer)
+    {
+        return (aFramebuffer.GetChannelMask() & kRequiredChannels) == kRequiredChannels;
+    }
+
+    // Denoises the color of an averaged framebuffer in place, does nothing without the required channels
+    void Run(Framebuffer &aoFramebuffer)
+    {
+        if(!CanDenoise(aoFramebuffer) || mPasses <= 0)
+            return;
+
+        mResX = aoFramebuffer.GetResX();
+        mResY = aoFramebuffer.GetResY();
+
+        const size_t count = size_t(mResX) * mResY;
+
+        for(int c=0; c<3; c++)
+        {
+            mColor[0][c].resize(count);
+            mColor[1][c].resize(count);
+            mNormal[c].resize(count);
+        }
+
+        mVariance[0].resize(count);
+        mVariance[1].resize(count);
+        mFilteredVariance.resize(count);
+        mDepth.resize(count);
+        mDepthGradient.resize(count);
+        mSamples.resize(count);
+
+        Demodulate(aoFramebuffer);
+        EstimateSpatialVariance();
+
+        int src = 0;
+        for(int pass=0; pass<mPasses; pass++)
+        {
+            FilterPass(1 << pass, src, 1 - src);
+            src = 1 - src;
+        }
+
+        Remodulate(aoFramebuffer, src);
+    }
+
+public:
+
+    int   mPasses;         //!< Number of a-trous passes, tap spacing is 2^pass
+    float mSigmaLuminance; //!< Luminance weight, in standard deviations
+    float mSigmaNormal;    //!< Exponent of the normal weight
+    float mSigmaDepth;     //!< Depth weight, relative to the local depth gradient
+
+private:
+
+    static constexpr float kLumWeights[3] = { 0.212671f, 0.715160f, 0.072169f };
+
+    static float AlbedoDemod(float aAlbedo)
+    {
+        return aAlbedo > 1e-3f ? aAlbedo : 1.f;
+    }
+
+    void Demodulate(const Framebuffer &aFramebuffer)
+    {
+        const float *samples = aFramebuffer.GetPlane(kChannelSampleCount);
+        const float *moment  = aFramebuffer.GetPlane(kChannelLumMoment);
+        const float *depth   = aFramebuffer.GetPlane(kChannelDepth);
+
+        const float *color[3], *emission[3], *albedo[3], *normal[3];
+        for(int c=0; c<3; c++)
+        {
+            color[c]    = aFramebuffer.GetPlane(kChannelColor, c);
+            emission[c] = aFramebuffer.GetPlane(kChannelEmission, c);
+            albedo[c]   = aFramebuffer.GetPlane(kChannelAlbedo, c);
+            normal[c]   = aFramebuffer.GetPlane(kChannelNormal, c);
+        }
+
+        TaskSystem::ParallelFor(0, mResY, 8, [&](int aFirst, int aLast)
+        {
+            for(int y=aFirst; y<aLast; y++)
+            {
+                for(int x=0; x<mResX; x++)
+                {
+                    const int i = x + y * mResX;
+                    const int f = aFramebuffer.PixelToIndex(x, y);
+
+                    float albedoLum = 0.f, reflectedLum = 0.f, normalLenSqr = 0.f;
+
+                    for(int c=0; c<3; c++)
+                    {
+                        const float a = AlbedoDemod(albedo[c][f]);
+                        const float reflected = color[c][f] - emission[c][f];
+
+                        mColor[0][c][i] = reflected / a;
+                        mNormal[c][i]   = normal[c][f];
+
+                        albedoLum    += kLumWeights[c] * a;
+                        reflectedLum += kLumWeights[c] * reflected;
+                        normalLenSqr += Sqr(mNormal[c][i]);
+                    }
+
+                    // Averaged normals are shorter at geometric edges, renormalize them
+                    const float invLen = normalLenSqr > 0.f ? 1.f / std::sqrt(normalLenSqr) : 0.f;
+                    for(int c=0; c<3; c++)
+                        mNormal[c][i] *= invLen;
+
+                    mDepth[i]   = depth[f];
+                    mSamples[i] = samples[f];
+
+                    // Variance of the pixel mean, moved to the demodulated domain
+                    const float variance = std::max(0.f, moment[f] - Sqr(reflectedLum)) / std::max(1.f, samples[f]);
+                    mVariance[0][i] = variance / Sqr(albedoLum);
+                }
+            }
+        });
+
+        TaskSystem::ParallelFor(0, mResY, 8, [&](int aFirst, int aLast)
+        {
+            for(int y=aFirst; y<aLast; y++)
+            {
+                for(int x=0; x<mResX; x++)
+                {
+                    const int xl = std::max(x - 1, 0), xr = std::min(x + 1, mResX - 1);
+                    const int yd = std::max(y - 1, 0), yu = std::min(y + 1, mResY - 1);
+
+                    const float dx = std::abs(mDepth[xr + y*mResX] - mDepth[xl + y*mResX]) / std::max(1, xr - xl);
+                    const float dy = std::abs(mDepth[x + yu*mResX] - mDepth[x + yd*mResX]) / std::max(1, yu - yd);
+                    mDepthGradient[x + y*mResX] = std::max(dx, dy);
+                }
+            }
+        });
+    }
+
+    // Few samples do not give a usable variance estimate, such pixels
+    // get the luminance variance of their 5x5 neighbourhood instead
+    void EstimateSpatialVariance()
+    {
+        TaskSystem::ParallelFor(0, mResY, 8, [&](int aFirst, int aLast)
+        {
+            for(int y=aFirst; y<aLast; y++)
+            {
+                for(int x=0; x<mResX; x++)
+                {
+                    if(mSamples[x + y*mResX] >= 4.f)
+                        continue;
+
+                    float sum = 0.f, sumSqr = 0.f;
+                    int   taps = 0;
+
+                    for(int yy=std::max(y - 2, 0); yy<=std::min(y + 2, mResY - 1); yy++)
+                    {
+                        for(int xx=std::max(x - 2, 0); xx<=std::min(x + 2, mResX - 1); xx++)
+                        {
+                            const float lum = LuminanceAt(0, xx + yy*mResX);
+                            sum    += lum;
+                            sumSqr += lum * lum;
+                            taps++;
+                        }
+                    }
+
+                    const float mean = sum / taps;
+                    mVariance[1][x + y*mResX] = std::max(0.f, sumSqr / taps - mean * mean);
+                }
+            }
+        });
+
+        TaskSystem::ParallelFor(0, mResY, 8, [&](int aFirst, int aLast)
+        {
+            for(int y=aFirst; y<aLast; y++)
+            {
+                for(int x=0; x<mResX; x++)
+                {
+                    if(mSamples[x + y*mResX] < 4.f)
+                        mVariance[0][x + y*mResX] = mVariance[1][x + y*mResX];
+                }
+            }
+        });
+    }
+
+    float LuminanceAt(int aBuffer, int aIndex) const
+    {
+        return kLumWeights[0] * mColor[aBuffer][0][aIndex] +
+               kLumWeights[1] * mColor[aBuffer][1][aIndex] +
+               kLumWeights[2] * mColor[aBuffer][2][aIndex];
+    }
+
+    void FilterPass(
+        int aStep,
+        int aSrc,
+        int aDst)
+    {
+        static const float kernel[5] = { 1.f/16.f, 1.f/4.f, 3.f/8.f, 1.f/4.f, 1.f/16.f };
+
+        const std::vector<float> &varIn  = mVariance[aSrc];
+        std::vector<float>       &varOut = mVariance[aDst];
+
+        // The luminance weight uses 3x3 blurred variance, which is far more stable
+        TaskSystem::ParallelFor(0, mResY, 8, [&](int aFirst, int aLast)
+        {
+            for(int y=aFirst; y<aLast; y++)
+            {
+                for(int x=0; x<mResX; x++)
+                {
+                    float sum = 0.f, weight = 0.f;
+
+                    for(int dy=-1; dy<=1; dy++)
+                    {
+                        const int yy = y + dy;
+                        if(yy < 0 || yy >= mResY) continue;
+
+                        for(int dx=-1; dx<=1; dx++)
+                        {
+                            const int xx = x + dx;
+                            if(xx < 0 || xx >= mResX) continue;
+
+                            const float w = (dx == 0 ? 0.5f : 0.25f) * (dy == 0 ? 0.5f : 0.25f);
+                            sum    += w * varIn[xx + yy*mResX];
+                            weight += w;
+                        }
+                    }
+
+                    mFilteredVariance[x + y*mResX] = sum / weight;
+                }
+            }
+        });
+
+        TaskSystem::ParallelFor(0, mResY, 8, [&](int aFirst, int aLast)
+        {
+            for(int y=aFirst; y<aLast; y++)
+            {
+                for(int x=0; x<mResX; x++)
+                {
+                    const int   p   = x + y*mResX;
+                    const float lp  = LuminanceAt(aSrc, p);
+                    const float nxp = mNormal[0][p], nyp = mNormal[1][p], nzp = mNormal[2][p];
+                    const float zp  = mDepth[p];
+
+                    const float lumDenom   = mSigmaLuminance * std::sqrt(mFilteredVariance[p]) + 1e-6f;
+                    const float depthDenom = mSigmaDepth * mDepthGradient[p] * aStep + 1e-6f;
+
+                    float r = 0.f, g = 0.f, b = 0.f, var = 0.f, weight = 0.f;
+
+                    for(int ky=0; ky<5; ky++)
+                    {
+                        const int yy = y + (ky - 2) * aStep;
+                        if(yy < 0 || yy >= mResY) continue;
+
+                        for(int kx=0; kx<5; kx++)
+                        {
+                            const int xx = x + (kx - 2) * aStep;
+                            if(xx < 0 || xx >= mResX) continue;
+
+                            const int q = xx + yy*mResX;
+
+                            const float nDot = nxp * mNormal[0][q] + nyp * mNormal[1][q] + nzp * mNormal[2][q];
+                            const float wNormal = std::pow(std::max(0.f, nDot), mSigmaNormal);
+
+                            const float dist  = float(std::max(std::abs(kx - 2), std::abs(ky - 2)));
+                            const float wDepth = std::abs(zp - mDepth[q]) / (depthDenom * dist + 1e-6f);
+                            const float wLum   = std::abs(lp - LuminanceAt(aSrc, q)) / lumDenom;
+
+                            // The center tap always participates, so the weight sum is never zero
+                            const float w = (q == p) ? kernel[2] * kernel[2] :
+                                kernel[kx] * kernel[ky] * wNormal * std::exp(-wDepth - wLum);
+
+                            r      += w * mColor[aSrc][0][q];
+                            g      += w * mColor[aSrc][1][q];
+                            b      += w * mColor[aSrc][2][q];
+                            var    += w * w * varIn[q];
+                            weight += w;
+                        }
+                    }
+
+                    const float invWeight = 1.f / weight;
+                    mColor[aDst][0][p] = r * invWeight;
+                    mColor[aDst][1][p] = g * invWeight;
+                    mColor[aDst][2][p] = b * invWeight;
+                    varOut[p] = var * invWeight * invWeight;
+                }
+            }
+        });
+    }
+
+    void Remodulate(
+        Framebuffer &aoFramebuffer,
+        int         aSrc)
+    {
+        for(int c=0; c<3; c++)
+        {
+            float       *color    = aoFramebuffer.GetPlane(kChannelColor, c);
+            const float *emission = aoFramebuffer.GetPlane(kChannelEmission, c);
+            const float *albedo   = aoFramebuffer.GetPlane(kChannelAlbedo, c);
+            const float *filtered = mColor[aSrc][c].data();
+
+            TaskSystem::ParallelFor(0, mResY, 8, [&](int aFirst, int aLast)
+            {
+                for(int y=aFirst; y<aLast; y++)
+                {
+                    for(int x=0; x<mResX; x++)
+                    {
+                        const int f = aoFramebuffer.PixelToIndex(x, y);
+                        color[f] = filtered[x + y*mResX] * AlbedoDemod(albedo[f]) + emission[f];
+                    }
+                }
+            });
+        }
+    }
+
+private:
+
+    int                mResX;
+    int                mResY;
+    std::vector<float> mColor[2][3];      //!< Ping-pong planar demodulated color
+    std::vector<float> mVariance[2];      //!< Ping-pong luminance variance
+    std::vector<float> mFilteredVariance;
+    std::vector<float> mNormal[3];
+    std::vector<float> mDepth;
+    std::vector<float> mDepthGradient;
+    std::vector<float> mSamples;
+};
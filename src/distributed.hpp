@@ -0,0 +1,229 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <string.h>
+#include <stdint.h>
+#include "framebuffer.hpp"
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// Rendering split over several processes
+//
+// Every worker renders its own share of the iterations with its own seeds
+// and produces a partial accumulation: the framebuffer summed over all its
+// iterations, not yet averaged, and the number of iterations. Partials are
+// merged by adding them up and dividing by the total iteration count, so
+// the result does not depend on how the iterations were split.
+
+// Seeds of the renderers within one worker are consecutive, workers are this far apart
+const int kWorkerSeedStride = 1 << 16;
+
+// Iterations [oFirst, oFirst + oCount) out of aIterations rendered by worker aIndex of aCount
+void WorkerIterationRange(
+    int aIterations,
+    int aIndex,
+    int aCount,
+    int &oFirst,
+    int &oCount)
+{
+    oFirst = int(int64_t(aIterations) * aIndex / aCount);
+    oCount = int(int64_t(aIterations) * (aIndex + 1) / aCount) - oFirst;
+}
+
+class PartialAccumulation
+{
+public:
+
+    PartialAccumulation() : mIterations(0)
+    {}
+
+    void Write(std::ostream &aoStream) const
+    {
+        aoStream.write(kMagic, sizeof(kMagic));
+        aoStream.write(reinterpret_cast<const char*>(&mIterations), sizeof(mIterations));
+        mSum.SaveState(aoStream);
+    }
+
+    bool Read(std::istream &aoStream)
+    {
+        char magic[sizeof(kMagic)];
+        aoStream.read(magic, sizeof(magic));
+        aoStream.read(reinterpret_cast<char*>(&mIterations), sizeof(mIterations));
+
+        if(!aoStream || memcmp(magic, kMagic, sizeof(kMagic)) != 0 || mIterations < 0)
+            return false;
+
+        return mSum.LoadState(aoStream, true);
+    }
+
+    bool Save(const char *aFilename) const
+    {
+        std::ofstream file(aFilename, std::ios::binary);
+        Write(file);
+        return bool(file);
+    }
+
+    bool Load(const char *aFilename)
+    {
+        std::ifstream file(aFilename, std::ios::binary);
+        return Read(file);
+    }
+
+    // Adds another partial of the same resolution and channels
+    bool Add(const PartialAccumulation &aOther)
+    {
+        if(mIterations == 0 && mSum.GetResX() == 0)
+        {
+            *this = aOther;
+            return true;
+        }
+
+        if(aOther.mSum.GetResX() != mSum.GetResX() || aOther.mSum.GetResY() != mSum.GetResY() ||
+            aOther.mSum.GetChannelMask() != mSum.GetChannelMask())
+            return false;
+
+        mSum.Add(aOther.mSum);
+        mIterations += aOther.mIterations;
+        return true;
+    }
+
+    // Averages the sum into the final image
+    void Resolve(Framebuffer &oFramebuffer) const
+    {
+        oFramebuffer.Reduce(std::vector<const Framebuffer*>(1, &mSum),
+            std::vector<float>(1, mIterations > 0 ? 1.f / mIterations : 1.f));
+    }
+
+public:
+
+    Framebuffer mSum;        //!< Sum over all iterations, not averaged
+    int         mIterations; //!< Samples per pixel in mSum
+
+private:
+
+    static constexpr char kMagic[8] = { 'P', 'G', '3', 'P', 'A', 'R', 'T', '2' };
+};
+
+/**
+ * Local coordinator: forks worker processes and merges what they send back
+ * through pipes. Must be called before the task system is started, its
+ * worker threads do not survive a fork; aWork starts the worker's own.
+ * Arguments:
+ *  - aCount = number of worker processes
+ *  - aWork = run in each worker with its index, renders the partial accumulation
+ * Returns:
+ *  - false when a worker could not be started or did not deliver its result
+ */
+bool RunLocalWorkers(
+    int                                              aCount,
+    std::function<void(int, PartialAccumulation&)>  aWork,
+    PartialAccumulation                              &oMerged)
+{
+#if defined(_WIN32)
+    (void)aCount; (void)aWork; (void)oMerged;
+    printf("Worker processes are not supported on this platform\n");
+    return false;
+#else
+    std::vector<pid_t> pids(aCount, -1);
+    std::vector<int>   fds(aCount, -1);
+    bool ok = true;
+
+    fflush(stdout);
+
+    for(int i=0; i<aCount && ok; i++)
+    {
+        int fd[2];
+        if(pipe(fd) != 0)
+        {
+            ok = false;
+            break;
+        }
+
+        const pid_t pid = fork();
+        if(pid < 0)
+        {
+            close(fd[0]);
+            close(fd[1]);
+            ok = false;
+            break;
+        }
+
+        if(pid == 0)
+        {
+            // Worker: the pipes of the earlier workers belong to the coordinator
+            close(fd[0]);
+            for(int j=0; j<i; j++)
+                close(fds[j]);
+
+            // Progress of many workers would only garble the terminal
+            if(!freopen("/dev/null", "w", stdout))
+                _exit(1);
+
+            PartialAccumulation partial;
+            aWork(i, partial);
+
+            std::ostringstream stream;
+            partial.Write(stream);
+            const std::string data = stream.str();
+
+            size_t written = 0;
+            while(written < data.size())
+            {
+                const ssize_t res = write(fd[1], data.data() + written, data.size() - written);
+                if(res <= 0)
+                    _exit(1);
+                written += size_t(res);
+            }
+
+            close(fd[1]);
+            _exit(0);
+        }
+
+        close(fd[1]);
+        pids[i] = pid;
+        fds[i]  = fd[0];
+    }
+
+    // Workers that are done block on their pipe until they are read, which costs nothing
+    for(int i=0; i<aCount; i++)
+    {
+        if(fds[i] < 0)
+            continue;
+
+        std::string data;
+        char buffer[1 << 16];
+        ssize_t res;
+        while((res = read(fds[i], buffer, sizeof(buffer))) > 0)
+            data.append(buffer, size_t(res));
+        close(fds[i]);
+
+        std::istringstream stream(data);
+        PartialAccumulation partial;
+        if(!ok || res < 0 || !partial.Read(stream) || !oMerged.Add(partial))
+            ok = false;
+    }
+
+    for(int i=0; i<aCount; i++)
+    {
+        if(pids[i] < 0)
+            continue;
+
+        int status = 0;
+        if(waitpid(pids[i], &status, 0) != pids[i] || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ok = false;
+    }
+
+    return ok;
+#endif
+}
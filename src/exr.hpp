@@ -0,0 +1,297 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include "tasks.hpp"
+#include "deflate.hpp"
+
+//////////////////////////////////////////////////////////////////////////
+// Minimal OpenEXR writer
+//
+// Writes single-part scanline files with any number of half or float
+// channels, uncompressed or with ZIP/ZIPS compression. Chunks are
+// compressed in parallel and the file goes out in a single write.
+// Only little-endian hosts are supported, which is what EXR stores on disk.
+class ExrWriter
+{
+public:
+
+    enum PixelType
+    {
+        kPixelHalf  = 1,
+        kPixelFloat = 2
+    };
+
+    enum Compression
+    {
+        kNoCompression   = 0,
+        kZipsCompression = 2, //!< Deflate, one scanline per chunk
+        kZipCompression  = 3  //!< Deflate, 16 scanlines per chunk
+    };
+
+    ExrWriter(Compression aCompression = kZipCompression) : mCompression(aCompression)
+    {}
+
+    /**
+     * Adds a channel to the file
+     * Arguments:
+     *  - aName = full channel name, e.g. "R" or "albedo.R"
+     *  - aData = aResX * aResY floats in row-major order, first row is the top of the image
+     *  - aType = how the channel is stored in the file
+     */
+    void AddChannel(
+        const std::string &aName,
+        const float       *aData,
+        PixelType         aType = kPixelFloat)
+    {
+        Channel channel;
+        channel.mName = aName;
+        channel.mData = aData;
+        channel.mType = aType;
+        mChannels.push_back(channel);
+    }
+
+    // Rounds to nearest even, overflows to infinity
+    static uint16_t FloatToHalf(float aValue)
+    {
+        uint32_t bits;
+        memcpy(&bits, &aValue, 4);
+
+        const uint32_t sign = (bits >> 16) & 0x8000;
+        const uint32_t absBits = bits & 0x7fffffff;
+
+        // Infinity and NaN
+        if(absBits >= 0x7f800000)
+            return uint16_t(sign | 0x7c00 | (absBits > 0x7f800000 ? 0x200 : 0));
+
+        // Rounds to infinity (65520 and above)
+        if(absBits >= 0x477ff000)
+            return uint16_t(sign | 0x7c00);
+
+        // Half subnormals and zero
+        if(absBits < 0x38800000)
+        {
+            if(absBits < 0x33000000)
+                return uint16_t(sign);
+
+            const int      shift     = 126 - int(absBits >> 23);
+            const uint32_t mantissa  = (absBits & 0x7fffff) | 0x800000;
+            uint32_t       res       = mantissa >> shift;
+            const uint32_t remainder = mantissa & ((1u << shift) - 1);
+            const uint32_t halfway   = 1u << (shift - 1);
+
+            if(remainder > halfway || (remainder == halfway && (res & 1)))
+                res++;
+
+            return uint16_t(sign | res);
+        }
+
+        // Normal numbers, rebias the exponent from 127 to 15
+        uint32_t res = (absBits - 0x38000000) >> 13;
+        const uint32_t remainder = absBits & 0x1fff;
+
+        if(remainder > 0x1000 || (remainder == 0x1000 && (res & 1)))
+            res++;
+
+        return uint16_t(sign | res);
+    }
+
+    bool Write(
+        const char *aFilename,
+        int        aResX,
+        int        aResY)
+    {
+        // Readers require the channel list sorted by name
+        std::sort(mChannels.begin(), mChannels.end(),
+            [](const Channel &a, const Channel &b) { return a.mName < b.mName; });
+
+        std::vector<char> file;
+
+        // Magic number and version 2, single-part scanline file
+        PutInt(file, 20000630);
+        PutInt(file, 2);
+
+        // Header
+        std::vector<char> chlist;
+        for(size_t c=0; c<mChannels.size(); c++)
+        {
+            PutString(chlist, mChannels[c].mName);
+            PutInt(chlist, mChannels[c].mType);
+            PutInt(chlist, 0);  // pLinear and reserved bytes
+            PutInt(chlist, 1);  // xSampling
+            PutInt(chlist, 1);  // ySampling
+        }
+        chlist.push_back(0);
+
+        std::vector<char> box;
+        PutInt(box, 0);
+        PutInt(box, 0);
+        PutInt(box, aResX - 1);
+        PutInt(box, aResY - 1);
+
+        std::vector<char> value;
+
+        PutAttribute(file, "channels", "chlist", chlist);
+        value.assign(1, char(mCompression));
+        PutAttribute(file, "compression", "compression", value);
+        PutAttribute(file, "dataWindow", "box2i", box);
+        PutAttribute(file, "displayWindow", "box2i", box);
+        value.assign(1, 0); // increasing y
+        PutAttribute(file, "lineOrder", "lineOrder", value);
+        value.clear();
+        PutFloat(value, 1.f);
+        PutAttribute(file, "pixelAspectRatio", "float", value);
+        value.clear();
+        PutFloat(value, 0.f);
+        PutFloat(value, 0.f);
+        PutAttribute(file, "screenWindowCenter", "v2f", value);
+        value.clear();
+        PutFloat(value, 1.f);
+        PutAttribute(file, "screenWindowWidth", "float", value);
+        file.push_back(0);
+
+        // Chunks are encoded independently, so they can go in parallel
+        const int linesPerChunk = (mCompression == kZipCompression) ? 16 : 1;
+        const int chunkCount    = (aResY + linesPerChunk - 1) / linesPerChunk;
+        std::vector<std::vector<uint8_t> > chunks(chunkCount);
+
+        TaskSystem::ParallelFor(0, chunkCount, 1, [&](int aFirst, int aLast)
+        {
+            for(int chunk=aFirst; chunk<aLast; chunk++)
+            {
+                const int y0 = chunk * linesPerChunk;
+                const int y1 = std::min(aResY, y0 + linesPerChunk);
+                EncodeChunk(y0, y1, aResX, chunks[chunk]);
+            }
+        });
+
+        // Offset table, followed by the chunks
+        const size_t tableStart = file.size();
+        size_t offset = tableStart + chunkCount * sizeof(uint64_t);
+        file.resize(offset);
+
+        for(int chunk=0; chunk<chunkCount; chunk++)
+        {
+            const uint64_t chunkOffset = offset;
+            memcpy(&file[tableStart + chunk * sizeof(uint64_t)], &chunkOffset, sizeof(uint64_t));
+            offset += 8 + chunks[chunk].size();
+        }
+
+        file.reserve(offset);
+        for(int chunk=0; chunk<chunkCount; chunk++)
+        {
+            PutInt(file, chunk * linesPerChunk);
+            PutInt(file, int32_t(chunks[chunk].size()));
+            file.insert(file.end(), chunks[chunk].begin(), chunks[chunk].end());
+        }
+
+        std::ofstream exr(aFilename, std::ios::binary);
+        exr.write(file.data(), file.size());
+        exr.close();
+        return bool(exr);
+    }
+
+private:
+
+    struct Channel
+    {
+        std::string  mName;
+        const float *mData;
+        PixelType    mType;
+    };
+
+    // Pixel data of lines [aY0, aY1), each line holds all channels one after another
+    void EncodeChunk(
+        int                  aY0,
+        int                  aY1,
+        int                  aResX,
+        std::vector<uint8_t> &oData) const
+    {
+        std::vector<uint8_t> raw;
+
+        for(int y=aY0; y<aY1; y++)
+        {
+            for(size_t c=0; c<mChannels.size(); c++)
+            {
+                const float *src = mChannels[c].mData + size_t(y) * aResX;
+
+                if(mChannels[c].mType == kPixelHalf)
+                {
+                    const size_t start = raw.size();
+                    raw.resize(start + aResX * sizeof(uint16_t));
+
+                    for(int x=0; x<aResX; x++)
+                    {
+                        const uint16_t half = FloatToHalf(src[x]);
+                        memcpy(&raw[start + x * sizeof(uint16_t)], &half, sizeof(uint16_t));
+                    }
+                }
+                else
+                {
+                    const uint8_t *bytes = reinterpret_cast<const uint8_t*>(src);
+                    raw.insert(raw.end(), bytes, bytes + aResX * sizeof(float));
+                }
+            }
+        }
+
+        if(mCompression == kNoCompression)
+        {
+            oData.swap(raw);
+            return;
+        }
+
+        // ZIP predictor: bytes are split into even and odd halves and delta encoded
+        std::vector<uint8_t> shuffled(raw.size());
+        const size_t half = (raw.size() + 1) / 2;
+        for(size_t i=0; i<raw.size(); i++)
+            shuffled[(i & 1) ? half + i / 2 : i / 2] = raw[i];
+
+        for(size_t i=shuffled.size()-1; i>0; i--)
+            shuffled[i] = uint8_t(int(shuffled[i]) - int(shuffled[i - 1]) + 128);
+
+        DeflateCompressor::Compress(shuffled.data(), shuffled.size(), oData);
+
+        // Chunks that do not shrink are stored raw, readers detect it by the size
+        if(oData.size() >= raw.size())
+            oData.swap(raw);
+    }
+
+    static void PutInt(std::vector<char> &aoBuffer, int32_t aValue)
+    {
+        const char *bytes = reinterpret_cast<const char*>(&aValue);
+        aoBuffer.insert(aoBuffer.end(), bytes, bytes + 4);
+    }
+
+    static void PutFloat(std::vector<char> &aoBuffer, float aValue)
+    {
+        const char *bytes = reinterpret_cast<const char*>(&aValue);
+        aoBuffer.insert(aoBuffer.end(), bytes, bytes + 4);
+    }
+
+    static void PutString(std::vector<char> &aoBuffer, const std::string &aValue)
+    {
+        aoBuffer.insert(aoBuffer.end(), aValue.begin(), aValue.end());
+        aoBuffer.push_back(0);
+    }
+
+    static void PutAttribute(
+        std::vector<char>       &aoBuffer,
+        const char              *aName,
+        const char              *aType,
+        const std::vector<char> &aValue)
+    {
+        PutString(aoBuffer, aName);
+        PutString(aoBuffer, aType);
+        PutInt(aoBuffer, int32_t(aValue.size()));
+        aoBuffer.insert(aoBuffer.end(), aValue.begin(), aValue.end());
+    }
+
+private:
+
+    std::vector<Channel> mChannels;
+    Compression          mCompression;
+};
@@ -3,61 +3,365 @@
 #include <vector>
 #include <cmath>
 #include <fstream>
+#include <iostream>
 #include <string.h>
+#include <string>
+#include <sstream>
+#include <algorithm>
 #include "utils.hpp"
+#include "tasks.hpp"
+#include "exr.hpp"
+#include "png.hpp"
+#include "tonemap.hpp"
+
+//////////////////////////////////////////////////////////////////////////
+// Framebuffer channels (arbitrary output variables)
+enum FramebufferChannel
+{
+    kChannelColor = 0,   //!< Final radiance, always present
+    kChannelAlbedo,      //!< First hit reflectance
+    kChannelNormal,      //!< First hit shading normal
+    kChannelDepth,       //!< First hit distance from the camera
+    kChannelEmission,    //!< Directly visible emission
+    kChannelDirect,      //!< Direct illumination
+    kChannelIndirect,    //!< Indirect illumination (zero for direct-only integrators)
+    kChannelSampleCount, //!< Number of samples taken in the pixel
+    kChannelLumMoment,   //!< Second moment of the sample luminance
+    kChannelCount
+};
+
+const uint kChannelMaskColor = 1u << kChannelColor;
+
+struct FramebufferChannelInfo
+{
+    const char *mName;          //!< Layer name, also used on the command line
+    const char *mComponents;    //!< One character per component, used as channel suffix
+    bool        mAveraged;      //!< Whether Scale applies, counts are only summed
+    bool        mHalfPrecision; //!< Whether half floats are precise enough when saving
+};
+
+const FramebufferChannelInfo& GetChannelInfo(int aChannel)
+{
+    static const FramebufferChannelInfo infos[kChannelCount] = {
+        { "color",     "RGB", true,  true  },
+        { "albedo",    "RGB", true,  true  },
+        { "normal",    "XYZ", true,  true  },
+        { "depth",     "Z",   true,  false },
+        { "emission",  "RGB", true,  true  },
+        { "direct",    "RGB", true,  true  },
+        { "indirect",  "RGB", true,  true  },
+        { "samples",   "Y",   false, false },
+        { "lumMoment", "Y",   true,  false }
+    };
 
+    return infos[aChannel];
+}
+
+int GetChannelComponents(int aChannel)
+{
+    return int(strlen(GetChannelInfo(aChannel).mComponents));
+}
+
+// Returns the channel of the given name, or -1 when there is none
+int FindChannel(const std::string &aName)
+{
+    for(int c=0; c<kChannelCount; c++)
+        if(aName == GetChannelInfo(c).mName)
+            return c;
+
+    return -1;
+}
+
+// Multi-channel framebuffer. Every channel is stored as planar float arrays,
+// one per component, and channels outside of the mask are not allocated.
+//
+// Pixels are stored in 8x8 tiles, Morton ordered inside the tile, with the
+// tiles in row-major order. A tile of one component is 256 bytes, so nearby
+// samples of a few rows share cache lines instead of touching a line per row.
+// The resolution is padded to whole tiles; the padding stays zero. Rows are
+// only assembled when saving, use PixelToIndex for anything else.
 class Framebuffer
 {
 public:
 
-    Framebuffer()
+    static const int kTileBits = 3;
+    static const int kTileSize = 1 << kTileBits; //!< Tile edge in pixels
+
+    Framebuffer() : mResX(0), mResY(0), mTilesX(0), mPixelCount(0)
     {}
 
     //////////////////////////////////////////////////////////////////////////
     // Accumulation
+
+    // Returns index of the pixel containing the sample, or -1 when outside
+    int SampleToIndex(const Vec2f& aSample) const
+    {
+        if(aSample.x < 0 || aSample.x >= mResolution.x)
+            return -1;
+
+        if(aSample.y < 0 || aSample.y >= mResolution.y)
+            return -1;
+
+        return PixelToIndex(int(aSample.x), int(aSample.y));
+    }
+
+    // Returns index of the pixel in the tiled layout
+    int PixelToIndex(int aX, int aY) const
+    {
+        const int tile = (aY >> kTileBits) * mTilesX + (aX >> kTileBits);
+        return (tile << (2 * kTileBits)) | MortonCode(aX & (kTileSize - 1), aY & (kTileSize - 1));
+    }
+
     void AddColor(
         const Vec2f& aSample,
         const Vec3f& aColor)
     {
-        if(aSample.x < 0 || aSample.x >= mResolution.x)
+        const int idx = SampleToIndex(aSample);
+
+        if(idx < 0)
             return;
 
-        if(aSample.y < 0 || aSample.y >= mResolution.y)
+        Add(kChannelColor, idx, aColor);
+
+        // The denoiser derives per-pixel variance from it
+        Add(kChannelLumMoment, idx, Sqr(Luminance(aColor)));
+    }
+
+    // Accumulates directly visible emission, the denoiser keeps it out of the filtered signal
+    void AddEmission(
+        const Vec2f& aSample,
+        const Vec3f& aColor)
+    {
+        const int idx = SampleToIndex(aSample);
+
+        if(idx < 0)
             return;
 
-        int x = int(aSample.x);
-        int y = int(aSample.y);
+        Add(kChannelColor, idx, aColor);
+        Add(kChannelEmission, idx, aColor);
+    }
+
+    // Adds to a pixel of the channel, does nothing when the channel is not present
+    void Add(
+        int          aChannel,
+        int          aIndex,
+        const Vec3f& aValue)
+    {
+        if(!HasChannel(aChannel))
+            return;
 
-        mColor[x + y * mResX] = mColor[x + y * mResX] + aColor;
+        float *data = &mPlanes[aChannel][aIndex];
+        data[0]               += aValue.x;
+        data[mPixelCount]     += aValue.y;
+        data[2 * mPixelCount] += aValue.z;
+    }
+
+    void Add(
+        int   aChannel,
+        int   aIndex,
+        float aValue)
+    {
+        if(!HasChannel(aChannel))
+            return;
+
+        mPlanes[aChannel][aIndex] += aValue;
     }
 
     //////////////////////////////////////////////////////////////////////////
     // Methods for framebuffer operations
-    void Setup(const Vec2f& aResolution)
+    void Setup(
+        const Vec2f& aResolution,
+        uint         aChannelMask = kChannelMaskColor)
     {
-        mResolution = aResolution;
-        mResX = int(aResolution.x);
-        mResY = int(aResolution.y);
-        mColor.resize(mResX * mResY);
+        Allocate(aResolution, aChannelMask);
         Clear();
     }
 
     void Clear()
     {
-        // memset(&mColor[0], 0, sizeof(Vec3f) * mColor.size()); // Gives warnings
-        mColor.assign(mColor.size(), 0);
+        for(int c=0; c<kChannelCount; c++)
+            mPlanes[c].assign(mPlanes[c].size(), 0.f);
     }
 
     void Add(const Framebuffer& aOther)
     {
-        for(size_t i=0; i<mColor.size(); i++)
-            mColor[i] = mColor[i] + aOther.mColor[i];
+        for(int c=0; c<kChannelCount; c++)
+        {
+            if(!HasChannel(c) || !aOther.HasChannel(c))
+                continue;
+
+            float       *dst = mPlanes[c].data();
+            const float *src = aOther.mPlanes[c].data();
+
+            for(size_t i=0; i<mPlanes[c].size(); i++)
+                dst[i] += src[i];
+        }
     }
 
     void Scale(float aScale)
     {
-        for(size_t i=0; i<mColor.size(); i++)
-            mColor[i] = mColor[i] * Vec3f(aScale);
+        for(int c=0; c<kChannelCount; c++)
+        {
+            if(!GetChannelInfo(c).mAveraged)
+                continue;
+
+            float *dst = mPlanes[c].data();
+
+            for(size_t i=0; i<mPlanes[c].size(); i++)
+                dst[i] *= aScale;
+        }
+    }
+
+    /**
+     * Replaces the contents with the weighted sum of framebuffers of one setup,
+     * in a single parallel pass. Every block of the planes is summed in cache
+     * over all sources, so each source is read once and the result written
+     * once. The sum is taken in the order of the sources, as Scale and Add
+     * would, so the result does not depend on the number of threads.
+     * Arguments:
+     *  - aSources = framebuffers to sum, the setup is taken from the first
+     *  - aWeights = per source weights of the averaged channels, the other channels are summed
+     *  - aScale = applied to the averaged channels of the sum
+     */
+    void Reduce(
+        const std::vector<const Framebuffer*> &aSources,
+        const std::vector<float>              &aWeights,
+        float                                 aScale = 1.f)
+    {
+        if(aSources.empty())
+            return;
+
+        const Framebuffer &first = *aSources[0];
+        Allocate(first.mResolution, first.mChannelMask);
+
+        const int sourceCount = int(aSources.size());
+        std::vector<const float*> src(sourceCount);
+        std::vector<float>        weights(sourceCount);
+
+        for(int c=0; c<kChannelCount; c++)
+        {
+            if(!HasChannel(c))
+                continue;
+
+            const bool  averaged = GetChannelInfo(c).mAveraged;
+            const float scale    = averaged ? aScale : 1.f;
+
+            for(int i=0; i<sourceCount; i++)
+            {
+                src[i]     = aSources[i]->mPlanes[c].data();
+                weights[i] = averaged ? aWeights[i] : 1.f;
+            }
+
+            float     *dst       = mPlanes[c].data();
+            const int size       = int(mPlanes[c].size());
+            const int blockCount = (size + kReduceBlockSize - 1) / kReduceBlockSize;
+
+            TaskSystem::ParallelFor(0, blockCount, 1, [&](int aFirst, int aLast)
+            {
+                for(int block=aFirst; block<aLast; block++)
+                {
+                    const int begin = block * kReduceBlockSize;
+                    const int end   = std::min(begin + kReduceBlockSize, size);
+
+                    const float *src0    = src[0];
+                    const float weight0 = weights[0];
+
+#pragma omp simd
+                    for(int j=begin; j<end; j++)
+                        dst[j] = src0[j] * weight0;
+
+                    for(int i=1; i<sourceCount; i++)
+                    {
+                        const float *srcI    = src[i];
+                        const float weightI = weights[i];
+
+#pragma omp simd
+                        for(int j=begin; j<end; j++)
+                            dst[j] += srcI[j] * weightI;
+                    }
+
+                    if(scale != 1.f)
+                    {
+#pragma omp simd
+                        for(int j=begin; j<end; j++)
+                            dst[j] *= scale;
+                    }
+                }
+            });
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Raw contents in the tiled layout, for checkpoints and partial renders.
+    // Loading requires the same setup, unless aAdoptSetup is set.
+    void SaveState(std::ostream &aoStream) const
+    {
+        aoStream.write(reinterpret_cast<const char*>(&mResX), sizeof(mResX));
+        aoStream.write(reinterpret_cast<const char*>(&mResY), sizeof(mResY));
+        aoStream.write(reinterpret_cast<const char*>(&mChannelMask), sizeof(mChannelMask));
+
+        for(int c=0; c<kChannelCount; c++)
+            aoStream.write(reinterpret_cast<const char*>(mPlanes[c].data()), mPlanes[c].size() * sizeof(float));
+    }
+
+    bool LoadState(
+        std::istream &aoStream,
+        bool         aAdoptSetup = false)
+    {
+        int  resX = 0, resY = 0;
+        uint channelMask = 0;
+        aoStream.read(reinterpret_cast<char*>(&resX), sizeof(resX));
+        aoStream.read(reinterpret_cast<char*>(&resY), sizeof(resY));
+        aoStream.read(reinterpret_cast<char*>(&channelMask), sizeof(channelMask));
+
+        if(!aoStream || resX <= 0 || resY <= 0)
+            return false;
+
+        if(aAdoptSetup)
+            Setup(Vec2f(float(resX), float(resY)), channelMask);
+        else if(resX != mResX || resY != mResY || channelMask != mChannelMask)
+            return false;
+
+        for(int c=0; c<kChannelCount; c++)
+            aoStream.read(reinterpret_cast<char*>(mPlanes[c].data()), mPlanes[c].size() * sizeof(float));
+
+        return bool(aoStream);
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Accessors
+    int   GetResX() const                { return mResX; }
+    int   GetResY() const                { return mResY; }
+    uint  GetChannelMask() const         { return mChannelMask; }
+    bool  HasChannel(int aChannel) const { return (mChannelMask >> aChannel) & 1u; }
+
+    // Floats per component plane, including the tile padding
+    int   GetPlaneSize() const           { return mPixelCount; }
+
+    // Returns the plane of a channel component (tiled, see PixelToIndex),
+    // NULL when the channel is not present
+    float* GetPlane(int aChannel, int aComponent = 0)
+    {
+        return HasChannel(aChannel) ? &mPlanes[aChannel][size_t(aComponent) * mPixelCount] : NULL;
+    }
+
+    const float* GetPlane(int aChannel, int aComponent = 0) const
+    {
+        return HasChannel(aChannel) ? &mPlanes[aChannel][size_t(aComponent) * mPixelCount] : NULL;
+    }
+
+    Vec3f GetColor(int aIndex) const
+    {
+        const float *data = &mPlanes[kChannelColor][aIndex];
+        return Vec3f(data[0], data[mPixelCount], data[2 * mPixelCount]);
+    }
+
+    void SetColor(int aIndex, const Vec3f& aColor)
+    {
+        float *data = &mPlanes[kChannelColor][aIndex];
+        data[0]               = aColor.x;
+        data[mPixelCount]     = aColor.y;
+        data[2 * mPixelCount] = aColor.z;
     }
 
     //////////////////////////////////////////////////////////////////////////
@@ -70,63 +374,137 @@ public:
         {
             for(int x=0; x<mResX; x++)
             {
-                lum += Luminance(mColor[x + y*mResX]);
+                lum += Luminance(GetColor(PixelToIndex(x, y)));
             }
         }
 
         return lum;
     }
 
+    // Root mean square error against a reference image of the same resolution,
+    // the zero padding of both adds nothing to the sums
+    float RMSE(const Framebuffer& aReference) const
+    {
+        if(aReference.mResX != mResX || aReference.mResY != mResY)
+            return -1.f;
+
+        const std::vector<float> &color    = mPlanes[kChannelColor];
+        const std::vector<float> &refColor = aReference.mPlanes[kChannelColor];
+
+        double sum = 0;
+
+        for(size_t i=0; i<color.size(); i++)
+            sum += Sqr(double(color[i]) - refColor[i]);
+
+        return float(std::sqrt(sum / std::max(1, 3 * mResX * mResY)));
+    }
+
+    // Mean of the squared errors relative to the squared reference values, aEpsilon
+    // keeps dark pixels from dominating; returns -1 for a different resolution
+    float RelMSE(
+        const Framebuffer& aReference,
+        float              aEpsilon = 1e-2f) const
+    {
+        if(aReference.mResX != mResX || aReference.mResY != mResY)
+            return -1.f;
+
+        const std::vector<float> &color    = mPlanes[kChannelColor];
+        const std::vector<float> &refColor = aReference.mPlanes[kChannelColor];
+
+        double sum = 0;
+
+        for(size_t i=0; i<color.size(); i++)
+            sum += Sqr(double(color[i]) - refColor[i]) / (Sqr(double(refColor[i])) + aEpsilon);
+
+        return float(sum / std::max(1, 3 * mResX * mResY));
+    }
+
     //////////////////////////////////////////////////////////////////////////
-    // Saving
-    void SavePPM(
-        const char *aFilename,
-        float       aGamma = 1.f)
+    // Loading PFM (only 3 channel little-endian files, as written by SavePFM)
+    bool LoadPFM(const char* aFilename)
     {
-        const float invGamma = 1.f / aGamma;
+        std::ifstream pfm(aFilename, std::ios::binary);
+        std::string magic;
+        int resX, resY;
+        float scale;
+        pfm >> magic >> resX >> resY >> scale;
 
-        std::ofstream ppm(aFilename);
-        ppm << "P3" << std::endl;
-        ppm << mResX << " " << mResY << std::endl;
-        ppm << "255" << std::endl;
+        if(!pfm || magic != "PF" || resX <= 0 || resY <= 0 || scale >= 0)
+            return false;
 
-        Vec3f *ptr = &mColor[0];
+        pfm.get(); // single whitespace before the data
+        Setup(Vec2f(float(resX), float(resY)));
 
-        for(int y=0; y<mResY; y++)
+        std::vector<Vec3f> row(mResX);
+        for(int y=mResY-1; y>-1; y--)
         {
-            for(int x=0; x<mResX; x++)
-            {
-                ptr = &mColor[x + y*mResX];
-                int r = int(std::pow(ptr->x, invGamma) * 255.f);
-                int g = int(std::pow(ptr->y, invGamma) * 255.f);
-                int b = int(std::pow(ptr->z, invGamma) * 255.f);
-
-                ppm << std::min(255, std::max(0, r)) << " "
-                    << std::min(255, std::max(0, g)) << " "
-                    << std::min(255, std::max(0, b)) << " ";
-            }
+            pfm.read(reinterpret_cast<char*>(row.data()), mResX * sizeof(Vec3f));
 
-            ppm << std::endl;
+            for(int x=0; x<mResX; x++)
+                SetColor(PixelToIndex(x, y), row[x]);
         }
+
+        return bool(pfm);
     }
 
-    void SavePFM(const char* aFilename)
+    //////////////////////////////////////////////////////////////////////////
+    // Saving
+    bool SavePPM(
+        const char       *aFilename,
+        const Tonemapper &aTonemapper = Tonemapper())
     {
-        std::ofstream pfm(aFilename, std::ios::binary);
-        pfm << "PF" << std::endl;
-        pfm << mResX << " " << mResY << std::endl;
-        pfm << "-1" << std::endl;
+        // Binary P6, rows are tonemapped in parallel straight into the file buffer
+        std::ostringstream header;
+        header << "P6" << '\n' << mResX << " " << mResY << '\n' << "255" << '\n';
 
-        for(int y=mResY-1; y>-1; y--)
+        const std::string headerStr = header.str();
+        const size_t      rowBytes  = size_t(mResX) * 3;
+
+        std::vector<uint8_t> data(headerStr.size() + rowBytes * mResY);
+        std::copy(headerStr.begin(), headerStr.end(), data.begin());
+
+        Tonemap(aTonemapper, &data[headerStr.size()], rowBytes, false, false);
+
+        std::ofstream ppm(aFilename, std::ios::binary);
+        ppm.write(reinterpret_cast<const char*>(data.data()), data.size());
+        ppm.close();
+        return bool(ppm);
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Saving PNG
+    bool SavePNG(
+        const char       *aFilename,
+        const Tonemapper &aTonemapper = Tonemapper())
+    {
+        std::vector<uint8_t> pixels(size_t(mResX) * mResY * 3);
+        Tonemap(aTonemapper, pixels.data(), size_t(mResX) * 3, false, false);
+        return PngWriter::Write(aFilename, pixels.data(), mResX, mResY);
+    }
+
+    bool SavePFM(const char* aFilename)
+    {
+        // PFM is stored from bottom up, interleaved rows are assembled in parallel
+        std::vector<Vec3f> data(size_t(mResX) * mResY);
+
+        TaskSystem::ParallelFor(0, mResY, kTileSize, [&](int aFirst, int aLast)
         {
-            for(int x=0; x<mResX; x++)
+            for(int y=aFirst; y<aLast; y++)
             {
-                pfm.write(reinterpret_cast<const char*>(&mColor[x + y*mResX]), sizeof(Vec3f));
+                Vec3f *row = &data[size_t(mResY-y-1) * mResX];
+
+                for(int x=0; x<mResX; x++)
+                    row[x] = GetColor(PixelToIndex(x, y));
             }
-        }
+        });
 
-        // pfm.write(reinterpret_cast<const char*>(&mColor[0]),
-        //     mColor.size() * sizeof(Vec3f)); // does not work correctly, results in flipped images
+        std::ofstream pfm(aFilename, std::ios::binary);
+        pfm << "PF" << std::endl;
+        pfm << mResX << " " << mResY << std::endl;
+        pfm << "-1" << std::endl;
+        pfm.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(Vec3f));
+        pfm.close();
+        return bool(pfm);
     }
 
     //////////////////////////////////////////////////////////////////////////
@@ -151,93 +529,290 @@ public:
         uint   mImportantColors; // 0 - all are important
     };
 
-    void SaveBMP(
-        const char *aFilename,
-        float       aGamma = 1.f)
+    bool SaveBMP(
+        const char       *aFilename,
+        const Tonemapper &aTonemapper = Tonemapper())
     {
-        std::ofstream bmp(aFilename, std::ios::binary);
+        // Rows are padded to 4 bytes
+        const size_t rowBytes   = (size_t(mResX) * 3 + 3) & ~size_t(3);
+        const size_t dataOffset = sizeof(BmpHeader) + 2;
+
         BmpHeader header;
-        bmp.write("BM", 2);
-        header.mFileSize   = uint(sizeof(BmpHeader) + 2) + mResX * mResX * 3;
+        header.mFileSize   = uint(dataOffset + rowBytes * mResY);
         header.mReserved01 = 0;
-        header.mDataOffset = uint(sizeof(BmpHeader) + 2);
+        header.mDataOffset = uint(dataOffset);
         header.mHeaderSize = 40;
         header.mWidth      = mResX;
         header.mHeight     = mResY;
         header.mColorPlates     = 1;
         header.mBitsPerPixel    = 24;
         header.mCompression     = 0;
-        header.mImageSize       = mResX * mResY * 3;
+        header.mImageSize       = uint(rowBytes * mResY);
         header.mHorizRes        = 2953;
         header.mVertRes         = 2953;
         header.mPaletteColors   = 0;
         header.mImportantColors = 0;
 
-        bmp.write((char*)&header, sizeof(header));
+        std::vector<uint8_t> data(dataOffset + rowBytes * mResY, 0);
+        data[0] = 'B';
+        data[1] = 'M';
+        memcpy(&data[2], &header, sizeof(header));
 
-        const float invGamma = 1.f / aGamma;
+        // bmp is stored from bottom up, in BGR order
+        Tonemap(aTonemapper, &data[dataOffset], rowBytes, true, true);
+
+        std::ofstream bmp(aFilename, std::ios::binary);
+        bmp.write(reinterpret_cast<const char*>(data.data()), data.size());
+        bmp.close();
+        return bool(bmp);
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Saving HDR
+    bool SaveHDR(const char* aFilename)
+    {
+        // Scanlines are RLE encoded independently in parallel, then written at once
+        std::vector<std::vector<byte> > lines(mResY);
+
+        TaskSystem::ParallelFor(0, mResY, 16, [&](int aFirst, int aLast)
+        {
+            for(int y=aFirst; y<aLast; y++)
+                EncodeHDRLine(y, lines[y]);
+        });
+
+        std::ostringstream header;
+        header << "#?RADIANCE" << '\n';
+        header << "# PG3Render" << '\n';
+        header << "FORMAT=32-bit_rle_rgbe" << '\n' << '\n';
+        header << "-Y " << mResY << " +X " << mResX << '\n';
+
+        const std::string headerStr = header.str();
+        std::vector<char> data(headerStr.begin(), headerStr.end());
         for(int y=0; y<mResY; y++)
+            data.insert(data.end(), lines[y].begin(), lines[y].end());
+
+        std::ofstream hdr(aFilename, std::ios::binary);
+        hdr.write(data.data(), data.size());
+        hdr.close();
+        return bool(hdr);
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Saving EXR, all present channels go into a single multi-layer file
+    bool SaveEXR(
+        const char              *aFilename,
+        bool                    aHalf = true,
+        ExrWriter::Compression  aCompression = ExrWriter::kZipCompression)
+    {
+        ExrWriter exr(aCompression);
+
+        // The writer takes row-major planes, they must live until Write
+        std::vector<std::vector<float> > planes;
+        planes.reserve(kChannelCount * 3);
+
+        for(int c=0; c<kChannelCount; c++)
         {
-            for(int x=0; x<mResX; x++)
+            if(!HasChannel(c))
+                continue;
+
+            const FramebufferChannelInfo &info = GetChannelInfo(c);
+
+            for(int comp=0; comp<GetChannelComponents(c); comp++)
             {
-                // bmp is stored from bottom up
-                const Vec3f &rgbF = mColor[x + (mResY-y-1)*mResX];
-                typedef unsigned char byte;
-                float gammaBgr[3];
-                gammaBgr[0] = std::pow(rgbF.z, invGamma) * 255.f;
-                gammaBgr[1] = std::pow(rgbF.y, invGamma) * 255.f;
-                gammaBgr[2] = std::pow(rgbF.x, invGamma) * 255.f;
-
-                byte bgrB[3];
-                bgrB[0] = byte(std::min(255.f, std::max(0.f, gammaBgr[0])));
-                bgrB[1] = byte(std::min(255.f, std::max(0.f, gammaBgr[1])));
-                bgrB[2] = byte(std::min(255.f, std::max(0.f, gammaBgr[2])));
-
-                bmp.write((char*)&bgrB, sizeof(bgrB));
+                planes.push_back(std::vector<float>(size_t(mResX) * mResY));
+                std::vector<float> &plane = planes.back();
+
+                TaskSystem::ParallelFor(0, mResY, kTileSize, [&](int aFirst, int aLast)
+                {
+                    for(int y=aFirst; y<aLast; y++)
+                        CopyRow(c, comp, y, &plane[size_t(y) * mResX]);
+                });
+
+                // Color goes to the default layer, so viewers pick it up as RGB
+                std::string name = (c == kChannelColor) ? "" : std::string(info.mName) + ".";
+                name += info.mComponents[comp];
+                exr.AddChannel(name, plane.data(),
+                    (aHalf && info.mHalfPrecision) ? ExrWriter::kPixelHalf : ExrWriter::kPixelFloat);
             }
         }
+
+        return exr.Write(aFilename, mResX, mResY);
     }
 
-    //////////////////////////////////////////////////////////////////////////
-    // Saving HDR
-    void SaveHDR(const char* aFilename)
+private:
+
+    typedef unsigned char byte;
+
+    static const int kReduceBlockSize = 4096; //!< Floats summed in cache by Reduce, 16 KB
+
+    // Sets up the planes without clearing them, a plane of the same size keeps its memory
+    void Allocate(
+        const Vec2f& aResolution,
+        uint         aChannelMask)
     {
-        std::ofstream hdr(aFilename, std::ios::binary);
+        mResolution  = aResolution;
+        mResX        = int(aResolution.x);
+        mResY        = int(aResolution.y);
+        mTilesX      = (mResX + kTileSize - 1) >> kTileBits;
+        mPixelCount  = mTilesX * ((mResY + kTileSize - 1) >> kTileBits) * kTileSize * kTileSize;
+        mChannelMask = aChannelMask | kChannelMaskColor;
+
+        // Channels that are not requested cost nothing
+        for(int c=0; c<kChannelCount; c++)
+        {
+            const size_t size = HasChannel(c) ? size_t(GetChannelComponents(c)) * mPixelCount : 0;
+            mPlanes[c].resize(size);
+            mPlanes[c].shrink_to_fit();
+        }
+    }
 
-        hdr << "#?RADIANCE" << '\n';
-        hdr << "# PG3Render" << '\n';
-        hdr << "FORMAT=32-bit_rle_rgbe" << '\n' << '\n';
-        hdr << "-Y " << mResY << " +X " << mResX << '\n';
+    // Interleaves the bits of the in-tile coordinates, x goes to the even bits
+    static int MortonCode(int aX, int aY)
+    {
+        return SpreadBits(aX) | (SpreadBits(aY) << 1);
+    }
 
-        for(int y=0; y<mResY; y++)
+    static int SpreadBits(int aValue)
+    {
+        return (aValue & 1) | ((aValue & 2) << 1) | ((aValue & 4) << 2);
+    }
+
+    // Copies row aY of a channel component out of the tiles
+    void CopyRow(
+        int   aChannel,
+        int   aComponent,
+        int   aY,
+        float *oRow) const
+    {
+        const float *plane = GetPlane(aChannel, aComponent);
+        const int   rowBase = PixelToIndex(0, aY);
+
+        // Pixels of a tile row are at the same offsets in every tile
+        int offsets[kTileSize];
+        for(int x=0; x<kTileSize; x++)
+            offsets[x] = MortonCode(x, 0);
+
+        for(int x=0; x<mResX; x++)
+            oRow[x] = plane[rowBase + ((x >> kTileBits) << (2 * kTileBits)) + offsets[x & (kTileSize - 1)]];
+    }
+
+    // Tonemaps the color into 8-bit rows of aRowBytes stride, in parallel over rows
+    void Tonemap(
+        const Tonemapper &aTonemapper,
+        uint8_t          *oPixels,
+        size_t           aRowBytes,
+        bool             aBottomUp,
+        bool             aBgr) const
+    {
+        // Every range gets its own row buffers, ranges are whole tiles
+        TaskSystem::ParallelFor(0, mResY, kTileSize, [&](int aFirst, int aLast)
         {
-            for(int x=0; x<mResX; x++)
+            std::vector<float> rows(size_t(mResX) * 3);
+            float *r = &rows[0];
+            float *g = r + mResX;
+            float *b = g + mResX;
+
+            for(int y=aFirst; y<aLast; y++)
             {
-                typedef unsigned char byte;
-                byte rgbe[4] = {0,0,0,0};
+                CopyRow(kChannelColor, 0, y, r);
+                CopyRow(kChannelColor, 1, y, g);
+                CopyRow(kChannelColor, 2, y, b);
 
-                const Vec3f &rgbF = mColor[x + y*mResX];
-                float v = std::max(rgbF.x, std::max(rgbF.y, rgbF.z));
+                const size_t dst = size_t(aBottomUp ? mResY-y-1 : y) * aRowBytes;
+                aTonemapper.ApplyRow(r, g, b, mResX, oPixels + dst, aBgr);
+            }
+        });
+    }
+
+    // New style (per component) run-length encoded RGBE scanline
+    void EncodeHDRLine(
+        int               aY,
+        std::vector<byte> &oLine) const
+    {
+        std::vector<byte> rgbe(size_t(mResX) * 4);
+
+        for(int x=0; x<mResX; x++)
+        {
+            byte *px = &rgbe[size_t(x) * 4];
+            px[0] = px[1] = px[2] = px[3] = 0;
+
+            const Vec3f rgbF = GetColor(PixelToIndex(x, aY));
+            float v = std::max(rgbF.x, std::max(rgbF.y, rgbF.z));
 
-                if(v >= 1e-32f)
+            if(v >= 1e-32f)
+            {
+                int e;
+                v = float(frexp(v, &e) * 256.f / v);
+                px[0] = byte(rgbF.x * v);
+                px[1] = byte(rgbF.y * v);
+                px[2] = byte(rgbF.z * v);
+                px[3] = byte(e + 128);
+            }
+        }
+
+        // The RLE scheme only allows widths in [8, 32767]
+        if(mResX < 8 || mResX > 0x7fff)
+        {
+            oLine.swap(rgbe);
+            return;
+        }
+
+        oLine.reserve(rgbe.size() + 4);
+        oLine.push_back(2);
+        oLine.push_back(2);
+        oLine.push_back(byte(mResX >> 8));
+        oLine.push_back(byte(mResX & 0xff));
+
+        for(int comp=0; comp<4; comp++)
+        {
+            int x = 0;
+            while(x < mResX)
+            {
+                // Find the next run of at least 4 equal values
+                int runStart = x, runLength = 0;
+                while(runStart < mResX)
                 {
-                    int e;
-                    v = float(frexp(v, &e) * 256.f / v);
-                    rgbe[0] = byte(rgbF.x * v);
-                    rgbe[1] = byte(rgbF.y * v);
-                    rgbe[2] = byte(rgbF.z * v);
-                    rgbe[3] = byte(e + 128);
+                    runLength = 1;
+                    while(runLength < 127 && runStart + runLength < mResX &&
+                          rgbe[size_t(runStart + runLength) * 4 + comp] == rgbe[size_t(runStart) * 4 + comp])
+                        runLength++;
+
+                    if(runLength >= 4)
+                        break;
+
+                    runStart += runLength;
                 }
 
-                hdr.write((char*)&rgbe[0], 4);
+                if(runStart >= mResX)
+                    runLength = 0;
+
+                // Literal dump of everything before the run
+                while(x < runStart)
+                {
+                    const int count = std::min(128, runStart - x);
+                    oLine.push_back(byte(count));
+
+                    for(int i=0; i<count; i++, x++)
+                        oLine.push_back(rgbe[size_t(x) * 4 + comp]);
+                }
+
+                if(runLength >= 4)
+                {
+                    oLine.push_back(byte(128 + runLength));
+                    oLine.push_back(rgbe[size_t(runStart) * 4 + comp]);
+                    x += runLength;
+                }
             }
         }
     }
 
 private:
 
-    std::vector<Vec3f> mColor;
+    std::vector<float> mPlanes[kChannelCount]; //!< Per channel, component planes one after another
     Vec2f              mResolution;
     int                mResX;
     int                mResY;
+    int                mTilesX;
+    int                mPixelCount;   //!< Per component plane, whole tiles
+    uint               mChannelMask = kChannelMaskColor;
 };
@@ -1,9 +1,12 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
 #include <cmath>
 #include "math.hpp"
 #include "ray.hpp"
+#include "stats.hpp"
+#include "arena.hpp"
 
 //////////////////////////////////////////////////////////////////////////
 // Geometry
@@ -14,7 +17,7 @@ public:
 
     virtual ~AbstractGeometry(){};
 
-    // Finds the closest intersection
+    // Finds the closest intersection, recording only its distance, primitive and barycentrics
     virtual bool Intersect (const Ray& aRay, Intersection& oResult) const = 0;
 
     // Finds any intersection, default calls Intersect
@@ -23,60 +26,181 @@ public:
         return Intersect(aRay, oResult);
     }
 
+    /**
+     * Shadow ray test: whether anything is hit before aMaxDistance. Nothing but the answer is computed
+     * Arguments:
+     *  - aoLastOccluder = primitive that occluded the previous query of the calling thread, or NULL;
+     *    tested first and updated on a hit, as consecutive shadow rays tend to be blocked by the same object
+     */
+    virtual bool Occluded(const Ray& aRay, float aMaxDistance, int * /*aoLastOccluder*/) const
+    {
+        Intersection isect(aMaxDistance);
+        return IntersectP(aRay, isect);
+    }
+
+    // Batched Occluded, e.g. all shadow rays of one shading point, with one last occluder
+    // per ray (e.g. per light, or NULL). The default tests them one by one
+    virtual void Occluded(
+        const Ray   *aRays,
+        const float *aMaxDistances,
+        int         aCount,
+        bool        *oOccluded,
+        int         *aoLastOccluders) const
+    {
+        for(int i=0; i<aCount; i++)
+            oOccluded[i] = Occluded(aRays[i], aMaxDistances[i], aoLastOccluders ? &aoLastOccluders[i] : NULL);
+    }
+
+    // Fills the surface attributes (normal, material, light, uv) of the hit found by Intersect,
+    // done once for the final hit instead of for every closer candidate
+    virtual void ComputeSurfaceInteraction(const Ray& aRay, Intersection& aoResult) const = 0;
+
     // Grows given bounding box by this object
     virtual void GrowBBox(Vec3f &aoBBoxMin, Vec3f &aoBBoxMax) = 0;
+
+    // Deep copy in the given arena, allocated (and first touched) by the calling thread
+    virtual AbstractGeometry* Clone(MemoryArena &aoArena) const = 0;
 };
 
-class GeometryList : public AbstractGeometry
+//////////////////////////////////////////////////////////////////////////
+// Ray-primitive distances
+//
+// Shared by the single primitive classes and the batched loops of
+// GeometryList. They work on the components directly, with the operations
+// of the Vec3f Dot and Cross in the same order, so the results do not
+// depend on the caller. A miss gives INFINITY (or NaN), which fails every
+// distance comparison.
+
+// Triple products of the ray direction with the vertices taken relative to
+// the ray origin, i.e. Cross(co, bo), Cross(bo, ao), Cross(ao, co) dotted
+// with the direction. One per edge, each proportional to the barycentric
+// coordinate of the vertex opposite to it.
+inline void TriangleEdgeTests(
+    const Ray &aRay,
+    float     aP0x, float aP0y, float aP0z,
+    float     aP1x, float aP1y, float aP1z,
+    float     aP2x, float aP2y, float aP2z,
+    float     &oV0d,
+    float     &oV1d,
+    float     &oV2d)
 {
-public:
+    const float dx = aRay.direction.x, dy = aRay.direction.y, dz = aRay.direction.z;
+
+    const float aox = aP0x - aRay.origin.x, aoy = aP0y - aRay.origin.y, aoz = aP0z - aRay.origin.z;
+    const float box = aP1x - aRay.origin.x, boy = aP1y - aRay.origin.y, boz = aP1z - aRay.origin.z;
+    const float cox = aP2x - aRay.origin.x, coy = aP2y - aRay.origin.y, coz = aP2z - aRay.origin.z;
+
+    oV0d = (coy * boz - coz * boy) * dx + (coz * box - cox * boz) * dy + (cox * boy - coy * box) * dz;
+    oV1d = (boy * aoz - boz * aoy) * dx + (boz * aox - box * aoz) * dy + (box * aoy - boy * aox) * dz;
+    oV2d = (aoy * coz - aoz * coy) * dx + (aoz * cox - aox * coz) * dy + (aox * coy - aoy * cox) * dz;
+}
+
+// Sign test of the ray direction against the edges. It has no branches,
+// so that loops over many triangles vectorize.
+inline float TriangleDistance(
+    const Ray &aRay,
+    float     aP0x, float aP0y, float aP0z,
+    float     aP1x, float aP1y, float aP1z,
+    float     aP2x, float aP2y, float aP2z,
+    float     aNx,  float aNy,  float aNz)
+{
+    float v0d, v1d, v2d;
+    TriangleEdgeTests(aRay, aP0x, aP0y, aP0z, aP1x, aP1y, aP1z, aP2x, aP2y, aP2z, v0d, v1d, v2d);
 
-    virtual ~GeometryList()
-    {
-        for(int i=0; i<(int)mGeometry.size(); i++)
-            delete mGeometry[i];
-    };
+    const bool inside =
+        ((v0d < 0.f)  & (v1d < 0.f)  & (v2d < 0.f)) |
+        ((v0d >= 0.f) & (v1d >= 0.f) & (v2d >= 0.f));
 
-    virtual bool Intersect(const Ray& aRay, Intersection& oResult) const
-    {
-        bool anyIntersection = false;
+    const float dx = aRay.direction.x, dy = aRay.direction.y, dz = aRay.direction.z;
+    const float aox = aP0x - aRay.origin.x, aoy = aP0y - aRay.origin.y, aoz = aP0z - aRay.origin.z;
 
-        for(int i=0; i<(int)mGeometry.size(); i++)
-        {
-            bool hit = mGeometry[i]->Intersect(aRay, oResult);
+    const float distance = (aNx * aox + aNy * aoy + aNz * aoz) / (aNx * dx + aNy * dy + aNz * dz);
 
-            if(hit)
-                anyIntersection = hit;
-        }
+    // Adding instead of selecting keeps the compiler from moving the
+    // division under a branch, which would stop the vectorization
+    return distance + (inside ? 0.f : INFINITY);
+}
 
-        return anyIntersection;
-    }
+// Weights of the 2nd and 3rd vertex where the ray passes through the triangle
+inline Vec2f TriangleBarycentrics(
+    const Ray &aRay,
+    float     aP0x, float aP0y, float aP0z,
+    float     aP1x, float aP1y, float aP1z,
+    float     aP2x, float aP2y, float aP2z)
+{
+    float v0d, v1d, v2d;
+    TriangleEdgeTests(aRay, aP0x, aP0y, aP0z, aP1x, aP1y, aP1z, aP2x, aP2y, aP2z, v0d, v1d, v2d);
+
+    const float invSum = 1.f / (v0d + v1d + v2d);
+    return Vec2f(v2d * invSum, v1d * invSum);
+}
+
+// Discriminant of the ray-sphere quadratic A*t^2 + B*t + C, negative for a miss.
+// Cheap and without branches, so that a block of spheres is culled in one vectorized loop.
+inline float SphereDiscriminant(
+    const Ray &aRay,
+    float     aCx,
+    float     aCy,
+    float     aCz,
+    float     aRadius,
+    float     &oA,
+    float     &oB,
+    float     &oC)
+{
+    const float dx = aRay.direction.x, dy = aRay.direction.y, dz = aRay.direction.z;
+
+    // we transform ray origin into object space (center == origin)
+    const float ox = aRay.origin.x - aCx, oy = aRay.origin.y - aCy, oz = aRay.origin.z - aCz;
+
+    oA = dx * dx + dy * dy + dz * dz;
+    oB = 2 * (dx * ox + dy * oy + dz * oz);
+    oC = (ox * ox + oy * oy + oz * oz) - (aRadius * aRadius);
+
+    return oB*oB - 4*oA*oC;
+}
+
+// Nearer of the two roots beyond the ray offset
+// Taken from:
+// http://wiki.cgsociety.org/index.php/Ray_Sphere_Intersection
+inline float SphereDistance(
+    const Ray &aRay,
+    float     aCx,
+    float     aCy,
+    float     aCz,
+    float     aRadius)
+{
+    float A, B, C;
 
-    virtual bool IntersectP(
-        const Ray &aRay,
-        Intersection     &oResult) const
-    {
-        for(int i=0; i<(int)mGeometry.size(); i++)
-        {
-            if(mGeometry[i]->IntersectP(aRay, oResult))
-                return true;
-        }
+    // Must use doubles, because when B ~ sqrt(B*B - 4*A*C)
+    // the resulting t is imprecise enough to get around ray epsilons
+    const double disc = SphereDiscriminant(aRay, aCx, aCy, aCz, aRadius, A, B, C);
 
-        return false;
-    }
+    if(disc < 0)
+        return INFINITY;
 
-    virtual void GrowBBox(
-        Vec3f &aoBBoxMin,
-        Vec3f &aoBBoxMax)
-    {
-        for(int i=0; i<(int)mGeometry.size(); i++)
-            mGeometry[i]->GrowBBox(aoBBoxMin, aoBBoxMax);
-    }
+    const double discSqrt = std::sqrt(disc);
+    const double q = (B < 0) ? ((-B - discSqrt) / 2.f) : ((-B + discSqrt) / 2.f);
 
-public:
+    double t0 = q / A;
+    double t1 = C / q;
 
-    std::vector<AbstractGeometry*> mGeometry;
-};
+    if(t0 > t1) std::swap(t0, t1);
+
+    if(t0 > aRay.offset)
+        return float(t0);
+    else if(t1 > aRay.offset)
+        return float(t1);
+    else
+        return INFINITY;
+}
+
+// Longitude and latitude of the sphere point with the given normal, both in [0, 1]
+inline Vec2f SphereUV(const Vec3f &aNormal)
+{
+    return Vec2f(
+        0.5f + std::atan2(aNormal.y, aNormal.x) * (0.5f * INV_PI_F),
+        std::acos(std::min(std::max(aNormal.z, -1.f), 1.f)) * INV_PI_F);
+}
 
 class Triangle : public AbstractGeometry
 {
@@ -88,12 +212,14 @@ public:
         const Vec3f &p0,
         const Vec3f &p1,
         const Vec3f &p2,
-        int         aMatID)
+        int         aMatID,
+        int         aLightID = -1)
     {
         p[0] = p0;
         p[1] = p1;
         p[2] = p2;
         matID = aMatID;
+        lightID = aLightID;
         mNormal = Normalize(Cross(p[1] - p[0], p[2] - p[0]));
     }
 
@@ -101,35 +227,32 @@ public:
         const Ray &aRay,
         Intersection     &oResult) const
     {
-        const Vec3f ao = p[0] - aRay.origin;
-        const Vec3f bo = p[1] - aRay.origin;
-        const Vec3f co = p[2] - aRay.origin;
+        const float distance = TriangleDistance(aRay,
+            p[0].x, p[0].y, p[0].z, p[1].x, p[1].y, p[1].z,
+            p[2].x, p[2].y, p[2].z, mNormal.x, mNormal.y, mNormal.z);
 
-        const Vec3f v0 = Cross(co, bo);
-        const Vec3f v1 = Cross(bo, ao);
-        const Vec3f v2 = Cross(ao, co);
-
-        const float v0d = Dot(v0, aRay.direction);
-        const float v1d = Dot(v1, aRay.direction);
-        const float v2d = Dot(v2, aRay.direction);
-
-        if(((v0d < 0.f)  && (v1d < 0.f)  && (v2d < 0.f)) ||
-           ((v0d >= 0.f) && (v1d >= 0.f) && (v2d >= 0.f)))
+        if((distance > aRay.offset) & (distance < oResult.distance))
         {
-            const float distance = Dot(mNormal, ao) / Dot(mNormal, aRay.direction);
-
-            if((distance > aRay.offset) & (distance < oResult.distance))
-            {
-                oResult.normal = mNormal;
-                oResult.materialID  = matID;
-                oResult.distance   = distance;
-                return true;
-            }
+            oResult.distance     = distance;
+            oResult.primitiveID  = 0;
+            oResult.barycentrics = TriangleBarycentrics(aRay,
+                p[0].x, p[0].y, p[0].z, p[1].x, p[1].y, p[1].z, p[2].x, p[2].y, p[2].z);
+            return true;
         }
 
         return false;
     }
 
+    virtual void ComputeSurfaceInteraction(
+        const Ray    &/*aRay*/,
+        Intersection &aoResult) const
+    {
+        aoResult.normal     = mNormal;
+        aoResult.materialID = matID;
+        aoResult.lightID    = lightID;
+        aoResult.uv         = aoResult.barycentrics;
+    }
+
     virtual void GrowBBox(
         Vec3f &aoBBoxMin,
         Vec3f &aoBBoxMax)
@@ -144,10 +267,16 @@ public:
         }
     }
 
+    virtual AbstractGeometry* Clone(MemoryArena &aoArena) const
+    {
+        return aoArena.New<Triangle>(kArenaGeometry, *this);
+    }
+
 public:
 
     Vec3f p[3];
     int   matID;
+    int   lightID; //!< Light the triangle is the emitter of, -1 for none
     Vec3f mNormal;
 };
 
@@ -167,48 +296,31 @@ public:
         matID  = aMatID;
     }
 
-    // Taken from:
-    // http://wiki.cgsociety.org/index.php/Ray_Sphere_Intersection
-
     virtual bool Intersect(
         const Ray &aRay,
         Intersection     &oResult) const
     {
-        // we transform ray origin into object space (center == origin)
-        const Vec3f transformedOrigin = aRay.origin - center;
-
-        const float A = Dot(aRay.direction, aRay.direction);
-        const float B = 2 * Dot(aRay.direction, transformedOrigin);
-        const float C = Dot(transformedOrigin, transformedOrigin) - (radius * radius);
-
-        // Must use doubles, because when B ~ sqrt(B*B - 4*A*C)
-        // the resulting t is imprecise enough to get around ray epsilons
-        const double disc = B*B - 4*A*C;
-
-        if(disc < 0)
-            return false;
-
-        const double discSqrt = std::sqrt(disc);
-        const double q = (B < 0) ? ((-B - discSqrt) / 2.f) : ((-B + discSqrt) / 2.f);
-
-        double t0 = q / A;
-        double t1 = C / q;
-
-        if(t0 > t1) std::swap(t0, t1);
+        const float resT = SphereDistance(aRay, center.x, center.y, center.z, radius);
 
-        float resT;
+        if(resT < oResult.distance)
+        {
+            oResult.distance     = resT;
+            oResult.primitiveID  = 0;
+            oResult.barycentrics = Vec2f(0.f);
+            return true;
+        }
 
-        if(t0 > aRay.offset && t0 < oResult.distance)
-            resT = float(t0);
-        else if(t1 > aRay.offset && t1 < oResult.distance)
-            resT = float(t1);
-        else
-            return false;
+        return false;
+    }
 
-        oResult.distance   = resT;
-        oResult.materialID  = matID;
-        oResult.normal = Normalize(transformedOrigin + Vec3f(resT) * aRay.direction);
-        return true;
+    virtual void ComputeSurfaceInteraction(
+        const Ray    &aRay,
+        Intersection &aoResult) const
+    {
+        aoResult.normal     = Normalize(aRay.origin - center + Vec3f(aoResult.distance) * aRay.direction);
+        aoResult.materialID = matID;
+        aoResult.lightID    = -1; // spheres never emit
+        aoResult.uv         = SphereUV(aoResult.normal);
     }
 
     virtual void GrowBBox(
@@ -233,9 +345,483 @@ public:
         }
     }
 
+    virtual AbstractGeometry* Clone(MemoryArena &aoArena) const
+    {
+        return aoArena.New<Sphere>(kArenaGeometry, *this);
+    }
+
 public:
 
     Vec3f center;
     float radius;
     int   matID;
 };
+
+//////////////////////////////////////////////////////////////////////////
+// Brute force list of all primitives
+//
+// Triangles and spheres are kept apart, each component in its own array
+// (structure of arrays), so testing a block of primitives is one loop over
+// contiguous floats with no virtual calls. The distances of a block are
+// computed first (vectorized) and then scanned in order for the closest
+// hit. Primitive IDs number the triangles first, then the spheres.
+class GeometryList : public AbstractGeometry
+{
+public:
+
+    // The arrays are allocated in aArena (e.g. of the scene), or on the heap without one
+    explicit GeometryList(MemoryArena *aArena = NULL)
+    {
+        ForEachArray([aArena](auto &aArray, bool)
+        {
+            typedef typename std::decay<decltype(aArray)>::type Array;
+            aArray = Array(typename Array::allocator_type(aArena, kArenaGeometry));
+        });
+    }
+
+    // Room for the given total counts, so that the arrays do not grow (and,
+    // in an arena, leave their old storage behind) while primitives are added
+    void Reserve(
+        int aTriangleCount,
+        int aSphereCount)
+    {
+        ForEachArray([=](auto &aArray, bool aTriangles)
+        {
+            aArray.reserve(aTriangles ? aTriangleCount : aSphereCount);
+        });
+    }
+
+    void AddTriangle(
+        const Vec3f &p0,
+        const Vec3f &p1,
+        const Vec3f &p2,
+        int         aMatID,
+        int         aLightID = -1)
+    {
+        const Vec3f normal = Normalize(Cross(p1 - p0, p2 - p0));
+
+        mP0x.push_back(p0.x); mP0y.push_back(p0.y); mP0z.push_back(p0.z);
+        mP1x.push_back(p1.x); mP1y.push_back(p1.y); mP1z.push_back(p1.z);
+        mP2x.push_back(p2.x); mP2y.push_back(p2.y); mP2z.push_back(p2.z);
+        mNx.push_back(normal.x); mNy.push_back(normal.y); mNz.push_back(normal.z);
+        mTriangleMatID.push_back(aMatID);
+        mTriangleLightID.push_back(aLightID);
+    }
+
+    void AddSphere(
+        const Vec3f &aCenter,
+        float       aRadius,
+        int         aMatID)
+    {
+        mCx.push_back(aCenter.x); mCy.push_back(aCenter.y); mCz.push_back(aCenter.z);
+        mRadius.push_back(aRadius);
+        mSphereMatID.push_back(aMatID);
+    }
+
+    int GetTriangleCount() const { return (int)mTriangleMatID.size(); }
+    int GetSphereCount()   const { return (int)mSphereMatID.size(); }
+
+    // Single primitive as its own object, e.g. for measuring it alone
+    Triangle GetTriangle(int aIndex) const
+    {
+        return Triangle(GetVertex0(aIndex), GetVertex1(aIndex), GetVertex2(aIndex),
+            mTriangleMatID[aIndex], mTriangleLightID[aIndex]);
+    }
+
+    Sphere GetSphere(int aIndex) const
+    {
+        return Sphere(GetCenter(aIndex), mRadius[aIndex], mSphereMatID[aIndex]);
+    }
+
+    // Distance to one primitive, as the loops of Intersect compute it; a hit
+    // lies beyond the ray offset (spheres only return such distances)
+    float PrimitiveDistance(
+        const Ray &aRay,
+        int       aPrimitiveID) const
+    {
+        const int i = aPrimitiveID - GetTriangleCount();
+        if(i >= 0)
+            return SphereDistance(aRay, mCx[i], mCy[i], mCz[i], mRadius[i]);
+
+        const int t = aPrimitiveID;
+        return TriangleDistance(aRay,
+            mP0x[t], mP0y[t], mP0z[t], mP1x[t], mP1y[t], mP1z[t],
+            mP2x[t], mP2y[t], mP2z[t], mNx[t], mNy[t], mNz[t]);
+    }
+
+    // Barycentrics of a hit as Intersect records them, zero for spheres
+    Vec2f PrimitiveBarycentrics(
+        const Ray &aRay,
+        int       aPrimitiveID) const
+    {
+        if(aPrimitiveID >= GetTriangleCount())
+            return Vec2f(0.f);
+
+        const int t = aPrimitiveID;
+        return TriangleBarycentrics(aRay,
+            mP0x[t], mP0y[t], mP0z[t], mP1x[t], mP1y[t], mP1z[t], mP2x[t], mP2y[t], mP2z[t]);
+    }
+
+    // Single primitive test, for the last occluder; false for an invalid ID
+    bool HitsPrimitive(
+        const Ray &aRay,
+        int       aPrimitiveID,
+        float     aMaxDistance) const
+    {
+        const int triangleCount = GetTriangleCount();
+
+        if((aPrimitiveID < 0) || (aPrimitiveID >= triangleCount + GetSphereCount()))
+            return false;
+
+        PG3_STAT_ADD(kStatPrimitiveTests, 1);
+
+        if(aPrimitiveID < triangleCount)
+        {
+            const int i = aPrimitiveID;
+            const float distance = TriangleDistance(aRay,
+                mP0x[i], mP0y[i], mP0z[i], mP1x[i], mP1y[i], mP1z[i],
+                mP2x[i], mP2y[i], mP2z[i], mNx[i], mNy[i], mNz[i]);
+
+            return (distance > aRay.offset) & (distance < aMaxDistance);
+        }
+
+        const int i = aPrimitiveID - triangleCount;
+        return SphereDistance(aRay, mCx[i], mCy[i], mCz[i], mRadius[i]) < aMaxDistance;
+    }
+
+    virtual bool Intersect(const Ray& aRay, Intersection& oResult) const
+    {
+        const int triangleCount = GetTriangleCount();
+        const int sphereCount   = GetSphereCount();
+
+        PG3_STAT_ADD(kStatNodeVisits, 1);
+        PG3_STAT_ADD(kStatPrimitiveTests, triangleCount + sphereCount);
+
+        float distances[kBlockSize];
+        int   triangle = -1;
+        int   sphere   = -1;
+
+        for(int first=0; first<triangleCount; first+=kBlockSize)
+        {
+            const int count = std::min(kBlockSize, triangleCount - first);
+            TriangleDistances(aRay, first, count, distances);
+
+            for(int i=0; i<count; i++)
+            {
+                if((distances[i] > aRay.offset) & (distances[i] < oResult.distance))
+                {
+                    oResult.distance = distances[i];
+                    triangle = first + i;
+                }
+            }
+        }
+
+        // A sphere is only taken when it is closer than the closest triangle
+        for(int first=0; first<sphereCount; first+=kBlockSize)
+        {
+            const int count = std::min(kBlockSize, sphereCount - first);
+            SphereDistances(aRay, first, count, distances);
+
+            for(int i=0; i<count; i++)
+            {
+                if(distances[i] < oResult.distance)
+                {
+                    oResult.distance = distances[i];
+                    sphere = first + i;
+                }
+            }
+        }
+
+        if(sphere >= 0)
+        {
+            oResult.primitiveID  = triangleCount + sphere;
+            oResult.barycentrics = Vec2f(0.f);
+        }
+        else if(triangle >= 0)
+        {
+            oResult.primitiveID  = triangle;
+            oResult.barycentrics = TriangleBarycentrics(aRay,
+                mP0x[triangle], mP0y[triangle], mP0z[triangle],
+                mP1x[triangle], mP1y[triangle], mP1z[triangle],
+                mP2x[triangle], mP2y[triangle], mP2z[triangle]);
+        }
+
+        return (sphere >= 0) || (triangle >= 0);
+    }
+
+    // Records the distance and primitive only, shadow rays need nothing else
+    virtual bool IntersectP(
+        const Ray &aRay,
+        Intersection     &oResult) const
+    {
+        PG3_STAT_ADD(kStatNodeVisits, 1);
+
+        const int blockCount = GetBlockCount();
+        for(int block=0; block<blockCount; block++)
+        {
+            float distance;
+            const int primitive = BlockOccluder(aRay, block, oResult.distance, distance);
+
+            if(primitive >= 0)
+            {
+                oResult.distance    = distance;
+                oResult.primitiveID = primitive;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    virtual bool Occluded(
+        const Ray &aRay,
+        float     aMaxDistance,
+        int       *aoLastOccluder) const
+    {
+        if(aoLastOccluder && HitsPrimitive(aRay, *aoLastOccluder, aMaxDistance))
+            return true;
+
+        // An unoccluded ray clears the cache, so that lit regions do not pay for the extra test
+        Intersection isect(aMaxDistance);
+        const bool occluded = IntersectP(aRay, isect);
+
+        if(aoLastOccluder)
+            *aoLastOccluder = occluded ? isect.primitiveID : -1;
+        return occluded;
+    }
+
+    // Goes over the primitives once for all rays: each block is tested
+    // against every ray not occluded yet, while it is in the cache
+    virtual void Occluded(
+        const Ray   *aRays,
+        const float *aMaxDistances,
+        int         aCount,
+        bool        *oOccluded,
+        int         *aoLastOccluders) const
+    {
+        int pending = 0;
+        for(int r=0; r<aCount; r++)
+        {
+            PG3_STAT_ADD(kStatNodeVisits, 1);
+
+            oOccluded[r] = aoLastOccluders && HitsPrimitive(aRays[r], aoLastOccluders[r], aMaxDistances[r]);
+            pending += oOccluded[r] ? 0 : 1;
+        }
+
+        const int blockCount = GetBlockCount();
+        for(int block=0; (block<blockCount) && (pending>0); block++)
+        {
+            for(int r=0; r<aCount; r++)
+            {
+                if(oOccluded[r])
+                    continue;
+
+                float distance;
+                const int primitive = BlockOccluder(aRays[r], block, aMaxDistances[r], distance);
+
+                if(primitive >= 0)
+                {
+                    oOccluded[r] = true;
+                    pending--;
+
+                    if(aoLastOccluders)
+                        aoLastOccluders[r] = primitive;
+                }
+            }
+        }
+
+        for(int r=0; (r<aCount) && aoLastOccluders; r++)
+        {
+            if(!oOccluded[r])
+                aoLastOccluders[r] = -1;
+        }
+    }
+
+    virtual void ComputeSurfaceInteraction(
+        const Ray    &aRay,
+        Intersection &aoResult) const
+    {
+        const int triangleCount = GetTriangleCount();
+        const int id            = aoResult.primitiveID;
+
+        if(id < triangleCount)
+        {
+            aoResult.normal     = Vec3f(mNx[id], mNy[id], mNz[id]);
+            aoResult.materialID = mTriangleMatID[id];
+            aoResult.lightID    = mTriangleLightID[id];
+            aoResult.uv         = aoResult.barycentrics;
+        }
+        else
+        {
+            const int sphere = id - triangleCount;
+
+            aoResult.normal     = Normalize(aRay.origin - GetCenter(sphere) + Vec3f(aoResult.distance) * aRay.direction);
+            aoResult.materialID = mSphereMatID[sphere];
+            aoResult.lightID    = -1; // spheres never emit
+            aoResult.uv         = SphereUV(aoResult.normal);
+        }
+    }
+
+    virtual void GrowBBox(
+        Vec3f &aoBBoxMin,
+        Vec3f &aoBBoxMax)
+    {
+        for(int i=0; i<GetTriangleCount(); i++)
+            GetTriangle(i).GrowBBox(aoBBoxMin, aoBBoxMax);
+
+        for(int i=0; i<GetSphereCount(); i++)
+            GetSphere(i).GrowBBox(aoBBoxMin, aoBBoxMax);
+    }
+
+    virtual AbstractGeometry* Clone(MemoryArena &aoArena) const
+    {
+        // Copy assignment keeps the arena of the new list
+        GeometryList *list = aoArena.New<GeometryList>(kArenaGeometry, &aoArena);
+        *list = *this;
+        return list;
+    }
+
+private:
+
+    static const int kBlockSize = 64; //!< Primitives whose distances are computed in one go
+
+    // Triangle blocks first, then sphere blocks
+    int GetBlockCount() const
+    {
+        return (GetTriangleCount() + kBlockSize - 1) / kBlockSize + (GetSphereCount() + kBlockSize - 1) / kBlockSize;
+    }
+
+    // First primitive of the block hit before aMaxDistance, -1 for none
+    int BlockOccluder(
+        const Ray &aRay,
+        int       aBlock,
+        float     aMaxDistance,
+        float     &oDistance) const
+    {
+        const int triangleCount  = GetTriangleCount();
+        const int triangleBlocks = (triangleCount + kBlockSize - 1) / kBlockSize;
+
+        float distances[kBlockSize];
+
+        if(aBlock < triangleBlocks)
+        {
+            const int first = aBlock * kBlockSize;
+            const int count = std::min(kBlockSize, triangleCount - first);
+
+            PG3_STAT_ADD(kStatPrimitiveTests, count);
+            TriangleDistances(aRay, first, count, distances);
+
+            for(int i=0; i<count; i++)
+            {
+                if((distances[i] > aRay.offset) & (distances[i] < aMaxDistance))
+                {
+                    oDistance = distances[i];
+                    return first + i;
+                }
+            }
+        }
+        else
+        {
+            const int first = (aBlock - triangleBlocks) * kBlockSize;
+            const int count = std::min(kBlockSize, GetSphereCount() - first);
+
+            PG3_STAT_ADD(kStatPrimitiveTests, count);
+            SphereDistances(aRay, first, count, distances);
+
+            for(int i=0; i<count; i++)
+            {
+                if(distances[i] < aMaxDistance)
+                {
+                    oDistance = distances[i];
+                    return triangleCount + first + i;
+                }
+            }
+        }
+
+        return -1;
+    }
+
+    // Distances to triangles aFirst .. aFirst + aCount - 1, INFINITY for a miss
+    void TriangleDistances(
+        const Ray &aRay,
+        int       aFirst,
+        int       aCount,
+        float     *oDistances) const
+    {
+        const float *p0x = &mP0x[aFirst], *p0y = &mP0y[aFirst], *p0z = &mP0z[aFirst];
+        const float *p1x = &mP1x[aFirst], *p1y = &mP1y[aFirst], *p1z = &mP1z[aFirst];
+        const float *p2x = &mP2x[aFirst], *p2y = &mP2y[aFirst], *p2z = &mP2z[aFirst];
+        const float *nx  = &mNx[aFirst],  *ny  = &mNy[aFirst],  *nz  = &mNz[aFirst];
+
+#pragma omp simd
+        for(int i=0; i<aCount; i++)
+        {
+            oDistances[i] = TriangleDistance(aRay,
+                p0x[i], p0y[i], p0z[i], p1x[i], p1y[i], p1z[i],
+                p2x[i], p2y[i], p2z[i], nx[i], ny[i], nz[i]);
+        }
+    }
+
+    // Distances to spheres aFirst .. aFirst + aCount - 1 (beyond the ray offset), INFINITY for a miss
+    void SphereDistances(
+        const Ray &aRay,
+        int       aFirst,
+        int       aCount,
+        float     *oDistances) const
+    {
+        const float *cx = &mCx[aFirst], *cy = &mCy[aFirst], *cz = &mCz[aFirst];
+        const float *radius = &mRadius[aFirst];
+
+        float discriminants[kBlockSize];
+
+#pragma omp simd
+        for(int i=0; i<aCount; i++)
+        {
+            float A, B, C;
+            discriminants[i] = SphereDiscriminant(aRay, cx[i], cy[i], cz[i], radius[i], A, B, C);
+        }
+
+        // Only the few spheres the ray hits need the square root
+        for(int i=0; i<aCount; i++)
+        {
+            oDistances[i] = (discriminants[i] < 0.f) ?
+                INFINITY : SphereDistance(aRay, cx[i], cy[i], cz[i], radius[i]);
+        }
+    }
+
+    Vec3f GetVertex0(int aIndex) const { return Vec3f(mP0x[aIndex], mP0y[aIndex], mP0z[aIndex]); }
+    Vec3f GetVertex1(int aIndex) const { return Vec3f(mP1x[aIndex], mP1y[aIndex], mP1z[aIndex]); }
+    Vec3f GetVertex2(int aIndex) const { return Vec3f(mP2x[aIndex], mP2y[aIndex], mP2z[aIndex]); }
+    Vec3f GetCenter(int aIndex)  const { return Vec3f(mCx[aIndex], mCy[aIndex], mCz[aIndex]); }
+
+    // Calls aFunction(array, whether it is a triangle array) on every array
+    template<typename Function>
+    void ForEachArray(Function aFunction)
+    {
+        aFunction(mP0x, true); aFunction(mP0y, true); aFunction(mP0z, true);
+        aFunction(mP1x, true); aFunction(mP1y, true); aFunction(mP1z, true);
+        aFunction(mP2x, true); aFunction(mP2y, true); aFunction(mP2z, true);
+        aFunction(mNx, true);  aFunction(mNy, true);  aFunction(mNz, true);
+        aFunction(mTriangleMatID, true);
+        aFunction(mTriangleLightID, true);
+
+        aFunction(mCx, false); aFunction(mCy, false); aFunction(mCz, false);
+        aFunction(mRadius, false);
+        aFunction(mSphereMatID, false);
+    }
+
+private:
+
+    // Triangles
+    ArenaVector<float> mP0x, mP0y, mP0z;   //!< Vertices
+    ArenaVector<float> mP1x, mP1y, mP1z;
+    ArenaVector<float> mP2x, mP2y, mP2z;
+    ArenaVector<float> mNx, mNy, mNz;      //!< Precomputed geometric normals
+    ArenaVector<int>   mTriangleMatID;
+    ArenaVector<int>   mTriangleLightID;   //!< Light the triangle is the emitter of, -1 for none
+
+    // Spheres
+    ArenaVector<float> mCx, mCy, mCz;      //!< Centers
+    ArenaVector<float> mRadius;
+    ArenaVector<int>   mSphereMatID;
+};
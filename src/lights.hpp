@@ -8,6 +8,7 @@
 #include <algorithm>
 #include "math.hpp"
 #include "rng.hpp"
+#include "arena.hpp"
 
 class AbstractLight
 {
@@ -49,6 +50,9 @@ public:
         throw std::logic_error("Not implemented");
     }
 
+    // Deep copy in the given arena, allocated (and first touched) by the calling thread
+    virtual AbstractLight* Clone(MemoryArena &aoArena) const = 0;
+
     virtual ~AbstractLight() = default;
 };
 
@@ -103,6 +107,11 @@ public:
         return mInvArea;
     }
 
+    virtual AbstractLight* Clone(MemoryArena &aoArena) const override
+    {
+        return aoArena.New<AreaLight>(kArenaLights, *this);
+    }
+
 public:
     Vec3f p0, e1, e2;
     CoordinateFrame mFrame;
@@ -137,6 +146,11 @@ public:
         return 1.0f;
     }
 
+    virtual AbstractLight* Clone(MemoryArena &aoArena) const override
+    {
+        return aoArena.New<PointLight>(kArenaLights, *this);
+    }
+
 public:
     Vec3f mPosition;
     Vec3f mIntensity;
@@ -171,6 +185,11 @@ public:
         return 1/(4.0f*PI_F);
     }
 
+    virtual AbstractLight* Clone(MemoryArena &aoArena) const override
+    {
+        return aoArena.New<BackgroundLight>(kArenaLights, *this);
+    }
+
 public:
     Vec3f mBackgroundColor;
     float mRadius; // we model the background light as a huge sphere around the whole scene, with a given radius
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <algorithm>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// NUMA topology
+//
+// Read once from /sys/devices/system/node on Linux: the nodes with CPUs
+// this process may run on, and their CPUs. Elsewhere, or when /sys cannot
+// be read, the machine is a single node with all CPUs. Memory is never
+// placed explicitly: Linux allocates a page on the node of the thread that
+// touches it first, so data is made local by having the thread that uses
+// it write it first (see Scene::GetNodeReplica).
+class NumaTopology
+{
+public:
+
+    static const NumaTopology& Get()
+    {
+        static const NumaTopology topology;
+        return topology;
+    }
+
+    int GetNodeCount() const { return int(mNodeCpus.size()); }
+
+    // CPUs of a node (numbered from 0, not the /sys node ID)
+    const std::vector<int>& GetNodeCpus(int aNode) const { return mNodeCpus[aNode]; }
+
+    // All CPUs, node after node; the order in which threads are pinned
+    const std::vector<int>& GetCpuOrder() const { return mCpuOrder; }
+
+    int GetNodeOfCpu(int aCpu) const
+    {
+        return (aCpu >= 0 && aCpu < int(mCpuNode.size()) && mCpuNode[aCpu] >= 0) ? mCpuNode[aCpu] : 0;
+    }
+
+    // Node the calling thread runs on at the moment, 0 when unknown
+    int GetCurrentNode() const
+    {
+        if(GetNodeCount() <= 1)
+            return 0;
+#if defined(__linux__)
+        return GetNodeOfCpu(sched_getcpu());
+#else
+        return 0;
+#endif
+    }
+
+    // One line summary, e.g. "2 node(s): 0-15, 16-31"
+    std::string Describe() const
+    {
+        std::string text = std::to_string(GetNodeCount()) + " node(s):";
+        for(int n=0; n<GetNodeCount(); n++)
+        {
+            const std::vector<int> &cpus = mNodeCpus[n];
+            text += n > 0 ? ", " : " ";
+
+            // Runs of consecutive CPUs are written as ranges, as in /sys
+            for(size_t i=0; i<cpus.size(); )
+            {
+                size_t j = i;
+                while(j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+                    j++;
+
+                text += (i > 0 ? "," : "") + std::to_string(cpus[i]);
+                if(j > i)
+                    text += "-" + std::to_string(cpus[j]);
+                i = j + 1;
+            }
+        }
+        return text;
+    }
+
+    /**
+     * Parses a CPU list of /sys, e.g. "0-3,8-11,16"
+     * Returns:
+     *  - false on a malformed list; oCpus gets the CPUs in the order listed
+     */
+    static bool ParseCpuList(
+        const std::string &aList,
+        std::vector<int>  &oCpus)
+    {
+        oCpus.clear();
+
+        const char *p = aList.c_str();
+        while(*p && *p != '\n')
+        {
+            char *end;
+            const long first = strtol(p, &end, 10);
+            if(end == p || first < 0)
+                return false;
+
+            long last = first;
+            p = end;
+            if(*p == '-')
+            {
+                last = strtol(p + 1, &end, 10);
+                if(end == p + 1 || last < first)
+                    return false;
+                p = end;
+            }
+
+            for(long cpu=first; cpu<=last; cpu++)
+                oCpus.push_back(int(cpu));
+
+            if(*p == ',')
+                p++;
+            else if(*p && *p != '\n')
+                return false;
+        }
+
+        return true;
+    }
+
+private:
+
+    NumaTopology()
+    {
+#if defined(__linux__)
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        const bool haveAllowed = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+        // Node IDs may have gaps, the nodes present are listed in "online"
+        std::vector<int> nodeIds;
+        std::ifstream online("/sys/devices/system/node/online");
+        std::string list;
+        if(std::getline(online, list))
+            ParseCpuList(list, nodeIds);
+
+        for(size_t n=0; n<nodeIds.size(); n++)
+        {
+            const std::string name = "/sys/devices/system/node/node" + std::to_string(nodeIds[n]) + "/cpulist";
+            std::ifstream file(name.c_str());
+
+            std::vector<int> cpus;
+            if(!std::getline(file, list) || !ParseCpuList(list, cpus))
+                continue;
+
+            // Only the CPUs this process may use (e.g. within a container's cpuset)
+            std::vector<int> usable;
+            for(size_t i=0; i<cpus.size(); i++)
+            {
+                if(!haveAllowed || (cpus[i] < CPU_SETSIZE && CPU_ISSET(cpus[i], &allowed)))
+                    usable.push_back(cpus[i]);
+            }
+
+            if(!usable.empty())
+                mNodeCpus.push_back(usable);
+        }
+#endif
+
+        if(mNodeCpus.empty())
+        {
+            const int cpuCount = std::max(1, int(std::thread::hardware_concurrency()));
+
+            mNodeCpus.push_back(std::vector<int>());
+            for(int cpu=0; cpu<cpuCount; cpu++)
+                mNodeCpus[0].push_back(cpu);
+        }
+
+        for(int n=0; n<GetNodeCount(); n++)
+        {
+            for(size_t i=0; i<mNodeCpus[n].size(); i++)
+            {
+                const int cpu = mNodeCpus[n][i];
+
+                mCpuOrder.push_back(cpu);
+                if(cpu >= int(mCpuNode.size()))
+                    mCpuNode.resize(cpu + 1, -1);
+                mCpuNode[cpu] = n;
+            }
+        }
+    }
+
+    std::vector<std::vector<int> > mNodeCpus;
+    std::vector<int>               mCpuOrder; //!< Node by node
+    std::vector<int>               mCpuNode;  //!< Node of each CPU, -1 for CPUs of no node
+};
@@ -1,8 +1,8 @@
 #pragma once
 
 #include <vector>
+#include <memory>
 #include <cmath>
-#include <omp.h>
 #include <cassert>
 #include "renderer.hpp"
 #include "rng.hpp"
@@ -15,8 +15,14 @@ class PathTracer : public AbstractRenderer
 public:
     PathTracer(
         const Scene &aScene,
-        int aSeed = 1234) : AbstractRenderer(aScene), mRandomGenerator(aSeed)
+        int aSeed = 1234) : AbstractRenderer(aScene), mRandomGenerator(aSeed),
+        mShadowOccluded(new bool[aScene.GetLightCount()]),
+        mLastOccluders(aScene.GetLightCount(), -1)
     {
+        mShadowRays.reserve(aScene.GetLightCount());
+        mShadowDistances.reserve(aScene.GetLightCount());
+        mShadowOccluders.reserve(aScene.GetLightCount());
+        mLightConnections.reserve(aScene.GetLightCount());
     }
 
     virtual void RunIteration(int iteration)
@@ -38,13 +44,37 @@ public:
             Ray ray = mScene.mCamera.GenerateRay(sample);
 
             auto intersection = mScene.FindClosestIntersection(ray);
+            mRayCount++;
+            PG3_STAT_ADD(kStatPrimaryRays, 1);
+
+            // Auxiliary channels; they cost only a branch when not enabled.
+            // Emitters and background keep unit albedo and zero normal,
+            // so the denoiser never blends them with lit surfaces
+            const int pixelIdx = mFramebuffer.SampleToIndex(sample);
+            if (pixelIdx >= 0)
+            {
+                mFramebuffer.Add(kChannelSampleCount, pixelIdx, 1.f);
+
+                if (intersection && intersection->lightID < 0)
+                {
+                    const Material &mat = mScene.GetMaterial(intersection->materialID);
+                    mFramebuffer.Add(kChannelAlbedo, pixelIdx, mat.mDiffuseReflectance + mat.mPhongReflectance);
+                    mFramebuffer.Add(kChannelNormal, pixelIdx, intersection->normal);
+                }
+                else
+                    mFramebuffer.Add(kChannelAlbedo, pixelIdx, Vec3f(1));
+
+                if (intersection)
+                    mFramebuffer.Add(kChannelDepth, pixelIdx, intersection->distance);
+            }
+
             if (intersection)
             {
                 if (intersection->lightID >= 0)
                 {
                     const AbstractLight *intersectedLightPtr = mScene.GetLightPtr(intersection->lightID);
                     Vec3f intensity = intersectedLightPtr->Evaluate(ray.direction);
-                    mFramebuffer.AddColor(sample, intensity);
+                    mFramebuffer.AddEmission(sample, intensity);
                     continue;
                 }
 
@@ -59,10 +89,13 @@ public:
                 //BRDF SAMPLING
                 //Sampling the material
                 auto [direction,brdfIntensity,pdfMaterial] = mat.SampleReflectedDirection(incomingDirection,mRandomGenerator);
+                PG3_STAT_ADD(kStatShadingCalls, 1);
                 Ray sampleRay=Ray(surfacePoint,frame.ToWorld(direction),EPSILON_RAY);
                 
                 //Checking for light inersection
                 auto sampleIntersection= mScene.FindClosestIntersection(sampleRay);
+                mRayCount++;
+                PG3_STAT_ADD(kStatSampleRays, 1);
                 if(sampleIntersection && sampleIntersection->lightID>=0)
                 { 
                     //Evaluating light source
@@ -88,7 +121,13 @@ public:
                 }            
 
                 //LIGHT SOURCE SAMPLE
-                // Connect from the current surface point to every light source in the scene:
+                // Connect from the current surface point to every light source in the scene.
+                // The shadow rays are collected and tested in one batch afterwards
+                mShadowRays.clear();
+                mShadowDistances.clear();
+                mShadowOccluders.clear();
+                mLightConnections.clear();
+
                 for (int i = 0; i < mScene.GetLightCount(); i++)
                 {
                     const AbstractLight *light = mScene.GetLightPtr(i);
@@ -108,20 +147,76 @@ public:
 
                     if (cosTheta > 0 && intensity.Max() > 0)
                     {
-                        Ray rayToLight(surfacePoint, outgoingDirection, EPSILON_RAY); // Note! To prevent intersecting the same object we are already on, we need to offset the ray by EPSILON_RAY
-                        if (!mScene.FindAnyIntersection(rayToLight, lightDistance))
-                        { // Testing if the direction towards the light source is not occluded
-                            LoDirect += MIRWeightLight* intensity * mat.EvaluateBRDF(incomingDirection,frame.ToLocal(outgoingDirection)) * cosTheta / pdfLight;
-                        }
+                        mShadowRays.push_back(Ray(surfacePoint, outgoingDirection, EPSILON_RAY)); // Note! To prevent intersecting the same object we are already on, we need to offset the ray by EPSILON_RAY
+                        mShadowDistances.push_back(lightDistance);
+                        mShadowOccluders.push_back(mLastOccluders[i]);
+                        mLightConnections.push_back({ i, MIRWeightLight * intensity, cosTheta, pdfLight });
+                    }
+                }
+
+                const int shadowRayCount = int(mShadowRays.size());
+                mRayCount += shadowRayCount;
+                PG3_STAT_ADD(kStatShadowRays, shadowRayCount);
+                mScene.Occluded(mShadowRays.data(), mShadowDistances.data(), shadowRayCount, mShadowOccluded.get(), mShadowOccluders.data());
+
+                for (int i = 0; i < shadowRayCount; i++)
+                {
+                    mLastOccluders[mLightConnections[i].mLightID] = mShadowOccluders[i];
+
+                    if (!mShadowOccluded[i])
+                    { // Testing if the direction towards the light source is not occluded
+                        const LightConnection &connection = mLightConnections[i];
+                        PG3_STAT_ADD(kStatShadingCalls, 1);
+                        LoDirect += connection.mWeightedIntensity * mat.EvaluateBRDF(incomingDirection,frame.ToLocal(mShadowRays[i].direction)) * connection.mCosTheta / connection.mPdfLight;
                     }
                 }
 
                 mFramebuffer.AddColor(sample, LoDirect);
+                if (pixelIdx >= 0)
+                    mFramebuffer.Add(kChannelDirect, pixelIdx, LoDirect);
             }
         }
 
         mIterations++;
     }
 
+    virtual void Reset(int aSeed)
+    {
+        AbstractRenderer::Reset(aSeed);
+        mRandomGenerator = Rng(aSeed);
+    }
+
+    virtual void SaveState(std::ostream &aoStream) const
+    {
+        AbstractRenderer::SaveState(aoStream);
+        mRandomGenerator.SaveState(aoStream);
+    }
+
+    virtual bool LoadState(std::istream &aoStream)
+    {
+        return AbstractRenderer::LoadState(aoStream) && mRandomGenerator.LoadState(aoStream);
+    }
+
     Rng mRandomGenerator;
+
+private:
+
+    // Light sample of the current shading point waiting for its shadow ray
+    struct LightConnection
+    {
+        int   mLightID;
+        Vec3f mWeightedIntensity; //!< MIS weight times the light intensity
+        float mCosTheta;
+        float mPdfLight;
+    };
+
+    std::vector<Ray>             mShadowRays;
+    std::vector<float>           mShadowDistances;
+    std::vector<int>             mShadowOccluders;  //!< Last occluders of the lights of the shadow rays
+    std::vector<LightConnection> mLightConnections;
+    std::unique_ptr<bool[]>      mShadowOccluded;
+
+    // Primitive that blocked the last shadow ray towards each light, -1 for none.
+    // Nearby shading points (consecutive pixels) tend to be shadowed by the same one
+    std::vector<int>             mLastOccluders;
 };
@@ -0,0 +1,709 @@
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdio>
+#include <chrono>
+#include <sstream>
+#include <algorithm>
+#include "math.hpp"
+#include "utils.hpp"
+#include "ray.hpp"
+#include "geometry.hpp"
+#include "camera.hpp"
+#include "materials.hpp"
+#include "lights.hpp"
+#include "framebuffer.hpp"
+#include "scene.hpp"
+#include "rng.hpp"
+
+//////////////////////////////////////////////////////////////////////////
+// Microbenchmarks of the rendering kernels
+//
+// Built like the renderer, as its own executable:
+//     g++ -std=c++17 -O2 -fopenmp-simd -pthread pg3bench.cpp -o pg3bench
+//
+// Every kernel runs single-threaded on precomputed random inputs, cycling
+// through a table small enough to stay in cache. The number of operations
+// per sample is calibrated so that a sample takes at least the minimum
+// time; one sample is run and thrown away to warm the caches, then the
+// mean, the median and a 95% confidence interval of the mean are taken
+// over the given number of samples.
+
+// Results are added here so that the compiler cannot drop the kernels
+volatile float g_BenchSink = 0.f;
+
+struct BenchResult
+{
+    std::string mName;
+    double      mNsPerOp;      //!< Mean over the samples
+    double      mNsPerOpMedian;
+    double      mNsPerOpCi95;  //!< Half-width of the 95% confidence interval of the mean
+    double      mOpsPerSec;
+    int         mSamples;
+    int64_t     mOpsPerSample;
+};
+
+struct BenchOptions
+{
+    int         mSamples;      // Timed samples per benchmark
+    double      mMinSampleTime; // Seconds, the op count per sample is calibrated to it
+    std::string mFilter;       // Only benchmarks with this in their name
+    std::string mJsonName;     // JSON output, empty for none
+};
+
+// Two-sided 95% quantile of Student's t distribution with aDof degrees of freedom
+double StudentT95(int aDof)
+{
+    static const double table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+
+    if (aDof < 1)
+        return 0.0;
+    if (aDof <= int(sizeof(table) / sizeof(table[0])))
+        return table[aDof - 1];
+    return 1.960;
+}
+
+/**
+ * Times aKernel, which runs the given number of operations
+ * and returns a value that depends on all of them
+ */
+template<typename Kernel>
+BenchResult Measure(
+    const std::string  &aName,
+    const BenchOptions &aOptions,
+    Kernel             aKernel)
+{
+    typedef std::chrono::high_resolution_clock Clock;
+
+    auto runSample = [&aKernel](int64_t aOps)
+    {
+        const auto startT = Clock::now();
+        g_BenchSink = g_BenchSink + aKernel(aOps);
+        const auto endT = Clock::now();
+        return std::chrono::duration<double>(endT - startT).count();
+    };
+
+    // Doubles the op count until a sample is long enough, this also warms up
+    int64_t ops = 1;
+    while (runSample(ops) < aOptions.mMinSampleTime && ops < (int64_t(1) << 40))
+        ops *= 2;
+    runSample(ops);
+
+    std::vector<double> nsPerOp(aOptions.mSamples);
+    for (int i = 0; i < aOptions.mSamples; i++)
+        nsPerOp[i] = runSample(ops) * 1e9 / double(ops);
+
+    double mean = 0.0;
+    for (size_t i = 0; i < nsPerOp.size(); i++)
+        mean += nsPerOp[i];
+    mean /= nsPerOp.size();
+
+    double variance = 0.0;
+    for (size_t i = 0; i < nsPerOp.size(); i++)
+        variance += Sqr(nsPerOp[i] - mean);
+    variance /= std::max<size_t>(1, nsPerOp.size() - 1);
+
+    std::vector<double> sorted = nsPerOp;
+    std::sort(sorted.begin(), sorted.end());
+
+    BenchResult result;
+    result.mName          = aName;
+    result.mNsPerOp       = mean;
+    result.mNsPerOpMedian = sorted[sorted.size() / 2];
+    result.mNsPerOpCi95   = StudentT95(aOptions.mSamples - 1) * std::sqrt(variance / nsPerOp.size());
+    result.mOpsPerSec     = mean > 0.0 ? 1e9 / mean : 0.0;
+    result.mSamples       = aOptions.mSamples;
+    result.mOpsPerSample  = ops;
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Benchmarks
+
+class BenchSuite
+{
+public:
+
+    // Table sizes of the random inputs, powers of two
+    static const int kInputCount = 4096;
+    static const int kShadowRaysPerPoint = 8;
+    static const int kRowLength = 512;
+    static const int kReduceSources = 8;     //!< Framebuffers of a render with 8 threads
+    static const int kMeshTriangles = 1 << 20; //!< Of the BVH benchmarks, far beyond the L3 cache
+
+    BenchSuite(const BenchOptions &aOptions) :
+        mOptions(aOptions),
+        mRng(1234)
+    {
+        // Every light type, glossy and diffuse materials, walls and spheres
+        mScene.LoadCornellBox(Vec2i(512, 512),
+            Scene::kLightCeiling | Scene::kLightPoint | Scene::kLightEnv | Scene::kWalls | Scene::kSpheres |
+            Scene::kWallsDiffuse | Scene::kWallsGlossy | Scene::kSpheresDiffuse | Scene::kSpheresGlossy);
+
+        const GeometryList *list = static_cast<const GeometryList*>(mScene.mGeometry);
+        for (int i = 0; i < list->GetTriangleCount(); i++)
+            mTriangles.push_back(list->GetTriangle(i));
+        for (int i = 0; i < list->GetSphereCount(); i++)
+            mSpheres.push_back(list->GetSphere(i));
+
+        // Rays from inside the box in all directions, as secondary rays are
+        mRays.resize(kInputCount);
+        mPoints.resize(kInputCount);
+        mRasterSamples.resize(kInputCount);
+        mLocalDirections.resize(kInputCount);
+        mColors.resize(kInputCount);
+        mTriangleIndices.resize(kInputCount);
+        mSphereIndices.resize(kInputCount);
+
+        for (int i = 0; i < kInputCount; i++)
+        {
+            const Vec3f origin = (mRng.GetVec3f() * 2.f - Vec3f(1.f)) * 1.2f;
+            mRays[i]            = Ray(origin, sampleUnitSphereUniform(mRng.GetVec2f()), EPSILON_RAY);
+            mPoints[i]          = origin;
+            mRasterSamples[i]   = mRng.GetVec2f() * mScene.mCamera.mResolution;
+            mLocalDirections[i] = sampleCosUnitHemisphere(mRng.GetVec2f());
+            mColors[i]          = mRng.GetVec3f();
+            mTriangleIndices[i] = int(mRng.GetUint() % mTriangles.size());
+            mSphereIndices[i]   = int(mRng.GetUint() % mSpheres.size());
+        }
+
+        // The raster samples again, as the separate coordinate arrays of a row
+        mRasterX.resize(kInputCount);
+        mRasterY.resize(kInputCount);
+        for (int i = 0; i < kInputCount; i++)
+        {
+            mRasterX[i] = mRasterSamples[i].x;
+            mRasterY[i] = mRasterSamples[i].y;
+        }
+
+        // Shadow rays as the path tracer casts them: from the visible surface
+        // points of consecutive pixels to one sample on each light, kShadowRaysPerPoint per point
+        mShadowRays.resize(kInputCount);
+        mShadowDistances.resize(kInputCount);
+
+        for (int i = 0; i < kInputCount; i += kShadowRaysPerPoint)
+        {
+            const int   pixel   = i / kShadowRaysPerPoint + 128 * int(mScene.mCamera.mResolution.x);
+            const Vec2f sample  = Vec2f(float(pixel % int(mScene.mCamera.mResolution.x)),
+                float(pixel / int(mScene.mCamera.mResolution.x))) + mRng.GetVec2f();
+            const Ray   primary = mScene.mCamera.GenerateRay(sample);
+            const auto isect  = mScene.FindClosestIntersection(primary);
+            const Vec3f surfacePoint = isect ? primary.origin + primary.direction * isect->distance : primary.origin;
+
+            for (int j = 0; j < kShadowRaysPerPoint; j++)
+            {
+                const AbstractLight *light = mScene.GetLightPtr(j % mScene.GetLightCount());
+                const Vec3f lightPoint = std::get<0>(light->SamplePointOnLight(surfacePoint, mRng));
+
+                mShadowRays[i + j]      = Ray(surfacePoint, Normalize(lightPoint - surfacePoint), EPSILON_RAY);
+                mShadowDistances[i + j] = sqrt((lightPoint - surfacePoint).LenSqr());
+            }
+        }
+    }
+
+    void Run(std::vector<BenchResult> &aoResults)
+    {
+        const int mask = kInputCount - 1;
+
+        Add(aoResults, "Triangle::Intersect", [this, mask](int64_t aOps)
+        {
+            float sum = 0.f;
+            for (int64_t i = 0; i < aOps; i++)
+            {
+                Intersection isect(1e36f);
+                if (mTriangles[mTriangleIndices[i & mask]].Intersect(mRays[i & mask], isect))
+                    sum += isect.distance;
+            }
+            return sum;
+        });
+
+        Add(aoResults, "Sphere::Intersect", [this, mask](int64_t aOps)
+        {
+            float sum = 0.f;
+            for (int64_t i = 0; i < aOps; i++)
+            {
+                Intersection isect(1e36f);
+                if (mSpheres[mSphereIndices[i & mask]].Intersect(mRays[i & mask], isect))
+                    sum += isect.distance;
+            }
+            return sum;
+        });
+
+        Add(aoResults, "GeometryList::Intersect", [this, mask](int64_t aOps)
+        {
+            float sum = 0.f;
+            for (int64_t i = 0; i < aOps; i++)
+            {
+                Intersection isect(1e36f);
+                if (mScene.mGeometry->Intersect(mRays[i & mask], isect))
+                    sum += isect.distance;
+            }
+            return sum;
+        });
+
+        Add(aoResults, "GeometryList::IntersectP", [this, mask](int64_t aOps)
+        {
+            float sum = 0.f;
+            for (int64_t i = 0; i < aOps; i++)
+            {
+                Intersection isect(1.f);
+                if (mScene.mGeometry->IntersectP(mRays[i & mask], isect))
+                    sum += 1.f;
+            }
+            return sum;
+        });
+
+        Add(aoResults, "Scene::FindAnyIntersection (shadow rays)", [this, mask](int64_t aOps)
+        {
+            float sum = 0.f;
+            for (int64_t i = 0; i < aOps; i++)
+            {
+                if (mScene.FindAnyIntersection(mShadowRays[i & mask], mShadowDistances[i & mask]))
+                    sum += 1.f;
+            }
+            return sum;
+        });
+
+        Add(aoResults, "Scene::Occluded (shadow rays)", [this, mask](int64_t aOps)
+        {
+            float sum = 0.f;
+            for (int64_t i = 0; i < aOps; i++)
+            {
+                if (mScene.Occluded(mShadowRays[i & mask], mShadowDistances[i & mask]))
+                    sum += 1.f;
+            }
+            return sum;
+        });
+
+        Add(aoResults, "Scene::Occluded, last occluder (shadow rays)", [this, mask](int64_t aOps)
+        {
+            float sum = 0.f;
+            int lastOccluders[kShadowRaysPerPoint] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+            for (int64_t i = 0; i < aOps; i++)
+            {
+                if (mScene.Occluded(mShadowRays[i & mask], mShadowDistances[i & mask], &lastOccluders[i % kShadowRaysPerPoint]))
+                    sum += 1.f;
+            }
+            return sum;
+        });
+
+        // Ops are rays, a whole batch per shading point
+        Add(aoResults, "Scene::Occluded, batched (shadow rays)", [this, mask](int64_t aOps)
+        {
+            float sum = 0.f;
+            int lastOccluders[kShadowRaysPerPoint] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+            bool occluded[kShadowRaysPerPoint];
+            for (int64_t i = 0; i < aOps; i += kShadowRaysPerPoint)
+            {
+                const int first = int(i & mask);
+                mScene.Occluded(&mShadowRays[first], &mShadowDistances[first], kShadowRaysPerPoint, occluded, lastOccluders);
+                for (int j = 0; j < kShadowRaysPerPoint; j++)
+                    sum += occluded[j] ? 1.f : 0.f;
+            }
+            return sum;
+        });
+
+        // A mesh whose BVH does not fit the caches, in full precision and compressed
+        for (int a = Scene::kAccelBvh; a <= Scene::kAccelCompressedBvh; a++)
+        {
+            const std::string suffix = (a == Scene::kAccelBvh) ? " (1M triangle mesh, full precision)" :
+                " (1M triangle mesh, compressed)";
+            if (("Bvh::Intersect" + suffix).find(mOptions.mFilter) == std::string::npos &&
+                ("Bvh::IntersectP" + suffix).find(mOptions.mFilter) == std::string::npos)
+                continue;
+
+            Scene mesh;
+            mesh.LoadStressScene(Vec2i(512, 512), Scene::kStressMesh, kMeshTriangles, 1);
+            mesh.BuildAccel(Scene::AccelType(a));
+            printf("%s\n", mesh.DescribeAccel().c_str());
+
+            Add(aoResults, "Bvh::Intersect" + suffix, [this, &mesh, mask](int64_t aOps)
+            {
+                float sum = 0.f;
+                for (int64_t i = 0; i < aOps; i++)
+                {
+                    Intersection isect(1e36f);
+                    if (mesh.mGeometry->Intersect(mRays[i & mask], isect))
+                        sum += isect.distance;
+                }
+                return sum;
+            });
+
+            Add(aoResults, "Bvh::IntersectP" + suffix, [this, &mesh, mask](int64_t aOps)
+            {
+                float sum = 0.f;
+                for (int64_t i = 0; i < aOps; i++)
+                {
+                    Intersection isect(1.f);
+                    if (mesh.mGeometry->IntersectP(mRays[i & mask], isect))
+                        sum += 1.f;
+                }
+                return sum;
+            });
+        }
+
+        Add(aoResults, "Camera::GenerateRay", [this, mask](int64_t aOps)
+        {
+            float sum = 0.f;
+            for (int64_t i = 0; i < aOps; i++)
+                sum += mScene.mCamera.GenerateRay(mRasterSamples[i & mask]).direction.x;
+            return sum;
+        });
+
+        Add(aoResults, "Camera::GenerateRay (differentials)", [this, mask](int64_t aOps)
+        {
+            float sum = 0.f;
+            RayDifferential differential;
+            for (int64_t i = 0; i < aOps; i++)
+                sum += mScene.mCamera.GenerateRay(mRasterSamples[i & mask], differential).direction.x + differential.directionDx.x;
+            return sum;
+        });
+
+        // Ops are rays, generated a row of kRowLength samples at a time
+        Add(aoResults, "Camera::GenerateRays (differentials)", [this, mask](int64_t aOps)
+        {
+            float sum = 0.f;
+            for (int64_t i = 0; i < aOps; i += kRowLength)
+            {
+                const int first = int(i & mask);
+                mScene.mCamera.GenerateRays(&mRasterX[first], &mRasterY[first], kRowLength, mRayBuffer);
+                sum += mRayBuffer.mDirectionX[0] + mRayBuffer.mDirectionDxX[0];
+            }
+            return sum;
+        });
+
+        for (int m = 2; m < mScene.GetMaterialCount(); m++)
+        {
+            const Material &mat = mScene.GetMaterial(m);
+            std::ostringstream suffix;
+            suffix << " (material " << m << ")";
+
+            Add(aoResults, "Material::SampleReflectedDirection" + suffix.str(), [this, &mat, mask](int64_t aOps)
+            {
+                float sum = 0.f;
+                for (int64_t i = 0; i < aOps; i++)
+                    sum += std::get<2>(mat.SampleReflectedDirection(mLocalDirections[i & mask], mRng));
+                return sum;
+            });
+
+            Add(aoResults, "Material::EvaluateBRDF" + suffix.str(), [this, &mat, mask](int64_t aOps)
+            {
+                float sum = 0.f;
+                for (int64_t i = 0; i < aOps; i++)
+                    sum += mat.EvaluateBRDF(mLocalDirections[i & mask], mLocalDirections[(i + 1) & mask]).x;
+                return sum;
+            });
+        }
+
+        for (int l = 0; l < mScene.GetLightCount(); l++)
+        {
+            const AbstractLight *light = mScene.GetLightPtr(l);
+
+            std::string type = "BackgroundLight";
+            if (dynamic_cast<const AreaLight*>(light))
+                type = "AreaLight";
+            else if (dynamic_cast<const PointLight*>(light))
+                type = "PointLight";
+
+            std::ostringstream name;
+            name << type << "::SamplePointOnLight (light " << l << ")";
+
+            Add(aoResults, name.str(), [this, light, mask](int64_t aOps)
+            {
+                float sum = 0.f;
+                for (int64_t i = 0; i < aOps; i++)
+                    sum += std::get<2>(light->SamplePointOnLight(mPoints[i & mask], mRng));
+                return sum;
+            });
+        }
+
+        Add(aoResults, "Rng::GetFloat", [this](int64_t aOps)
+        {
+            float sum = 0.f;
+            for (int64_t i = 0; i < aOps; i++)
+                sum += mRng.GetFloat();
+            return sum;
+        });
+
+        Add(aoResults, "Rng::GetVec2f", [this](int64_t aOps)
+        {
+            float sum = 0.f;
+            for (int64_t i = 0; i < aOps; i++)
+                sum += mRng.GetVec2f().y;
+            return sum;
+        });
+
+        // Random pixels, as the accumulation of a sample
+        Framebuffer framebuffer;
+        framebuffer.Setup(mScene.mCamera.mResolution);
+
+        Add(aoResults, "Framebuffer::AddColor", [this, &framebuffer, mask](int64_t aOps)
+        {
+            for (int64_t i = 0; i < aOps; i++)
+                framebuffer.AddColor(mRasterSamples[i & mask], mColors[i & mask]);
+            return framebuffer.GetPlane(kChannelColor)[0];
+        });
+
+        Framebuffer other = framebuffer;
+
+        Add(aoResults, "Framebuffer::Add (512x512)", [&framebuffer, &other](int64_t aOps)
+        {
+            for (int64_t i = 0; i < aOps; i++)
+                framebuffer.Add(other);
+            return framebuffer.GetPlane(kChannelColor)[0];
+        });
+
+        Add(aoResults, "Framebuffer::Scale (512x512)", [&framebuffer](int64_t aOps)
+        {
+            for (int64_t i = 0; i < aOps; i++)
+                framebuffer.Scale(0.999f);
+            return framebuffer.GetPlane(kChannelColor)[0];
+        });
+
+        // The per-thread framebuffers of a render into the final average
+        std::vector<Framebuffer>        threadFramebuffers(kReduceSources, framebuffer);
+        std::vector<const Framebuffer*> sources;
+        for (int i = 0; i < kReduceSources; i++)
+            sources.push_back(&threadFramebuffers[i]);
+
+        Add(aoResults, "Framebuffer, 8 x 512x512 by copy, Scale and Add", [&framebuffer, &threadFramebuffers](int64_t aOps)
+        {
+            for (int64_t i = 0; i < aOps; i++)
+            {
+                for (int j = 0; j < kReduceSources; j++)
+                {
+                    Framebuffer tmp = threadFramebuffers[j];
+                    tmp.Scale(0.5f);
+
+                    if (j == 0)
+                        framebuffer = tmp;
+                    else
+                        framebuffer.Add(tmp);
+                }
+                framebuffer.Scale(1.f / kReduceSources);
+            }
+            return framebuffer.GetPlane(kChannelColor)[0];
+        });
+
+        Add(aoResults, "Framebuffer::Reduce (8 x 512x512)", [&framebuffer, &sources](int64_t aOps)
+        {
+            const std::vector<float> weights(kReduceSources, 0.5f);
+
+            for (int64_t i = 0; i < aOps; i++)
+                framebuffer.Reduce(sources, weights, 1.f / kReduceSources);
+            return framebuffer.GetPlane(kChannelColor)[0];
+        });
+
+        // One sample per pixel into all channels, as the path tracer accumulates,
+        // in the order of its pixel loop and in the order of the framebuffer tiles
+        Framebuffer aovFramebuffer;
+        aovFramebuffer.Setup(mScene.mCamera.mResolution, (1u << kChannelCount) - 1);
+
+        Add(aoResults, "Framebuffer, all channels (row order)", [this, &aovFramebuffer, mask](int64_t aOps)
+        {
+            for (int64_t i = 0; i < aOps; i++)
+            {
+                const int x = int(i & (kRowLength - 1));
+                const int y = int((i / kRowLength) & (kRowLength - 1));
+                AccumulateSample(aovFramebuffer, x, y, int(i & mask));
+            }
+            return aovFramebuffer.GetPlane(kChannelColor)[0];
+        });
+
+        Add(aoResults, "Framebuffer, all channels (tile order)", [this, &aovFramebuffer, mask](int64_t aOps)
+        {
+            const int tileSize = Framebuffer::kTileSize;
+            const int tileArea = tileSize * tileSize;
+            const int tilesX   = kRowLength / tileSize;
+
+            for (int64_t i = 0; i < aOps; i++)
+            {
+                const int tile = int((i / tileArea) & (tilesX * tilesX - 1));
+                const int x    = (tile % tilesX) * tileSize + int(i & (tileSize - 1));
+                const int y    = (tile / tilesX) * tileSize + int((i / tileSize) & (tileSize - 1));
+                AccumulateSample(aovFramebuffer, x, y, int(i & mask));
+            }
+            return aovFramebuffer.GetPlane(kChannelColor)[0];
+        });
+    }
+
+private:
+
+    // The framebuffer writes of one camera sample of the path tracer
+    void AccumulateSample(
+        Framebuffer &aoFramebuffer,
+        int         aX,
+        int         aY,
+        int         aInput)
+    {
+        const Vec2f sample   = Vec2f(float(aX), float(aY)) + mRasterSamples[aInput] * (1.f / kRowLength);
+        const int   pixelIdx = aoFramebuffer.SampleToIndex(sample);
+
+        if (pixelIdx < 0)
+            return;
+
+        aoFramebuffer.Add(kChannelSampleCount, pixelIdx, 1.f);
+        aoFramebuffer.Add(kChannelAlbedo, pixelIdx, mColors[aInput]);
+        aoFramebuffer.Add(kChannelNormal, pixelIdx, mLocalDirections[aInput]);
+        aoFramebuffer.Add(kChannelDepth, pixelIdx, mColors[aInput].x);
+        aoFramebuffer.Add(kChannelDirect, pixelIdx, mColors[aInput]);
+        aoFramebuffer.AddColor(sample, mColors[aInput]);
+    }
+
+    template<typename Kernel>
+    void Add(
+        std::vector<BenchResult> &aoResults,
+        const std::string        &aName,
+        Kernel                   aKernel)
+    {
+        if (aName.find(mOptions.mFilter) == std::string::npos)
+            return;
+
+        const BenchResult result = Measure(aName, mOptions, aKernel);
+
+        printf("%-52s %12.2f ns/op  +- %5.2f%%  %12.0f ops/s\n",
+            result.mName.c_str(), result.mNsPerOp,
+            result.mNsPerOp > 0.0 ? 100.0 * result.mNsPerOpCi95 / result.mNsPerOp : 0.0,
+            result.mOpsPerSec);
+        fflush(stdout);
+
+        aoResults.push_back(result);
+    }
+
+private:
+
+    BenchOptions          mOptions;
+    Scene                 mScene;
+    Rng                   mRng;
+    std::vector<Triangle> mTriangles;
+    std::vector<Sphere>   mSpheres;
+    std::vector<Ray>      mRays;
+    std::vector<Vec3f>    mPoints;
+    std::vector<Vec2f>    mRasterSamples;
+    std::vector<Vec3f>    mLocalDirections;
+    std::vector<Vec3f>    mColors;
+    std::vector<int>      mTriangleIndices; //!< Random primitive for each ray
+    std::vector<int>      mSphereIndices;
+    std::vector<Ray>      mShadowRays;      //!< Groups of kShadowRaysPerPoint from one surface point
+    std::vector<float>    mShadowDistances;
+    std::vector<float>    mRasterX;         //!< mRasterSamples as structure of arrays
+    std::vector<float>    mRasterY;
+    RayBuffer             mRayBuffer;
+};
+
+// One object per benchmark, keys and their order do not change between versions
+bool SaveJson(
+    const std::string              &aFilename,
+    const BenchOptions             &aOptions,
+    const std::vector<BenchResult> &aResults)
+{
+    FILE *file = fopen(aFilename.c_str(), "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "{\n  \"format\": \"pg3bench-1\",\n  \"samples\": %d,\n  \"min_sample_time\": %.4f,\n  \"benchmarks\": [\n",
+        aOptions.mSamples, aOptions.mMinSampleTime);
+
+    for (size_t i = 0; i < aResults.size(); i++)
+    {
+        const BenchResult &r = aResults[i];
+        fprintf(file,
+            "    {\"name\": \"%s\", \"ns_per_op\": %.4f, \"ns_per_op_median\": %.4f, \"ns_per_op_ci95\": %.4f, "
+            "\"ops_per_sec\": %.1f, \"samples\": %d, \"ops_per_sample\": %lld}%s\n",
+            r.mName.c_str(), r.mNsPerOp, r.mNsPerOpMedian, r.mNsPerOpCi95, r.mOpsPerSec,
+            r.mSamples, (long long)r.mOpsPerSample, i + 1 < aResults.size() ? "," : "");
+    }
+
+    fprintf(file, "  ]\n}\n");
+    return fclose(file) == 0;
+}
+
+void PrintHelp(const char *argv[])
+{
+    printf("\n");
+    printf("Usage: %s [ --samples <count> | --min-time <ms> | --filter <text> | --json <file> ]\n\n", argv[0]);
+    printf("    --samples <count>     Timed samples per benchmark (default 20)\n");
+    printf("    --min-time <ms>       Minimum duration of one sample (default 10)\n");
+    printf("    --filter <text>       Runs only benchmarks whose name contains the text\n");
+    printf("    --json <file>         Writes the results as JSON\n");
+    printf("\n");
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Main
+
+int main(int argc, const char *argv[])
+{
+    BenchOptions options;
+    options.mSamples       = 20;
+    options.mMinSampleTime = 0.01;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg(argv[i]);
+
+        if (arg == "-h" || arg == "--help")
+        {
+            PrintHelp(argv);
+            return 0;
+        }
+
+        if (i + 1 == argc)
+        {
+            printf("Missing argument of %s, please see help (-h)\n", arg.c_str());
+            return 1;
+        }
+
+        const std::string value(argv[++i]);
+        std::istringstream iss(value);
+
+        if (arg == "--samples")
+        {
+            iss >> options.mSamples;
+            if (iss.fail() || options.mSamples < 2)
+            {
+                printf("Invalid <count> argument, please see help (-h)\n");
+                return 1;
+            }
+        }
+        else if (arg == "--min-time")
+        {
+            iss >> options.mMinSampleTime;
+            if (iss.fail() || options.mMinSampleTime <= 0.0)
+            {
+                printf("Invalid <ms> argument, please see help (-h)\n");
+                return 1;
+            }
+            options.mMinSampleTime *= 1e-3;
+        }
+        else if (arg == "--filter")
+            options.mFilter = value;
+        else if (arg == "--json")
+            options.mJsonName = value;
+        else
+        {
+            printf("Unknown option %s, please see help (-h)\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<BenchResult> results;
+    BenchSuite suite(options);
+    suite.Run(results);
+
+    if (options.mJsonName.length() > 0)
+    {
+        if (SaveJson(options.mJsonName, options, results))
+            printf("Saved:     %s\n", options.mJsonName.c_str());
+        else
+        {
+            printf("Cannot write %s\n", options.mJsonName.c_str());
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include <vector>
 #include <cmath>
 #include <cstdlib>
+#include <cstdio>
 #include <chrono>
 #include <algorithm>
 #include "math.hpp"
@@ -11,105 +12,358 @@
 #include "scene.hpp"
 #include "pathtracer.hpp"
 #include "config.hpp"
-
-#include <omp.h>
+#include "denoiser.hpp"
+#include "preview.hpp"
+#include "checkpoint.hpp"
+#include "distributed.hpp"
+#include "server.hpp"
+#include "progress.hpp"
+#include "trace.hpp"
+#include "convergence.hpp"
+
+#include "tasks.hpp"
+
+#include <atomic>
 #include <string>
 #include <set>
 #include <sstream>
+#include <iostream>
 
 //////////////////////////////////////////////////////////////////////////
 // The main rendering function, renders what is in aConfig
 
-float render(
+// Denoises the averaged image, guided by the feature buffers, returns the time it took
+float denoise(
+    const Config &aConfig,
+    Framebuffer  &aoFramebuffer)
+{
+    TraceScope trace("Denoise");
+    auto denoiseStartT = std::chrono::high_resolution_clock::now();
+
+    Denoiser denoiser;
+    denoiser.mPasses = aConfig.mDenoisePasses;
+    denoiser.Run(aoFramebuffer);
+
+    auto denoiseEndT = std::chrono::high_resolution_clock::now();
+
+    return float(std::chrono::duration_cast<std::chrono::microseconds>(denoiseEndT - denoiseStartT).count()) / 1e6f;
+}
+
+// Configuration of worker aIndex out of aCount in a distributed render
+Config workerConfig(
     const Config &aConfig,
-    int *oUsedIterations = NULL)
+    int          aIndex,
+    int          aCount)
 {
-    // Set number of used threads
-    omp_set_num_threads(aConfig.mNumThreads);
+    int firstIteration, iterationCount;
+    WorkerIterationRange(aConfig.mIterations, aIndex, aCount, firstIteration, iterationCount);
 
+    Config config = aConfig;
+    config.mIterations = iterationCount;
+    config.mBaseSeed  += aIndex * kWorkerSeedStride;
+
+    return config;
+}
+
+// With oPartial the renderers are summed into it without averaging or
+// denoising, for a distributed render. With aRenderers (one per thread,
+// owned by the caller) the given renderers are reset and reused.
+float render(
+    const Config &aConfig,
+    int *oUsedIterations = NULL,
+    float *oDenoiseTime = NULL,
+    PartialAccumulation *oPartial = NULL,
+    AbstractRenderer **aRenderers = NULL)
+{
     // Create 1 renderer per thread
     typedef AbstractRenderer *AbstractRendererPtr;
     AbstractRendererPtr *renderers;
     renderers = new AbstractRendererPtr[aConfig.mNumThreads];
 
-    for (int i = 0; i < aConfig.mNumThreads; i++)
+    // Given renderers are reset, missing ones are created and handed back
+    auto createRenderer = [&aConfig, aRenderers](int aIndex)
+    {
+        AbstractRenderer *renderer = aRenderers ? aRenderers[aIndex] : NULL;
+
+        if (renderer)
+            renderer->Reset(aConfig.mBaseSeed + aIndex);
+        else
+        {
+            renderer = CreateRenderer(aConfig, aConfig.mBaseSeed + aIndex);
+            if (aRenderers)
+                aRenderers[aIndex] = renderer;
+        }
+
+        renderer->mMaxPathLength = aConfig.mMaxPathLength;
+        renderer->mMinPathLength = aConfig.mMinPathLength;
+
+        renderer->SetupChannels(aConfig.mChannelMask |
+            (aConfig.mDenoisePasses > 0 ? Denoiser::kRequiredChannels : 0));
+
+        return renderer;
+    };
+
+    // Renderers are created by the first task of their iteration chain, see
+    // below, so the thread that renders one also first touches its framebuffer
+    // and the memory ends up on its NUMA node
+    std::fill(renderers, renderers + aConfig.mNumThreads, AbstractRendererPtr(NULL));
+
+    // Previews are written next to the final image and atomically replaced,
+    // so a viewer never sees a partial file
+    PreviewWriter *preview = NULL;
+    if (aConfig.mPreviewInterval > 0.f)
     {
-        renderers[i] = CreateRenderer(aConfig, aConfig.mBaseSeed + i);
+        const std::string &name = aConfig.mOutputName;
+        const std::string partName = name.substr(0, name.length() - 4) + ".part" + name.substr(name.length() - 4);
 
-        renderers[i]->mMaxPathLength = aConfig.mMaxPathLength;
-        renderers[i]->mMinPathLength = aConfig.mMinPathLength;
+        preview = new PreviewWriter(aConfig.mNumThreads, aConfig.mScene->mCamera.mResolution,
+            aConfig.mPreviewInterval,
+            [&aConfig, name, partName](Framebuffer &aPreview)
+            {
+                // Only a complete file replaces the last good preview
+                if (SaveImage(aPreview, partName, aConfig))
+                    std::rename(partName.c_str(), name.c_str());
+                else
+                    std::remove(partName.c_str());
+            });
+        preview->Start();
     }
 
-    auto startT = std::chrono::high_resolution_clock::now();
-    int iter = 0;
+    // Restores the renderers of an interrupted run, each thread then skips
+    // the iterations its renderer has already done
+    const uint64_t configHash = ConfigHash(aConfig);
+    const std::string checkpointName = aConfig.mOutputName + ".ckpt";
+    std::vector<int> resumedIterations(aConfig.mNumThreads, 0);
+    int resumedCount = 0;
 
-    // Rendering loop
-    // Iterations based loop
-    int globalCounter = 0;
-#pragma omp parallel for
-    for (iter = 0; iter < aConfig.mIterations; iter++)
+    if (aConfig.mResume)
     {
-        int threadId = omp_get_thread_num();
-        renderers[threadId]->RunIteration(iter);
+        TraceScope trace("Resume");
 
-        // Print progress bar
-#pragma omp critical
+        // Loading the checkpoint needs all renderers at once
+        TaskSystem::ParallelFor(0, aConfig.mNumThreads, 1, [&](int aBegin, int aEnd)
         {
-            globalCounter++;
-            const double progress = (double)globalCounter / aConfig.mIterations;
-            const int barCount = 20;
+            for (int i = aBegin; i < aEnd; i++)
+                renderers[i] = createRenderer(i);
+        });
 
-            printf(
-                "\rProgress:  %6.2f%% [",
-                100.0 * progress);
-            for (int bar = 1; bar <= barCount; bar++)
+        if (Checkpointer::Load(checkpointName, configHash, renderers, aConfig.mNumThreads))
+        {
+            for (int i = 0; i < aConfig.mNumThreads; i++)
             {
-                const double barProgress = (double)bar / barCount;
-                if (barProgress <= progress)
-                    printf("|");
-                else
-                    printf(".");
+                resumedIterations[i] = renderers[i]->GetIterationCount();
+                resumedCount += resumedIterations[i];
+            }
+
+            printf(" resuming %d iteration(s) from %s ...", resumedCount, checkpointName.c_str());
+        }
+        else
+        {
+            printf(" cannot resume from %s, starting over ...", checkpointName.c_str());
+
+            // A failed load may have overwritten part of the state
+            for (int i = 0; i < aConfig.mNumThreads; i++)
+            {
+                if (!aRenderers)
+                    delete renderers[i];
+                renderers[i] = createRenderer(i);
             }
-            printf("]");
-            fflush(stdout);
         }
+        fflush(stdout);
     }
 
-    auto endT = std::chrono::high_resolution_clock::now();
+    Checkpointer *checkpointer = NULL;
+    if (aConfig.mCheckpointInterval > 0.f)
+    {
+        checkpointer = new Checkpointer(aConfig.mNumThreads, configHash, checkpointName,
+            aConfig.mCheckpointInterval);
+        checkpointer->Start();
+    }
 
-    if (oUsedIterations)
-        *oUsedIterations = iter + 1;
+    // Reported from its own thread, render threads only bump counters
+    ProgressReporter *progress = NULL;
+    if (aConfig.mShowProgress)
+    {
+        progress = new ProgressReporter(aConfig.mNumThreads, aConfig.mIterations, resumedCount,
+            aConfig.mScene->mCamera.mResolution.x * aConfig.mScene->mCamera.mResolution.y,
+            aConfig.mProgressJson);
+        progress->Start();
+    }
+
+    // Runs an iteration on the renderer and lets the observers know, the slots
+    // of the observers are per renderer
+    auto runIteration = [&](int aRenderer, int aIteration)
+    {
+        {
+            TraceScope trace("Iteration", aIteration);
+            renderers[aRenderer]->RunIteration(aIteration);
+        }
+
+        if (preview)
+            preview->Poll(aRenderer, *renderers[aRenderer]);
 
-    // Accumulate from all renderers into a common framebuffer
-    int usedRenderers = 0;
+        if (checkpointer)
+            checkpointer->Poll(aRenderer, *renderers[aRenderer]);
 
-    // With very low number of iterations and high number of threads
-    // not all created renderers had to have been used.
-    // Those must not participate in accumulation.
+        if (progress)
+            progress->IterationDone(aRenderer, renderers[aRenderer]->GetRayCount());
+    };
+
+    // Without a time limit every renderer gets the same contiguous range of
+    // iterations in every run (the split of a static schedule), which is what
+    // makes resumed renders identical. Resumed renderers skip what they have done.
+    std::vector<int> nextIterations(aConfig.mNumThreads), endIterations(aConfig.mNumThreads);
     for (int i = 0; i < aConfig.mNumThreads; i++)
     {
-        if (!renderers[i]->WasUsed())
-            continue;
+        const int share = aConfig.mIterations / aConfig.mNumThreads;
+        const int rest  = aConfig.mIterations % aConfig.mNumThreads;
+        const int first = i * share + std::min(i, rest);
+
+        nextIterations[i] = first + resumedIterations[i];
+        endIterations[i]  = first + share + (i < rest ? 1 : 0);
+    }
+
+    std::atomic<int> nextIteration(resumedCount);
+
+    auto startT = std::chrono::high_resolution_clock::now();
 
-        if (usedRenderers == 0)
+    // Next iteration of the renderer, false when it is done
+    auto takeIteration = [&](int aRenderer, int &oIteration)
+    {
+        if (aConfig.mTimeLimit > 0.f)
         {
-            renderers[i]->GetFramebuffer(*aConfig.mFramebuffer);
+            // Time based, iterations are handed out until the time is up.
+            // Which renderer runs how many depends on timing, so the result
+            // is not reproducible. The first iteration always runs, a limit
+            // shorter than it (or than creating the renderers) would leave
+            // nothing to average.
+            oIteration = nextIteration.fetch_add(1);
+            const float elapsed = std::chrono::duration<float>(
+                std::chrono::high_resolution_clock::now() - startT).count();
+
+            return oIteration < aConfig.mIterations && (oIteration == 0 || elapsed < aConfig.mTimeLimit);
         }
-        else
+
+        oIteration = nextIterations[aRenderer]++;
+        return oIteration < endIterations[aRenderer];
+    };
+
+    // Rendering loop. The iterations of a renderer run one after another,
+    // each as its own task that queues the next one, so idle threads steal
+    // whole renderers and other tasks get in between iterations. The first
+    // tasks are spread over the participants, which creates the renderers
+    // in parallel and on all NUMA nodes.
+    {
+        TaskGroup rendering;
+        std::function<void(int)> runRenderer = [&](int aRenderer)
+        {
+            if (!renderers[aRenderer])
+            {
+                TraceScope trace("Create renderer", aRenderer);
+                renderers[aRenderer] = createRenderer(aRenderer);
+            }
+
+            int iteration;
+            if (!takeIteration(aRenderer, iteration))
+            {
+                if (checkpointer)
+                    checkpointer->Finish(aRenderer, *renderers[aRenderer]);
+                if (preview)
+                    preview->Finish(aRenderer, *renderers[aRenderer]);
+                return;
+            }
+
+            runIteration(aRenderer, iteration);
+            rendering.Run([&runRenderer, aRenderer] { runRenderer(aRenderer); });
+        };
+
+        const int caller = std::max(0, TaskSystem::GetThreadIndex());
+        for (int i = 0; i < aConfig.mNumThreads; i++)
+            rendering.Run([&runRenderer, i] { runRenderer(i); }, caller + i);
+
+        rendering.Wait();
+    }
+
+    auto endT = std::chrono::high_resolution_clock::now();
+
+    if (progress)
+    {
+        progress->Stop();
+        delete progress;
+    }
+
+    if (preview)
+    {
+        preview->Stop();
+        delete preview;
+    }
+
+    if (checkpointer)
+    {
+        checkpointer->Stop();
+        delete checkpointer;
+    }
+
+    if (oUsedIterations)
+    {
+        *oUsedIterations = 0;
+        for (int i = 0; i < aConfig.mNumThreads; i++)
+            *oUsedIterations += renderers[i]->GetIterationCount();
+    }
+
+    if (oPartial)
+    {
+        TraceScope trace("Reduce framebuffers");
+
+        // Unused renderers hold zeros, so they do not change the sum
+        std::vector<const Framebuffer*> sources;
+        oPartial->mIterations = 0;
+
+        for (int i = 0; i < aConfig.mNumThreads; i++)
         {
-            Framebuffer tmp;
-            renderers[i]->GetFramebuffer(tmp);
-            aConfig.mFramebuffer->Add(tmp);
+            sources.push_back(&renderers[i]->GetAccumulatedFramebuffer());
+            oPartial->mIterations += renderers[i]->GetIterationCount();
         }
 
-        usedRenderers++;
+        oPartial->mSum.Reduce(sources, std::vector<float>(sources.size(), 1.f));
     }
+    else
+    {
+        {
+            TraceScope trace("Reduce framebuffers");
+
+            // Average of the renderer averages, summed straight from the renderer
+            // framebuffers into the common one in a single pass
+            std::vector<const Framebuffer*> sources;
+            std::vector<float>              weights;
 
-    // Scale framebuffer by the number of used renderers
-    aConfig.mFramebuffer->Scale(1.f / usedRenderers);
+            // With very low number of iterations and high number of threads
+            // not all created renderers had to have been used.
+            // Those must not participate in accumulation.
+            for (int i = 0; i < aConfig.mNumThreads; i++)
+            {
+                if (!renderers[i]->WasUsed())
+                    continue;
+
+                sources.push_back(&renderers[i]->GetAccumulatedFramebuffer());
+                weights.push_back(1.f / renderers[i]->GetIterationCount());
+            }
+
+            aConfig.mFramebuffer->Reduce(sources, weights, 1.f / float(sources.size()));
+        }
+
+        // Denoise the accumulated image, guided by the feature buffers
+        if (aConfig.mDenoisePasses > 0)
+        {
+            const float denoiseTime = denoise(aConfig, *aConfig.mFramebuffer);
+
+            if (oDenoiseTime)
+                *oDenoiseTime = denoiseTime;
+        }
+    }
 
     // Clean up renderers
-    for (int i = 0; i < aConfig.mNumThreads; i++)
+    for (int i = 0; i < aConfig.mNumThreads && !aRenderers; i++)
         delete renderers[i];
 
     delete[] renderers;
@@ -117,6 +371,18 @@ float render(
     return float(std::chrono::duration_cast<std::chrono::milliseconds>(endT - startT).count()) / 1000.f; // in seconds
 }
 
+// Writes the timeline when --trace was given, once all threads are done
+void saveTrace(const Config &aConfig)
+{
+    if (aConfig.mTraceName.length() == 0)
+        return;
+
+    if (Tracer::Save(aConfig.mTraceName.c_str()))
+        printf("Trace:     %s\n", aConfig.mTraceName.c_str());
+    else
+        printf("Cannot write trace %s\n", aConfig.mTraceName.c_str());
+}
+
 //////////////////////////////////////////////////////////////////////////
 // Main
 
@@ -126,51 +392,334 @@ int main(int argc, const char *argv[])
     PrintRngWarning();
 
     // Setups config based on command line
+    const int64_t loadStartT = Tracer::Now();
     Config config;
     ParseCommandline(argc, argv, config);
 
+    // Scene loading happens while parsing, its event is recorded afterwards
+    if (config.mTraceName.length() > 0)
+    {
+        Tracer::Enable();
+        Tracer::Record("Load scene", loadStartT, Tracer::Now());
+    }
+
     // If number of threads is invalid, set 1 thread per processor
     if (config.mNumThreads <= 0)
-        config.mNumThreads = std::max(1, omp_get_num_procs());
+        config.mNumThreads = std::max(1, int(std::thread::hardware_concurrency()));
+
+    // Worker processes are forked before there are any threads, the task
+    // system would not survive the fork; they start their own
+    const bool forksWorkers = config.mProcessCount > 1 && !config.mServer && config.mConvergenceDir.empty() &&
+        config.mMergeNames.empty() && config.mWorkerIndex < 0;
+
+    if (!forksWorkers)
+        TaskSystem::Start(config.mNumThreads, config.mPinThreads);
+
+    if (config.mServer)
+    {
+        // Jobs render into framebuffers and with renderers kept by the server
+        RenderServer server(config.mNumThreads,
+            [](const Config &aJob, AbstractRenderer **aRenderers, Framebuffer &aoFramebuffer)
+            {
+                Config job = aJob;
+                job.mFramebuffer = &aoFramebuffer;
+
+                render(job, NULL, NULL, NULL, aRenderers);
+                return SaveImage(aoFramebuffer, job.mOutputName, job);
+            });
+
+        auto startT = std::chrono::high_resolution_clock::now();
+
+        int jobCount = 0;
+        const int failed = server.Serve(std::cin, jobCount);
+
+        auto endT = std::chrono::high_resolution_clock::now();
+        const float time = float(std::chrono::duration_cast<std::chrono::milliseconds>(endT - startT).count()) / 1000.f;
+
+        printf("Served:    %d job(s), %d failed, in %.2f s\n", jobCount, failed, time);
+
+        TaskSystem::Stop();
+        return failed > 0 ? 1 : 0;
+    }
+
+    if (config.mConvergenceDir.length() > 0)
+    {
+        // Error versus time of the scenes, the time includes denoising
+        ConvergenceHarness harness(config,
+            [](const Config &aJob, int &oIterations)
+            {
+                float denoiseTime = 0.f;
+                const float time = render(aJob, &oIterations, &denoiseTime);
+                return time + denoiseTime;
+            });
+
+        bool ok = harness.Run(config.mConvergenceScene);
+
+        if (harness.Save(config.mOutputName))
+            printf("Saved:     %s\n", config.mOutputName.c_str());
+        else
+        {
+            printf("Cannot write %s\n", config.mOutputName.c_str());
+            ok = false;
+        }
+
+        if (config.mBaselineName.length() > 0)
+        {
+            const int regressions = harness.Compare(config.mBaselineName, config.mTolerance);
+
+            if (regressions < 0)
+                printf("Cannot read baseline %s\n", config.mBaselineName.c_str());
+            else if (regressions > 0)
+                printf("Efficiency regressed in %d scene(s) by more than %.0f%%\n", regressions, 100.f * config.mTolerance);
+
+            ok = ok && regressions == 0;
+        }
+
+        TaskSystem::Stop();
+        return ok ? 0 : 1;
+    }
 
     // When some error has been encountered, exit
-    if (config.mScene == NULL)
+    if (config.mScene == NULL && config.mMergeNames.empty())
         return 1;
 
     // Sets up framebuffer and number of threads
     Framebuffer fbuffer;
     config.mFramebuffer = &fbuffer;
 
-    // Prints what we are doing
-    printf("Scene:     %s\n", config.mScene->mSceneName.c_str());
-    printf("Target:    %d iteration(s)\n", config.mIterations);
+    // The image is not denoised when it lacks the channels the denoiser needs
+    float denoiseTime = 0.f;
+    bool  denoised    = config.mDenoisePasses > 0;
 
-    // Renders the image
-    printf("Running ...");
-    fflush(stdout);
-    float time = render(config);
-    printf(" done in %.2f s\n", time);
+    if (config.mMergeNames.empty())
+    {
+        // Prints what we are doing
+        printf("Scene:     %s\n", config.mScene->mSceneName.c_str());
+        printf("Memory:    %s\n", config.mScene->mArena.Describe().c_str());
+        if (config.mScene->mAccel != Scene::kAccelList)
+            printf("Accel:     %s\n", config.mScene->DescribeAccel().c_str());
+        printf("Target:    %d iteration(s)\n", config.mIterations);
+
+        // Where the threads run, when there is a choice
+        const NumaTopology &topology = NumaTopology::Get();
+        if (config.mPinThreads != TaskSystem::kPinNone || topology.GetNodeCount() > 1)
+        {
+            const char *pinning[] = { "not pinned", "pinned to CPUs", "pinned to nodes" };
+            printf("Threads:   %d, %s, NUMA %s\n", config.mNumThreads, pinning[config.mPinThreads],
+                topology.Describe().c_str());
+        }
+    }
 
-    // Saves the image
-    printf("Saving to: %s ... ", config.mOutputName.c_str());
-    std::string extension = config.mOutputName.substr(config.mOutputName.length() - 3, 3);
-    if (extension == "bmp")
+    if (config.mWorkerIndex >= 0)
     {
-        fbuffer.SaveBMP(config.mOutputName.c_str(), 2.2f /*gamma*/);
-        printf("done\n");
+        // One share of a distributed render, merged later with --merge
+        const Config worker = workerConfig(config, config.mWorkerIndex, config.mWorkerCount);
+
+        printf("Worker:    %d of %d, %d iteration(s)\n", config.mWorkerIndex, config.mWorkerCount, worker.mIterations);
+        printf("Running ...");
+        fflush(stdout);
+
+        PartialAccumulation partial;
+        float time = render(worker, NULL, NULL, &partial);
+        printf(" done in %.2f s\n", time);
+
+        printf("Saving to: %s ... ", config.mOutputName.c_str());
+        printf(partial.Save(config.mOutputName.c_str()) ? "done\n" : "failed\n");
+
+        saveTrace(config);
+        TaskSystem::Stop();
+        delete config.mScene;
+        return 0;
     }
-    else if (extension == "hdr")
+
+    float time = 0.f;
+    PartialAccumulation workerSum;
+
+    if (forksWorkers)
     {
-        fbuffer.SaveHDR(config.mOutputName.c_str());
-        printf("done\n");
+        printf("Running ...");
+        fflush(stdout);
+
+        TraceScope trace("Worker processes");
+
+        // Every worker process gets its share of the cores and iterations,
+        // pinned threads of the processes go to different CPUs
+        const int processCount = config.mProcessCount;
+        const int threadCount  = std::max(1, config.mNumThreads / processCount);
+
+        auto startT = std::chrono::high_resolution_clock::now();
+
+        const bool ok = RunLocalWorkers(processCount,
+            [&config, processCount, threadCount](int aIndex, PartialAccumulation &oPartial)
+            {
+                TaskSystem::Start(threadCount, config.mPinThreads, aIndex * threadCount);
+
+                // The processes share the output name, so they must not write files
+                Config worker = workerConfig(config, aIndex, processCount);
+                worker.mNumThreads         = threadCount;
+                worker.mPreviewInterval    = 0.f;
+                worker.mCheckpointInterval = 0.f;
+                worker.mResume             = false;
+
+                render(worker, NULL, NULL, &oPartial);
+                TaskSystem::Stop();
+            },
+            workerSum);
+
+        auto endT = std::chrono::high_resolution_clock::now();
+        time = float(std::chrono::duration_cast<std::chrono::milliseconds>(endT - startT).count()) / 1000.f;
+
+        if (!ok)
+        {
+            printf(" worker processes failed\n");
+            delete config.mScene;
+            return 1;
+        }
+
+        TaskSystem::Start(config.mNumThreads, config.mPinThreads);
     }
-    else if (extension == "pfm")
+
+    // The reference is loaded while rendering, the comparison and saving of
+    // the image then run side by side. Results are printed once all is done,
+    // in the order of the steps.
+    TaskGraph graph;
+    bool renderOk = true;
+
+    Framebuffer reference;
+    bool referenceOk = false;
+    float rmse = 0.f;
+    bool saved = false;
+
+    const int loadNode = graph.Add([&]
     {
-        fbuffer.SavePFM(config.mOutputName.c_str());
-        printf("done\n");
+        if (config.mReferenceName.length() == 0)
+            return;
+
+        TraceScope trace("Load reference");
+        referenceOk = reference.LoadPFM(config.mReferenceName.c_str());
+    });
+
+    const int renderNode = graph.Add([&]
+    {
+        if (config.mMergeNames.size() > 0)
+        {
+            // Merges partial accumulations of a distributed render
+            PartialAccumulation merged;
+
+            for (size_t i = 0; i < config.mMergeNames.size(); i++)
+            {
+                PartialAccumulation partial;
+                if (!partial.Load(config.mMergeNames[i].c_str()) || !merged.Add(partial))
+                {
+                    printf("Cannot merge %s\n", config.mMergeNames[i].c_str());
+                    renderOk = false;
+                    return;
+                }
+            }
+
+            printf("Merged:    %d partial(s), %d iteration(s)\n", int(config.mMergeNames.size()), merged.mIterations);
+            merged.Resolve(fbuffer);
+
+            // Partials only have the feature channels when their workers ran with --denoise
+            if (denoised && !Denoiser::CanDenoise(fbuffer))
+            {
+                printf("Not denoised: the partials lack the feature channels, render them with --denoise\n");
+                denoised = false;
+            }
+
+            if (denoised)
+                denoiseTime = denoise(config, fbuffer);
+        }
+        else
+        {
+            if (forksWorkers)
+            {
+                workerSum.Resolve(fbuffer);
+
+                if (denoised && !Denoiser::CanDenoise(fbuffer))
+                {
+                    printf("Not denoised: the workers did not write the feature channels\n");
+                    denoised = false;
+                }
+
+                if (denoised)
+                    denoiseTime = denoise(config, fbuffer);
+            }
+            else
+            {
+                // Renders the image
+                printf("Running ...");
+                fflush(stdout);
+
+                RayStatistics::Reset();
+                time = render(config, NULL, &denoiseTime);
+            }
+
+            printf(" done in %.2f s\n", time);
+
+            // Counters only exist in builds with PG3_STATS, and only for threads of this process
+            if (RayStatistics::Enabled() && !forksWorkers)
+            {
+                RayStatistics::PrintReport(time);
+
+                if (config.mStatsName.length() > 0 && !RayStatistics::SaveJson(config.mStatsName.c_str(), time))
+                    printf("Cannot write %s\n", config.mStatsName.c_str());
+            }
+            else if (config.mStatsName.length() > 0)
+                printf("No ray statistics, they need a build with -DPG3_STATS and a single process\n");
+        }
+
+        if (denoised)
+            printf("Denoised:  %d pass(es) in %.3f s\n", config.mDenoisePasses, denoiseTime);
+    });
+
+    // Compares against the reference image
+    graph.Add([&]
+    {
+        if (!renderOk || !referenceOk)
+            return;
+
+        TraceScope trace("Compare to reference");
+        rmse = fbuffer.RMSE(reference);
+    }, { loadNode, renderNode });
+
+    // Saves the image
+    graph.Add([&]
+    {
+        if (!renderOk)
+            return;
+
+        TraceScope trace("Save image");
+        saved = SaveImage(fbuffer, config.mOutputName, config);
+    }, { renderNode });
+
+    graph.Run();
+
+    if (!renderOk)
+    {
+        TaskSystem::Stop();
+        return 1;
     }
+
+    if (config.mReferenceName.length() > 0)
+    {
+        if (referenceOk)
+            printf("RMSE:      %g (vs. %s)\n", rmse, config.mReferenceName.c_str());
+        else
+            printf("Cannot load reference %s\n", config.mReferenceName.c_str());
+    }
+
+    printf("Saving to: %s ... ", config.mOutputName.c_str());
+    if (saved)
+        printf("done\n");
+    else if (!IsImageFormat(config.mOutputName))
+        printf("Used unknown extension %s\n",
+            config.mOutputName.substr(config.mOutputName.length() - 3, 3).c_str());
     else
-        printf("Used unknown extension %s\n", extension.c_str());
+        printf("Cannot write the file\n");
+
+    saveTrace(config);
+    TaskSystem::Stop();
 
     // Scene cleanup
     delete config.mScene;
@@ -178,5 +727,5 @@ int main(int argc, const char *argv[])
     // debug
     // getchar(); // Wait for pressing the enter key on the command line
 
-    return 0;
+    return saved ? 0 : 1;
 }
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <vector>
+#include <fstream>
+#include <cstdlib>
+#include <algorithm>
+#include <stdint.h>
+#include "tasks.hpp"
+#include "deflate.hpp"
+
+//////////////////////////////////////////////////////////////////////////
+// Minimal PNG writer for 8-bit RGB images
+//
+// Each row gets the adaptive filter with the smallest sum of absolute
+// differences. The filtered image is cut into bands that are deflated in
+// parallel and stitched into a single zlib stream, so the file still has
+// one IDAT chunk and goes out in a single write.
+class PngWriter
+{
+public:
+
+    /**
+     * Writes the image
+     * Arguments:
+     *  - aPixels = interleaved RGB, aResX * aResY * 3 bytes, first row is the top
+     */
+    static bool Write(
+        const char    *aFilename,
+        const uint8_t *aPixels,
+        int           aResX,
+        int           aResY)
+    {
+        const size_t rowBytes = size_t(aResX) * 3;
+        const size_t lineSize = rowBytes + 1;
+
+        // Filtered scanlines, each prefixed by its filter type
+        std::vector<uint8_t> filtered(lineSize * aResY);
+
+        TaskSystem::ParallelFor(0, aResY, 16, [&](int aFirst, int aLast)
+        {
+            for(int y=aFirst; y<aLast; y++)
+            {
+                const uint8_t *row   = aPixels + y * rowBytes;
+                const uint8_t *above = (y > 0) ? row - rowBytes : NULL;
+                FilterRow(row, above, rowBytes, &filtered[y * lineSize]);
+            }
+        });
+
+        // Bands are large enough that the lost matches across band borders do not matter
+        const int linesPerBand = std::max(1, int((256 * 1024) / lineSize));
+        const int bandCount    = (aResY + linesPerBand - 1) / linesPerBand;
+
+        std::vector<std::vector<uint8_t> > bands(bandCount);
+        std::vector<uint32_t>              adlers(bandCount);
+
+        TaskSystem::ParallelFor(0, bandCount, 1, [&](int aFirst, int aLast)
+        {
+            for(int band=aFirst; band<aLast; band++)
+            {
+                const size_t start = size_t(band) * linesPerBand * lineSize;
+                const size_t size  = std::min(filtered.size() - start, linesPerBand * lineSize);
+
+                DeflateCompressor::CompressRaw(&filtered[start], size, bands[band], band == bandCount - 1);
+                adlers[band] = DeflateCompressor::Adler32(&filtered[start], size);
+            }
+        });
+
+        std::vector<uint8_t> idat;
+        idat.push_back(0x78);
+        idat.push_back(0x01);
+
+        uint32_t adler = 1;
+        for(int band=0; band<bandCount; band++)
+        {
+            const size_t start = size_t(band) * linesPerBand * lineSize;
+            const size_t size  = std::min(filtered.size() - start, linesPerBand * lineSize);
+
+            idat.insert(idat.end(), bands[band].begin(), bands[band].end());
+            adler = DeflateCompressor::Adler32Combine(adler, adlers[band], size);
+        }
+        PutUint(idat, adler);
+
+        std::vector<uint8_t> file;
+        static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        file.insert(file.end(), signature, signature + 8);
+
+        std::vector<uint8_t> ihdr;
+        PutUint(ihdr, uint32_t(aResX));
+        PutUint(ihdr, uint32_t(aResY));
+        ihdr.push_back(8); // bit depth
+        ihdr.push_back(2); // truecolor
+        ihdr.push_back(0); // deflate
+        ihdr.push_back(0); // adaptive filtering
+        ihdr.push_back(0); // no interlace
+
+        PutChunk(file, "IHDR", ihdr);
+        PutChunk(file, "IDAT", idat);
+        PutChunk(file, "IEND", std::vector<uint8_t>());
+
+        std::ofstream png(aFilename, std::ios::binary);
+        png.write(reinterpret_cast<const char*>(file.data()), file.size());
+        png.close();
+        return bool(png);
+    }
+
+private:
+
+    static uint8_t Paeth(int a, int b, int c)
+    {
+        const int p  = a + b - c;
+        const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+
+        if(pa <= pb && pa <= pc) return uint8_t(a);
+        if(pb <= pc)             return uint8_t(b);
+        return uint8_t(c);
+    }
+
+    // Tries filters None, Sub, Up and Paeth and keeps the one with the smallest residuals
+    static void FilterRow(
+        const uint8_t *aRow,
+        const uint8_t *aAbove,
+        size_t        aRowBytes,
+        uint8_t       *oLine)
+    {
+        std::vector<uint8_t> candidate(aRowBytes);
+        uint64_t bestCost = ~uint64_t(0);
+
+        static const int filters[4] = { 0, 1, 2, 4 };
+
+        for(int f=0; f<4; f++)
+        {
+            const int filter = filters[f];
+            uint64_t  cost   = 0;
+
+            for(size_t i=0; i<aRowBytes; i++)
+            {
+                const int left  = (i >= 3) ? aRow[i - 3] : 0;
+                const int up    = aAbove ? aAbove[i] : 0;
+                const int diag  = (aAbove && i >= 3) ? aAbove[i - 3] : 0;
+
+                int predicted = 0;
+                if(filter == 1)      predicted = left;
+                else if(filter == 2) predicted = up;
+                else if(filter == 4) predicted = Paeth(left, up, diag);
+
+                const uint8_t residual = uint8_t(aRow[i] - predicted);
+                candidate[i] = residual;
+
+                // Residuals are scored as signed bytes
+                cost += (residual < 128) ? residual : 256 - residual;
+            }
+
+            if(cost < bestCost)
+            {
+                bestCost = cost;
+                oLine[0] = uint8_t(filter);
+                std::copy(candidate.begin(), candidate.end(), oLine + 1);
+            }
+        }
+    }
+
+    static uint32_t Crc32(
+        const uint8_t *aData,
+        size_t        aSize,
+        uint32_t      aCrc = 0)
+    {
+        static const std::vector<uint32_t> table = []()
+        {
+            std::vector<uint32_t> t(256);
+            for(uint32_t n=0; n<256; n++)
+            {
+                uint32_t c = n;
+                for(int k=0; k<8; k++)
+                    c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                t[n] = c;
+            }
+            return t;
+        }();
+
+        uint32_t crc = ~aCrc;
+        for(size_t i=0; i<aSize; i++)
+            crc = table[(crc ^ aData[i]) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    // PNG stores integers big-endian
+    static void PutUint(std::vector<uint8_t> &aoBuffer, uint32_t aValue)
+    {
+        for(int i=3; i>=0; i--)
+            aoBuffer.push_back(uint8_t(aValue >> (8 * i)));
+    }
+
+    static void PutChunk(
+        std::vector<uint8_t>       &aoFile,
+        const char                 *aType,
+        const std::vector<uint8_t> &aData)
+    {
+        PutUint(aoFile, uint32_t(aData.size()));
+
+        const size_t typeStart = aoFile.size();
+        aoFile.insert(aoFile.end(), aType, aType + 4);
+        aoFile.insert(aoFile.end(), aData.begin(), aData.end());
+
+        // CRC covers the type and the data
+        PutUint(aoFile, Crc32(&aoFile[typeStart], aoFile.size() - typeStart));
+    }
+};
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include "math.hpp"
+#include "framebuffer.hpp"
+#include "renderer.hpp"
+
+//////////////////////////////////////////////////////////////////////////
+// Periodic preview of a running render
+//
+// Render threads never wait for the preview. A background thread raises a
+// request every interval; each render thread notices it at its next
+// iteration boundary (one atomic load per iteration), copies its
+// accumulated color into its own slot and publishes the request number.
+// When all slots have answered, the background thread merges and encodes
+// the snapshot while rendering goes on. A slot is only written after a new
+// request, and a new request is only raised once the previous snapshot has
+// been merged, so the slots need no locks. A thread that runs out of
+// iterations leaves its final color in the slot (Finish), which answers all
+// later requests.
+class PreviewWriter
+{
+public:
+
+    typedef std::function<void(Framebuffer&)> SaveFunction;
+
+    /**
+     * Arguments:
+     *  - aSlotCount = number of render threads
+     *  - aInterval = seconds between two previews
+     *  - aSave = encodes the merged preview, runs on the background thread
+     */
+    PreviewWriter(
+        int          aSlotCount,
+        const Vec2f  &aResolution,
+        float        aInterval,
+        SaveFunction aSave) :
+        mSlots(aSlotCount),
+        mInterval(aInterval),
+        mSave(aSave),
+        mRequest(0),
+        mStop(false),
+        mPreviewCount(0)
+    {
+        mPreview.Setup(aResolution);
+
+        // Slots copy the tiled planes as they are, padding included
+        const size_t pixelCount = size_t(mPreview.GetPlaneSize());
+
+        for(size_t i=0; i<mSlots.size(); i++)
+        {
+            mSlots[i].mColor.resize(3 * pixelCount);
+            mSlots[i].mIterations = 0;
+            mSlots[i].mFinalIterations = 0;
+            mSlots[i].mPublished.store(0);
+        }
+    }
+
+    ~PreviewWriter()
+    {
+        Stop();
+    }
+
+    void Start()
+    {
+        mThread = std::thread(&PreviewWriter::Run, this);
+    }
+
+    // Stops the background thread, a preview in progress is still finished
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mWakeUp.notify_all();
+
+        if(mThread.joinable())
+            mThread.join();
+    }
+
+    // Called by render thread aSlot after each iteration
+    void Poll(
+        int                    aSlot,
+        const AbstractRenderer &aRenderer)
+    {
+        Slot &slot = mSlots[aSlot];
+        const int request = mRequest.load(std::memory_order_acquire);
+
+        if(request == slot.mPublished.load(std::memory_order_relaxed))
+            return;
+
+        const Framebuffer &accumulated = aRenderer.GetAccumulatedFramebuffer();
+        const float       *color       = accumulated.GetPlane(kChannelColor);
+
+        std::copy(color, color + slot.mColor.size(), slot.mColor.begin());
+        slot.mIterations = aRenderer.GetIterationCount();
+
+        slot.mPublished.store(request, std::memory_order_release);
+    }
+
+    // Called by render thread aSlot when it has no more iterations to run;
+    // later previews use this final state of the slot
+    void Finish(
+        int                    aSlot,
+        const AbstractRenderer &aRenderer)
+    {
+        // A separate buffer, the background thread may be merging mColor right now
+        Slot &slot = mSlots[aSlot];
+        const float *color = aRenderer.GetAccumulatedFramebuffer().GetPlane(kChannelColor);
+
+        slot.mFinalColor.assign(color, color + slot.mColor.size());
+        slot.mFinalIterations = aRenderer.GetIterationCount();
+        slot.mPublished.store(kFinished, std::memory_order_release);
+    }
+
+    int GetPreviewCount() const { return mPreviewCount; }
+
+private:
+
+    static const int kFinished = -1;
+
+    void Run()
+    {
+        // This thread is outside the task system, so the encoders run serially
+        // and do not compete with the render threads
+        const auto interval = std::chrono::duration<float>(mInterval);
+        const auto poll     = std::chrono::milliseconds(1);
+
+        std::unique_lock<std::mutex> lock(mMutex);
+
+        for(int request=1; ; request++)
+        {
+            if(mWakeUp.wait_for(lock, interval, [this]{ return mStop; }))
+                return;
+
+            mRequest.store(request, std::memory_order_release);
+
+            // Slots fill in at the next iteration boundary of each thread
+            while(!AllPublished(request))
+            {
+                if(mWakeUp.wait_for(lock, poll, [this]{ return mStop; }))
+                    return;
+            }
+
+            lock.unlock();
+            Merge();
+            mSave(mPreview);
+            mPreviewCount++;
+            lock.lock();
+        }
+    }
+
+    bool AllPublished(int aRequest) const
+    {
+        for(size_t i=0; i<mSlots.size(); i++)
+        {
+            const int published = mSlots[i].mPublished.load(std::memory_order_acquire);
+            if(published != aRequest && published != kFinished)
+                return false;
+        }
+
+        return true;
+    }
+
+    // Average over all iterations of all threads
+    void Merge()
+    {
+        std::vector<const float*> colors(mSlots.size());
+
+        int iterations = 0;
+        for(size_t i=0; i<mSlots.size(); i++)
+        {
+            const bool finished = mSlots[i].mPublished.load(std::memory_order_acquire) == kFinished;
+
+            colors[i]   = finished ? mSlots[i].mFinalColor.data() : mSlots[i].mColor.data();
+            iterations += finished ? mSlots[i].mFinalIterations : mSlots[i].mIterations;
+        }
+
+        const float  scale      = iterations > 0 ? 1.f / iterations : 0.f;
+        const size_t pixelCount = mSlots[0].mColor.size() / 3;
+
+        for(int c=0; c<3; c++)
+        {
+            float *dst = mPreview.GetPlane(kChannelColor, c);
+
+            for(size_t p=0; p<pixelCount; p++)
+            {
+                float sum = 0.f;
+                for(size_t i=0; i<mSlots.size(); i++)
+                    sum += colors[i][c * pixelCount + p];
+
+                dst[p] = sum * scale;
+            }
+        }
+    }
+
+private:
+
+    // Written by one render thread, padded so that slots do not share cache lines
+    struct alignas(64) Slot
+    {
+        std::vector<float> mColor;      //!< Planar accumulated color, not averaged
+        int                mIterations;
+        std::vector<float> mFinalColor; //!< As mColor, once the thread has finished
+        int                mFinalIterations;
+        std::atomic<int>   mPublished;  //!< Request the slot content answers, or kFinished
+    };
+
+    std::vector<Slot>       mSlots;
+    float                   mInterval;
+    SaveFunction            mSave;
+    Framebuffer             mPreview;
+
+    std::atomic<int>        mRequest;
+    bool                    mStop;       //!< Guarded by mMutex
+    int                     mPreviewCount;
+
+    std::thread             mThread;
+    std::mutex              mMutex;
+    std::condition_variable mWakeUp;
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstdio>
+#include <stdint.h>
+#include <condition_variable>
+
+//////////////////////////////////////////////////////////////////////////
+// Progress reporting off the render threads
+//
+// Render threads only bump an atomic iteration counter and store their
+// own ray count after each iteration. A reporter thread wakes up a few
+// times per second and prints the progress bar with ETA, samples/s and
+// rays/s, or one JSON object per line on stderr for scripts.
+class ProgressReporter
+{
+public:
+
+    /**
+     * Arguments:
+     *  - aSlotCount = number of render threads
+     *  - aTotalIterations, aDoneIterations = target, and what is done already (resumed renders)
+     *  - aPixelCount = samples per iteration
+     *  - aJson = JSON lines on stderr instead of the progress bar
+     */
+    ProgressReporter(
+        int  aSlotCount,
+        int  aTotalIterations,
+        int  aDoneIterations,
+        int  aPixelCount,
+        bool aJson) :
+        mSlots(aSlotCount),
+        mTotalIterations(aTotalIterations),
+        mStartIterations(aDoneIterations),
+        mPixelCount(aPixelCount),
+        mJson(aJson),
+        mDoneIterations(aDoneIterations),
+        mStop(false)
+    {
+        for(size_t i=0; i<mSlots.size(); i++)
+            mSlots[i].mRays.store(0);
+    }
+
+    ~ProgressReporter()
+    {
+        Stop();
+    }
+
+    void Start()
+    {
+        mStartT = std::chrono::high_resolution_clock::now();
+        mThread = std::thread(&ProgressReporter::Run, this);
+    }
+
+    // Stops the reporter thread and prints the final state
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if(mStop)
+                return;
+            mStop = true;
+        }
+        mWakeUp.notify_all();
+
+        if(mThread.joinable())
+            mThread.join();
+
+        Report();
+    }
+
+    // Called by render thread aSlot after each iteration, with the rays it has cast so far
+    void IterationDone(
+        int      aSlot,
+        uint64_t aRayCount)
+    {
+        mSlots[aSlot].mRays.store(aRayCount, std::memory_order_relaxed);
+        mDoneIterations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+
+    void Run()
+    {
+        const auto interval = std::chrono::milliseconds(mJson ? 1000 : 250);
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        while(!mWakeUp.wait_for(lock, interval, [this]{ return mStop; }))
+            Report();
+    }
+
+    void Report()
+    {
+        const int done = mDoneIterations.load(std::memory_order_relaxed);
+
+        uint64_t rays = 0;
+        for(size_t i=0; i<mSlots.size(); i++)
+            rays += mSlots[i].mRays.load(std::memory_order_relaxed);
+
+        const double elapsed = std::chrono::duration<double>(
+            std::chrono::high_resolution_clock::now() - mStartT).count();
+
+        // Rates only count the iterations of this run
+        const int    doneNow  = done - mStartIterations;
+        const double samples  = double(doneNow) * mPixelCount;
+        const double progress = mTotalIterations > 0 ? double(done) / mTotalIterations : 1.0;
+        const double eta      = doneNow > 0 ? elapsed / doneNow * (mTotalIterations - done) : -1.0;
+        const double samplesPerSec = elapsed > 0.0 ? samples / elapsed : 0.0;
+        const double raysPerSec    = elapsed > 0.0 ? double(rays) / elapsed : 0.0;
+
+        if(mJson)
+        {
+            fprintf(stderr,
+                "{\"iterations\": %d, \"total\": %d, \"progress\": %.4f, \"elapsed\": %.3f, "
+                "\"eta\": %.3f, \"samples_per_sec\": %.0f, \"rays_per_sec\": %.0f}\n",
+                done, mTotalIterations, progress, elapsed, eta, samplesPerSec, raysPerSec);
+            fflush(stderr);
+            return;
+        }
+
+        const int barCount = 20;
+        char bar[barCount + 1];
+        for(int i=0; i<barCount; i++)
+            bar[i] = (double(i + 1) / barCount <= progress) ? '|' : '.';
+        bar[barCount] = 0;
+
+        printf("\rProgress:  %6.2f%% [%s]", 100.0 * progress, bar);
+        if(eta >= 0.0)
+            printf(" ETA %5.0f s, %6.2f Msamples/s, %6.2f Mrays/s",
+                eta, samplesPerSec * 1e-6, raysPerSec * 1e-6);
+        fflush(stdout);
+    }
+
+private:
+
+    // Written by one render thread, padded so that slots do not share cache lines
+    struct alignas(64) Slot
+    {
+        std::atomic<uint64_t> mRays;
+    };
+
+    std::vector<Slot>       mSlots;
+    int                     mTotalIterations;
+    int                     mStartIterations;
+    int                     mPixelCount;
+    bool                    mJson;
+
+    alignas(64) std::atomic<int> mDoneIterations;
+
+    std::chrono::high_resolution_clock::time_point mStartT;
+
+    bool                    mStop;  //!< Guarded by mMutex
+    std::thread             mThread;
+    std::mutex              mMutex;
+    std::condition_variable mWakeUp;
+};
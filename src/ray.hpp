@@ -25,6 +25,56 @@ struct Ray
     float offset; //!< Minimal distance to intersection
 };
 
+// Derivatives of the (normalized) ray direction per raster pixel, for
+// texture filtering and geometric level of detail. The origin of camera
+// rays does not change across pixels, so it has no derivatives.
+struct RayDifferential
+{
+    Vec3f directionDx; //!< d direction / d raster x
+    Vec3f directionDy; //!< d direction / d raster y
+};
+
+// Structure of arrays of rays with their differentials, written and read
+// by vectorized loops (e.g. a row or tile of camera rays for packet or
+// wavefront tracing)
+struct RayBuffer
+{
+    void Resize(int aSize)
+    {
+        std::vector<float> *arrays[] = {
+            &mOriginX, &mOriginY, &mOriginZ, &mDirectionX, &mDirectionY, &mDirectionZ, &mOffset,
+            &mDirectionDxX, &mDirectionDxY, &mDirectionDxZ, &mDirectionDyX, &mDirectionDyY, &mDirectionDyZ };
+
+        for(size_t i=0; i<sizeof(arrays) / sizeof(arrays[0]); i++)
+            arrays[i]->resize(aSize);
+    }
+
+    int Size() const
+    {
+        return (int)mOriginX.size();
+    }
+
+    Ray GetRay(int aIndex) const
+    {
+        return Ray(Vec3f(mOriginX[aIndex], mOriginY[aIndex], mOriginZ[aIndex]),
+            Vec3f(mDirectionX[aIndex], mDirectionY[aIndex], mDirectionZ[aIndex]), mOffset[aIndex]);
+    }
+
+    RayDifferential GetDifferential(int aIndex) const
+    {
+        RayDifferential res;
+        res.directionDx = Vec3f(mDirectionDxX[aIndex], mDirectionDxY[aIndex], mDirectionDxZ[aIndex]);
+        res.directionDy = Vec3f(mDirectionDyX[aIndex], mDirectionDyY[aIndex], mDirectionDyZ[aIndex]);
+        return res;
+    }
+
+    std::vector<float> mOriginX,     mOriginY,     mOriginZ;
+    std::vector<float> mDirectionX,  mDirectionY,  mDirectionZ;
+    std::vector<float> mOffset;
+    std::vector<float> mDirectionDxX, mDirectionDxY, mDirectionDxZ;
+    std::vector<float> mDirectionDyX, mDirectionDyY, mDirectionDyZ;
+};
+
 struct Intersection
 {
     Intersection()
@@ -33,8 +83,14 @@ struct Intersection
     Intersection(float aMaxDist):distance(aMaxDist)
     {}
 
-    float distance;    //!< Distance to closest intersection (serves as ray.tmax)
+    // Found by the traversal
+    float distance;     //!< Distance to closest intersection (serves as ray.tmax)
+    int   primitiveID;  //!< Index of the intersected primitive in its geometry
+    Vec2f barycentrics; //!< Weights of the 2nd and 3rd triangle vertex at the hit (0 for spheres)
+
+    // Filled for the final hit only, by AbstractGeometry::ComputeSurfaceInteraction
     int   materialID;   //!< ID of intersected material
     int   lightID; //!< ID of intersected light (if < 0, then none)
     Vec3f normal;  //!< Normal vector at the intersection
+    Vec2f uv;      //!< Surface coordinates: triangle barycentrics, or sphere longitude and latitude in [0, 1]
 };
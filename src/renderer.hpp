@@ -2,6 +2,8 @@
 
 #include <vector>
 #include <cmath>
+#include <iostream>
+#include <stdint.h>
 #include "scene.hpp"
 #include "framebuffer.hpp"
 
@@ -14,6 +16,7 @@ public:
         mMinPathLength = 0;
         mMaxPathLength = 2;
         mIterations = 0;
+        mRayCount = 0;
         mFramebuffer.Setup(aScene.mCamera.mResolution);
     }
 
@@ -23,15 +26,50 @@ public:
 
     void GetFramebuffer(Framebuffer& oFramebuffer)
     {
-        oFramebuffer = mFramebuffer;
+        oFramebuffer.Reduce(std::vector<const Framebuffer*>(1, &mFramebuffer),
+            std::vector<float>(1, mIterations > 0 ? 1.f / mIterations : 1.f));
+    }
+
+    //! Selects the framebuffer channels (AOVs) the renderer writes, see FramebufferChannel
+    void SetupChannels(uint aChannelMask)
+    {
+        mFramebuffer.Setup(mScene.mCamera.mResolution, aChannelMask);
+    }
 
-        if(mIterations > 0)
-            oFramebuffer.Scale(1.f / mIterations);
+    //! Starts over with an empty framebuffer, derived renderers also reseed
+    virtual void Reset(int aSeed)
+    {
+        (void)aSeed;
+        mIterations = 0;
+        mRayCount = 0;
+        mFramebuffer.Clear();
     }
 
     //! Whether this renderer was used at all
     bool WasUsed() const { return mIterations > 0; }
 
+    //! Accumulated framebuffer, not yet divided by the number of iterations
+    const Framebuffer& GetAccumulatedFramebuffer() const { return mFramebuffer; }
+
+    int GetIterationCount() const { return mIterations; }
+
+    //! Rays cast so far, for throughput reports
+    uint64_t GetRayCount() const { return mRayCount; }
+
+    //! Serializes everything needed to continue the render bit-identically,
+    //! derived renderers add their own state (e.g. random generators)
+    virtual void SaveState(std::ostream &aoStream) const
+    {
+        aoStream.write(reinterpret_cast<const char*>(&mIterations), sizeof(mIterations));
+        mFramebuffer.SaveState(aoStream);
+    }
+
+    virtual bool LoadState(std::istream &aoStream)
+    {
+        aoStream.read(reinterpret_cast<char*>(&mIterations), sizeof(mIterations));
+        return bool(aoStream) && mFramebuffer.LoadState(aoStream);
+    }
+
 public:
 
     uint         mMaxPathLength;
@@ -40,6 +78,7 @@ public:
 protected:
 
     int          mIterations;
+    uint64_t     mRayCount;
     Framebuffer  mFramebuffer;
     const Scene& mScene;
 };
@@ -2,6 +2,9 @@
 
 #include <vector>
 #include <cmath>
+#include <string>
+#include <sstream>
+#include <iostream>
 
 #if defined(_MSC_VER)
 #if (_MSC_VER < 1600)
@@ -51,6 +54,34 @@ public:
         return Vec3f(a, b, c);
     }
 
+    //////////////////////////////////////////////////////////////////////////
+    // Exact generator state, for checkpoints. The distributions keep no state.
+    void SaveState(std::ostream &aoStream) const
+    {
+        std::ostringstream state;
+        state << mRng;
+
+        const std::string text = state.str();
+        const uint size = uint(text.size());
+        aoStream.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        aoStream.write(text.data(), size);
+    }
+
+    bool LoadState(std::istream &aoStream)
+    {
+        uint size = 0;
+        aoStream.read(reinterpret_cast<char*>(&size), sizeof(size));
+        if(!aoStream)
+            return false;
+
+        std::string text(size, ' ');
+        aoStream.read(&text[0], size);
+
+        std::istringstream state(text);
+        state >> mRng;
+        return bool(aoStream) && !state.fail();
+    }
+
 private:
     std::mt19937_64 mRng;
     std::uniform_int_distribution<int> mDistInt;
@@ -87,6 +118,19 @@ public:
         return mState0;
     }
 
+    void SaveState(std::ostream &aoStream) const
+    {
+        aoStream.write(reinterpret_cast<const char*>(&mState0), sizeof(mState0));
+        aoStream.write(reinterpret_cast<const char*>(&mState1), sizeof(mState1));
+    }
+
+    bool LoadState(std::istream &aoStream)
+    {
+        aoStream.read(reinterpret_cast<char*>(&mState0), sizeof(mState0));
+        aoStream.read(reinterpret_cast<char*>(&mState1), sizeof(mState1));
+        return bool(aoStream);
+    }
+
 private:
     uint mState0, mState1;
 };
@@ -129,6 +173,17 @@ public:
     }
 
     //////////////////////////////////////////////////////////////////////////
+    // Exact generator state, for checkpoints
+    void SaveState(std::ostream &aoStream) const
+    {
+        mImpl.SaveState(aoStream);
+    }
+
+    bool LoadState(std::istream &aoStream)
+    {
+        return mImpl.LoadState(aoStream);
+    }
+
     void StoreState(
         uint *oState1,
         uint *oState2)
@@ -1,31 +1,36 @@
 #pragma once
 
 #include <vector>
-#include <map>
 #include <cmath>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <sstream>
+#include <algorithm>
 #include "math.hpp"
 #include "geometry.hpp"
 #include "camera.hpp"
 #include "materials.hpp"
 #include "lights.hpp"
+#include "numa.hpp"
+#include "arena.hpp"
+#include "bvh.hpp"
 
 class Scene
 {
 public:
-    Scene() :
+    // Geometry, lights and materials are allocated in mArena, optionally on
+    // huge pages, and all freed at once with the scene
+    explicit Scene(bool aHugePages = false) :
+        mArena(aHugePages),
         mGeometry(NULL),
-        mBackground(NULL)
+        mAccel(kAccelList),
+        mMaterials(ArenaAllocator<Material>(&mArena, kArenaMaterials)),
+        mLights(ArenaAllocator<AbstractLight*>(&mArena, kArenaLights)),
+        mBackground(NULL),
+        mNodeReplicas(NumaTopology::Get().GetNodeCount() > 1 ? NumaTopology::Get().GetNodeCount() : 0)
     {}
 
-    ~Scene()
-    {
-        delete mGeometry;
-
-        for(size_t i=0; i<mLights.size(); i++)
-            delete mLights[i];
-    }
-
     /**
      * Tries to find an intersection of the given ray with objects in the scene. If more than one exist, it returns the one closest to the ray origin
      * Arguments:
@@ -41,17 +46,11 @@ public:
         Intersection isect;
         isect.distance = maximumDistance - 2*EPSILON_RAY;
 
-        bool hit = mGeometry->Intersect(ray, isect);
-
-        if (hit)
+        // Emitting primitives carry their light ID, there is nothing to look up.
+        // The traversal only finds the hit, its attributes are computed once here
+        if (mGeometry->Intersect(ray, isect))
         {
-            isect.lightID = -1;
-            std::map<int, int>::const_iterator it =
-                mMaterial2Light.find(isect.materialID);
-
-            if (it != mMaterial2Light.end())
-                isect.lightID = it->second;
-
+            mGeometry->ComputeSurfaceInteraction(ray, isect);
             return isect;
         }
 
@@ -64,7 +63,8 @@ public:
      *  - a ray along which we look for the intersection
      *  - a maximum distance along the ray that we want to traverse (by default infinity, or a very big number)
      * Returns:
-     *  - an optional intersection object, either empty (if no intersection was found), or with the actual intersection that was found
+     *  - an optional intersection object, either empty (if no intersection was found), or with the actual intersection that was found;
+     *    shadow rays only need to know whether there is one, so only its distance and primitive are set, not the surface attributes
      */
     std::optional<Intersection> FindAnyIntersection(
         const Ray &ray,
@@ -73,21 +73,58 @@ public:
         Intersection isect;
         isect.distance = maximumDistance - 2 * EPSILON_RAY;
 
-        bool hit = mGeometry->IntersectP(ray, isect);
+        if (mGeometry->IntersectP(ray, isect))
+            return isect;
 
-        if (hit)
-        {
-            isect.lightID = -1;
-            std::map<int, int>::const_iterator it =
-                mMaterial2Light.find(isect.materialID);
+        return { };
+    }
+
+    /**
+     * Tells whether anything blocks the given ray before the given distance, i.e. a shadow ray test.
+     * Cheaper than FindAnyIntersection: no intersection object is filled in
+     * Arguments:
+     *  - a ray from the shading point
+     *  - the distance to the point we connect to (e.g. on a light), the light itself is not hit
+     *  - optional per-thread last occluder (initialized to -1), tested first and updated on a hit
+     * Returns:
+     *  - true when the ray is occluded
+     */
+    bool Occluded(
+        const Ray &ray,
+        float     maximumDistance,
+        int       *lastOccluder = NULL) const
+    {
+        return mGeometry->Occluded(ray, maximumDistance - 2 * EPSILON_RAY, lastOccluder);
+    }
+
+    /**
+     * Occluded for many rays at once, e.g. all shadow rays of a shading point or of a tile.
+     * The geometry is traversed once per chunk of rays instead of once per ray
+     * Arguments:
+     *  - count rays and the distances to the points they connect to
+     *  - output array of count flags, true for the occluded rays
+     *  - optional last occluders, one per ray, as for the single ray; e.g. the caller keeps one
+     *    per light, as shadow rays towards the same light from nearby points are blocked alike
+     */
+    void Occluded(
+        const Ray   *rays,
+        const float *maximumDistances,
+        int         count,
+        bool        *occluded,
+        int         *lastOccluders = NULL) const
+    {
+        const int chunkSize = 64;
+        float distances[chunkSize];
 
-            if (it != mMaterial2Light.end())
-                isect.lightID = it->second;
+        for (int first = 0; first < count; first += chunkSize)
+        {
+            const int chunkCount = std::min(chunkSize, count - first);
+            for (int i = 0; i < chunkCount; i++)
+                distances[i] = maximumDistances[first + i] - 2 * EPSILON_RAY;
 
-            return isect;
+            mGeometry->Occluded(rays + first, distances, chunkCount, occluded + first,
+                lastOccluders ? lastOccluders + first : NULL);
         }
-
-        return { };
     }
 
     const Material& GetMaterial(const int aMaterialIdx) const
@@ -117,6 +154,81 @@ public:
         return mBackground;
     }
 
+    // Deep copy of the read-only scene data, allocated (and first touched) by the calling thread
+    Scene* Clone() const
+    {
+        Scene *scene = new Scene(mArena.UsesHugePages());
+
+        scene->mGeometry  = mGeometry ? mGeometry->Clone(scene->mArena) : NULL;
+        scene->mAccel     = mAccel;
+        scene->mCamera    = mCamera;
+        scene->mMaterials = mMaterials;
+
+        scene->mLights.reserve(mLights.size());
+        for(size_t i=0; i<mLights.size(); i++)
+        {
+            scene->mLights.push_back(mLights[i]->Clone(scene->mArena));
+            if(mLights[i] == mBackground)
+                scene->mBackground = static_cast<BackgroundLight*>(scene->mLights[i]);
+        }
+
+        scene->mSceneName    = mSceneName;
+        scene->mSceneAcronym = mSceneAcronym;
+        return scene;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Acceleration structure over the loaded geometry
+    enum AccelType
+    {
+        kAccelList = 0,      // the geometry list alone, every ray tests every primitive
+        kAccelBvh,           // BVH in full precision
+        kAccelCompressedBvh, // BVH with quantized boxes and leaf vertices, 3-4x smaller
+        kAccelCount
+    };
+
+    static const char* GetAccelName(AccelType aType)
+    {
+        static const char *names[kAccelCount] = { "list", "bvh", "compressed" };
+        return names[aType];
+    }
+
+    // Wraps the geometry list in the given structure, once after loading
+    void BuildAccel(AccelType aType)
+    {
+        if(aType == kAccelList || mAccel != kAccelList || !mGeometry)
+            return;
+
+        GeometryList *geometryList = static_cast<GeometryList*>(mGeometry);
+        mGeometry = mArena.New<Bvh>(kArenaAccel, &mArena, geometryList,
+            aType == kAccelCompressedBvh ? Bvh::kCompressed : Bvh::kFullPrecision);
+        mAccel = aType;
+    }
+
+    // One line summary, e.g. "BVH, 2047 nodes, 3.2 MB of traversal data"; empty for the list
+    std::string DescribeAccel() const
+    {
+        return mAccel == kAccelList ? std::string() : static_cast<const Bvh*>(mGeometry)->Describe();
+    }
+
+    /**
+     * The copy of the scene on a NUMA node, made by the first thread that asks
+     * for it there, so it sits in that node's memory. Renderers use the copy
+     * of the node they are created on and do not read remote memory for
+     * every ray. With a single node there are no copies.
+     * Arguments:
+     *  - aNode = e.g. NumaTopology::GetCurrentNode()
+     */
+    const Scene& GetNodeReplica(int aNode) const
+    {
+        if(aNode < 0 || aNode >= int(mNodeReplicas.size()))
+            return *this;
+
+        NodeReplica &replica = mNodeReplicas[aNode];
+        std::call_once(replica.mOnce, [this, &replica]{ replica.mScene.reset(Clone()); });
+        return *replica.mScene;
+    }
+
     //////////////////////////////////////////////////////////////////////////
     // Loads a Cornell Box scene
     enum BoxMask
@@ -172,6 +284,7 @@ public:
             Vec2f(float(aResolution.x), float(aResolution.y)), 45);
 
         // Materials
+        mMaterials.reserve(mMaterials.size() + 8);
         Material mat;
         // 0) light1, will only emit
         mMaterials.push_back(mat);
@@ -202,8 +315,6 @@ public:
 		SetMaterial(mat, Vec3f(0.152941f, 0.152941f, 0.803922f), Vec3f(0.7f), 600, aBoxMask & kSpheresDiffuse, aBoxMask & kSpheresGlossy);
         mMaterials.push_back(mat);
 
-        delete mGeometry;
-
         //////////////////////////////////////////////////////////////////////////
         // Cornell box
         Vec3f cb[8] = {
@@ -217,38 +328,40 @@ public:
             Vec3f(-1.27029f, -1.25549f,  1.28002f)
         };
 
-        GeometryList *geometryList = new GeometryList;
+        GeometryList *geometryList = mArena.New<GeometryList>(kArenaGeometry, &mArena);
+        geometryList->Reserve(20, 2); // at most, with walls and the light box
         mGeometry = geometryList;
 
 		// Floor
-		geometryList->mGeometry.push_back(new Triangle(cb[0], cb[4], cb[5], 2));
-		geometryList->mGeometry.push_back(new Triangle(cb[5], cb[1], cb[0], 2));
+		geometryList->AddTriangle(cb[0], cb[4], cb[5], 2);
+		geometryList->AddTriangle(cb[5], cb[1], cb[0], 2);
 
 		if(aBoxMask & kWalls)
 		{
 			// Left wall
-			geometryList->mGeometry.push_back(new Triangle(cb[3], cb[7], cb[4], 3));
-			geometryList->mGeometry.push_back(new Triangle(cb[4], cb[0], cb[3], 3));
+			geometryList->AddTriangle(cb[3], cb[7], cb[4], 3);
+			geometryList->AddTriangle(cb[4], cb[0], cb[3], 3);
 
 			// Right wall
-			geometryList->mGeometry.push_back(new Triangle(cb[1], cb[5], cb[6], 4));
-			geometryList->mGeometry.push_back(new Triangle(cb[6], cb[2], cb[1], 4));
+			geometryList->AddTriangle(cb[1], cb[5], cb[6], 4);
+			geometryList->AddTriangle(cb[6], cb[2], cb[1], 4);
 
 			// Back wall
-			geometryList->mGeometry.push_back(new Triangle(cb[0], cb[1], cb[2], 5));
-			geometryList->mGeometry.push_back(new Triangle(cb[2], cb[3], cb[0], 5));
+			geometryList->AddTriangle(cb[0], cb[1], cb[2], 5);
+			geometryList->AddTriangle(cb[2], cb[3], cb[0], 5);
 
 
 			// Ceiling
 			if(light_ceiling && !light_box)
 			{
-				geometryList->mGeometry.push_back(new Triangle(cb[2], cb[6], cb[7], 0));
-				geometryList->mGeometry.push_back(new Triangle(cb[7], cb[3], cb[2], 1));
+				// Emitters of lights 0 and 1, see Lights below
+				geometryList->AddTriangle(cb[2], cb[6], cb[7], 0, 0);
+				geometryList->AddTriangle(cb[7], cb[3], cb[2], 1, 1);
 			}
 			else
 			{
-				geometryList->mGeometry.push_back(new Triangle(cb[2], cb[6], cb[7], 2));
-				geometryList->mGeometry.push_back(new Triangle(cb[7], cb[3], cb[2], 2));
+				geometryList->AddTriangle(cb[2], cb[6], cb[7], 2);
+				geometryList->AddTriangle(cb[7], cb[3], cb[2], 2);
 			}
 		}
 
@@ -263,8 +376,8 @@ public:
 			Vec3f leftBallCenter  = leftWallCenter  + Vec3f(2.f * xlen / 7.f, 0, 0);
 			Vec3f rightBallCenter = rightWallCenter - Vec3f(2.f * xlen / 7.f, -xlen/4, 0);
 
-			geometryList->mGeometry.push_back(new Sphere(leftBallCenter,  smallRadius, 6));
-			geometryList->mGeometry.push_back(new Sphere(rightBallCenter, smallRadius, 7));
+			geometryList->AddSphere(leftBallCenter,  smallRadius, 6);
+			geometryList->AddSphere(rightBallCenter, smallRadius, 7);
 		}
 
         //////////////////////////////////////////////////////////////////////////
@@ -283,20 +396,20 @@ public:
         if(light_box && !light_ceiling)
         {
             // Back wall
-            geometryList->mGeometry.push_back(new Triangle(lb[0], lb[2], lb[1], 5));
-            geometryList->mGeometry.push_back(new Triangle(lb[2], lb[0], lb[3], 5));
+            geometryList->AddTriangle(lb[0], lb[2], lb[1], 5);
+            geometryList->AddTriangle(lb[2], lb[0], lb[3], 5);
             // Left wall
-            geometryList->mGeometry.push_back(new Triangle(lb[3], lb[4], lb[7], 5));
-            geometryList->mGeometry.push_back(new Triangle(lb[4], lb[3], lb[0], 5));
+            geometryList->AddTriangle(lb[3], lb[4], lb[7], 5);
+            geometryList->AddTriangle(lb[4], lb[3], lb[0], 5);
             // Right wall
-            geometryList->mGeometry.push_back(new Triangle(lb[1], lb[6], lb[5], 5));
-            geometryList->mGeometry.push_back(new Triangle(lb[6], lb[1], lb[2], 5));
+            geometryList->AddTriangle(lb[1], lb[6], lb[5], 5);
+            geometryList->AddTriangle(lb[6], lb[1], lb[2], 5);
             // Front wall
-            geometryList->mGeometry.push_back(new Triangle(lb[4], lb[5], lb[6], 5));
-            geometryList->mGeometry.push_back(new Triangle(lb[6], lb[7], lb[4], 5));
-			// Floor
-			geometryList->mGeometry.push_back(new Triangle(lb[0], lb[5], lb[4], 0));
-			geometryList->mGeometry.push_back(new Triangle(lb[5], lb[0], lb[1], 1));
+            geometryList->AddTriangle(lb[4], lb[5], lb[6], 5);
+            geometryList->AddTriangle(lb[6], lb[7], lb[4], 5);
+			// Floor, emitters of lights 0 and 1
+			geometryList->AddTriangle(lb[0], lb[5], lb[4], 0, 0);
+			geometryList->AddTriangle(lb[5], lb[0], lb[1], 1, 1);
         }
 
         //////////////////////////////////////////////////////////////////////////
@@ -306,47 +419,153 @@ public:
         {
             // entire ceiling is a light source
             mLights.resize(2);
-            AreaLight *l = new AreaLight(cb[2], cb[6], cb[7]);
+            AreaLight *l = mArena.New<AreaLight>(kArenaLights, cb[2], cb[6], cb[7]);
             l->mRadiance = Vec3f(1.21f);
             mLights[0] = l;
-            mMaterial2Light.insert(std::make_pair(0, 0));
 
-            l = new AreaLight(cb[7], cb[3], cb[2]);
+            l = mArena.New<AreaLight>(kArenaLights, cb[7], cb[3], cb[2]);
             l->mRadiance = Vec3f(1.21f);
             mLights[1] = l;
-            mMaterial2Light.insert(std::make_pair(1, 1));
         }
 
         if(light_box && !light_ceiling)
         {
             // With light box
             mLights.resize(2);
-            AreaLight *l = new AreaLight(lb[0], lb[5], lb[4]);
+            AreaLight *l = mArena.New<AreaLight>(kArenaLights, lb[0], lb[5], lb[4]);
             l->mRadiance = Vec3f(31.831f); // 25 Watts
             mLights[0] = l;
-            mMaterial2Light.insert(std::make_pair(0, 0));
 
-            l = new AreaLight(lb[5], lb[0], lb[1]);
+            l = mArena.New<AreaLight>(kArenaLights, lb[5], lb[0], lb[1]);
             l->mRadiance = Vec3f(31.831f); // 25 Watts
             mLights[1] = l;
-            mMaterial2Light.insert(std::make_pair(1, 1));
         }
 
         if(light_point)
         {
-            PointLight *l = new PointLight(Vec3f(0.0, -0.5, 1.0));
+            PointLight *l = mArena.New<PointLight>(kArenaLights, Vec3f(0.0, -0.5, 1.0));
             l->mIntensity = Vec3f( 50.f/*Watts*/ / (4*PI_F) );
             mLights.push_back(l);
         }
 
         if(light_env)
         {
-            BackgroundLight *l = new BackgroundLight;
+            BackgroundLight *l = mArena.New<BackgroundLight>(kArenaLights);
             mLights.push_back(l);
             mBackground = l;
         }
     }
 
+    //////////////////////////////////////////////////////////////////////////
+    // Procedural stress scenes, for scaling tests without external assets.
+    // They sit in the Cornell box with diffuse walls and are generated from
+    // a fixed seed, so a scene is the same in every run.
+    enum StressScene
+    {
+        kStressSpheres = 0, // aPrimitiveCount random spheres
+        kStressMesh,        // one subdivided mesh of about aPrimitiveCount triangles
+        kStressLights,      // aLightCount emissive triangles above a few spheres
+        kStressGrid,        // a grid of flattened mesh copies (no instancing), about aPrimitiveCount triangles in total
+        kStressCount
+    };
+
+    static const char* GetStressSceneName(StressScene aType)
+    {
+        static const char *names[kStressCount] = { "spheres", "mesh", "lights", "grid" };
+        return names[aType];
+    }
+
+    void LoadStressScene(
+        const Vec2i &aResolution,
+        StressScene aType,
+        int         aPrimitiveCount,
+        int         aLightCount)
+    {
+        // Many lights replace the ceiling light
+        LoadCornellBox(aResolution, kWalls | kWallsDiffuse | (aType == kStressLights ? 0 : kLightCeiling));
+
+        Rng rng(4321);
+        GeometryList *geometryList = static_cast<GeometryList*>(mGeometry);
+
+        // Materials of the generated objects, every other one glossy
+        const int firstMaterial = GetMaterialCount();
+        const int materialCount = 8;
+        mMaterials.reserve(firstMaterial + materialCount);
+        for(int i=0; i<materialCount; i++)
+        {
+            Material mat;
+            SetMaterial(mat, rng.GetVec3f() * 0.7f + Vec3f(0.1f), Vec3f(0.5f), 100, 1, i & 1);
+            mMaterials.push_back(mat);
+        }
+
+        const int count = std::max(1, aPrimitiveCount);
+        std::ostringstream name, acronym;
+
+        // The arrays get their final size at once, see GeometryList::Reserve
+        const int perCopy   = 200;
+        const int copyCount = std::max(1, count / perCopy);
+        const int triangles[kStressCount] = { 0, MeshTriangleCount(MeshSubdivision(count)),
+            std::max(1, aLightCount), copyCount * MeshTriangleCount(MeshSubdivision(perCopy)) };
+        const int spheres[kStressCount] = { count, 0, 9, 0 };
+
+        geometryList->Reserve(geometryList->GetTriangleCount() + triangles[aType],
+            geometryList->GetSphereCount() + spheres[aType]);
+        if(aType == kStressLights)
+            mLights.reserve(mLights.size() + std::max(1, aLightCount));
+
+        if(aType == kStressSpheres)
+        {
+            // Smaller spheres as there are more of them, so they do not fill the box
+            const float radius = 0.35f / std::cbrt(float(count));
+
+            for(int i=0; i<count; i++)
+            {
+                const Vec3f center = (rng.GetVec3f() * 2.f - Vec3f(1.f)) * 1.1f;
+                const float r = radius * (0.5f + rng.GetFloat());
+                geometryList->AddSphere(center, r, firstMaterial + i % materialCount);
+            }
+
+            name << count << " random spheres";
+        }
+        else if(aType == kStressMesh)
+        {
+            AddMesh(*geometryList, Vec3f(0.f, 0.f, -0.2f), 0.9f, MeshSubdivision(count), firstMaterial);
+            name << "mesh of " << count << " triangles";
+        }
+        else if(aType == kStressLights)
+        {
+            for(int i=0; i<9; i++)
+            {
+                const Vec3f center(-0.8f + 0.8f * (i % 3), -0.8f + 0.8f * (i / 3), -0.98f);
+                geometryList->AddSphere(center, 0.28f, firstMaterial + i % materialCount);
+            }
+
+            AddEmissiveTriangles(*geometryList, std::max(1, aLightCount), rng);
+            name << std::max(1, aLightCount) << " emissive triangles";
+        }
+        else
+        {
+            // Flattened copies: each mesh is real triangles in the shared geometry, not a transformed
+            // reference to one mesh, so memory and build time grow with the copy count
+            const int subdivision   = MeshSubdivision(perCopy);
+            const int gridSize      = int(std::ceil(std::cbrt(float(copyCount)) - 1e-3f));
+            const float cellSize    = 2.2f / gridSize;
+
+            for(int i=0; i<copyCount; i++)
+            {
+                const Vec3i cell(i % gridSize, (i / gridSize) % gridSize, i / (gridSize * gridSize));
+                const Vec3f center = Vec3f(-1.1f) + Vec3f(cellSize) * (Vec3f(float(cell.x), float(cell.y), float(cell.z)) + Vec3f(0.5f));
+                AddMesh(*geometryList, center, 0.4f * cellSize, subdivision, firstMaterial + i % materialCount);
+            }
+
+            name << "grid of " << copyCount << " meshes";
+        }
+
+        mSceneName    = "stress: " + name.str() + (aType == kStressLights ? "" : " + ceiling light");
+        acronym << "stress_" << GetStressSceneName(aType) << "_" << (aType == kStressLights ? aLightCount : count);
+        mSceneAcronym = acronym.str();
+    }
+
     static std::string GetSceneName(
         uint        aBoxMask,
         std::string *oAcronym = NULL)
@@ -432,16 +651,128 @@ public:
         return name;
     }
 
+private:
+
+    // Subdivision of AddMesh giving about aTriangleCount triangles
+    static int MeshSubdivision(int aTriangleCount)
+    {
+        return std::max(2, int(std::sqrt(aTriangleCount / 4.f) + 0.5f));
+    }
+
+    // Triangles AddMesh adds at most (fewer when some collapse at the poles)
+    static int MeshTriangleCount(int aSubdivision)
+    {
+        return 4 * aSubdivision * aSubdivision;
+    }
+
+    // A sphere-like blob of about 4 * aSubdivision^2 triangles, facing outwards
+    static void AddMesh(
+        GeometryList &aoList,
+        const Vec3f  &aCenter,
+        float        aRadius,
+        int          aSubdivision,
+        int          aMatID)
+    {
+        const int rings    = aSubdivision;
+        const int segments = 2 * aSubdivision;
+
+        auto vertex = [&](int aRing, int aSegment)
+        {
+            const float theta = PI_F * aRing / rings;
+            const float phi   = 2.f * PI_F * aSegment / segments;
+            const float r     = aRadius * (1.f + 0.15f * std::sin(5.f * theta) * std::sin(4.f * phi));
+            return aCenter + Vec3f(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta)) * r;
+        };
+
+        auto addTriangle = [&](const Vec3f &aP0, const Vec3f &aP1, const Vec3f &aP2)
+        {
+            const Vec3f normal = Cross(aP1 - aP0, aP2 - aP0);
+            if(normal.LenSqr() <= 0.f)
+                return; // collapsed at a pole
+
+            if(Dot(normal, aP0 + aP1 + aP2 - aCenter * 3.f) >= 0.f)
+                aoList.AddTriangle(aP0, aP1, aP2, aMatID);
+            else
+                aoList.AddTriangle(aP0, aP2, aP1, aMatID);
+        };
+
+        for(int i=0; i<rings; i++)
+        {
+            for(int j=0; j<segments; j++)
+            {
+                const Vec3f p00 = vertex(i, j),     p01 = vertex(i, j + 1);
+                const Vec3f p10 = vertex(i + 1, j), p11 = vertex(i + 1, j + 1);
+
+                addTriangle(p00, p10, p11);
+                addTriangle(p00, p11, p01);
+            }
+        }
+    }
+
+    // Small downward facing emitters under the ceiling, each with its own
+    // light; the total power does not depend on their count
+    void AddEmissiveTriangles(
+        GeometryList &aoList,
+        int          aCount,
+        Rng          &aRng)
+    {
+        const float size = 1.5f / std::sqrt(float(aCount));
+
+        std::vector<AreaLight*> lights;
+        float totalArea = 0.f;
+
+        for(int i=0; i<aCount; i++)
+        {
+            const Vec3f center((aRng.GetFloat() * 2.f - 1.f) * 1.1f, (aRng.GetFloat() * 2.f - 1.f) * 1.1f,
+                0.6f + 0.6f * aRng.GetFloat());
+
+            Vec3f p[3];
+            for(int k=0; k<3; k++)
+            {
+                const float angle = 2.f * PI_F * (k + 0.3f * aRng.GetFloat()) / 3.f;
+                p[k] = center + Vec3f(std::cos(angle), std::sin(angle), 0.f) * size;
+            }
+
+            // Counter-clockwise from above faces up, so swap to face down
+            std::swap(p[1], p[2]);
+
+            // Material 0 only emits
+            aoList.AddTriangle(p[0], p[1], p[2], 0, int(mLights.size()));
+
+            AreaLight *light = mArena.New<AreaLight>(kArenaLights, p[0], p[1], p[2]);
+            mLights.push_back(light);
+            lights.push_back(light);
+
+            totalArea += 1.f / light->mInvArea;
+        }
+
+        // As much power as the ceiling light of the Cornell box
+        const float power = 1.21f * 2.56004f * 2.56004f;
+        for(size_t i=0; i<lights.size(); i++)
+            lights[i]->mRadiance = Vec3f(power / totalArea);
+    }
+
 public:
 
-    AbstractGeometry      *mGeometry;
+    MemoryArena           mArena;        //!< First, so that it outlives the arrays allocated in it
+    AbstractGeometry      *mGeometry;     //!< The GeometryList, or a Bvh over it (see mAccel)
+    AccelType             mAccel;
     Camera                mCamera;
-    std::vector<Material> mMaterials;
-    std::vector<AbstractLight*>   mLights;
-    std::map<int, int>    mMaterial2Light;
+    ArenaVector<Material> mMaterials;
+    ArenaVector<AbstractLight*>   mLights;
     // SceneSphere           mSceneSphere;
     BackgroundLight*      mBackground;
 
     std::string           mSceneName;
     std::string           mSceneAcronym;
+
+private:
+
+    struct NodeReplica
+    {
+        std::once_flag         mOnce;
+        std::unique_ptr<Scene> mScene;
+    };
+
+    mutable std::vector<NodeReplica> mNodeReplicas; //!< Per NUMA node, none with a single node
 };
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <map>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <condition_variable>
+#include "renderer.hpp"
+#include "config.hpp"
+#include "tasks.hpp"
+
+//////////////////////////////////////////////////////////////////////////
+// Long-running render server
+//
+// Jobs come one per line, with the same options as the command line
+// (-s, -i, -o, --resolution, ...). Scenes are cached by scene ID and
+// resolution, renderers (and their framebuffers) by scene and thread, and
+// the task system lives for the whole session. Jobs that arrive together
+// are run as one batch: the threads are split among the jobs, largest jobs
+// first, because small images do not keep many threads busy on their own.
+// The jobs' iterations are tasks of the same system, so a thread that is
+// done with its job steals from the others.
+class RenderServer
+{
+public:
+
+    // Renders a job with the given renderers (one per job thread) into the
+    // given framebuffer and saves it, returns whether it succeeded
+    typedef std::function<bool(const Config&, AbstractRenderer**, Framebuffer&)> JobFunction;
+
+    RenderServer(
+        int         aThreadCount,
+        JobFunction aRunJob) :
+        mThreadCount(std::max(1, aThreadCount)),
+        mRunJob(aRunJob),
+        mRenderers(mThreadCount),
+        mFramebuffers(mThreadCount),
+        mInputDone(false)
+    {}
+
+    ~RenderServer()
+    {
+        for(size_t slot=0; slot<mRenderers.size(); slot++)
+        {
+            for(auto it=mRenderers[slot].begin(); it!=mRenderers[slot].end(); ++it)
+            {
+                for(size_t i=0; i<it->second.size(); i++)
+                    delete it->second[i];
+            }
+        }
+    }
+
+    /**
+     * Serves jobs until the end of aInput
+     * Returns:
+     *  - number of failed jobs; oJobCount gets the number of all jobs
+     */
+    int Serve(
+        std::istream &aInput,
+        int          &oJobCount)
+    {
+        std::thread reader(&RenderServer::ReadJobs, this, std::ref(aInput));
+
+        int failed = 0;
+        oJobCount  = 0;
+
+        for(;;)
+        {
+            // Whatever has arrived so far makes the next batch
+            std::vector<std::string> lines;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mJobArrived.wait(lock, [this]{ return !mQueue.empty() || mInputDone; });
+
+                if(mQueue.empty())
+                    break;
+
+                lines.assign(mQueue.begin(), mQueue.end());
+                mQueue.clear();
+            }
+
+            failed    += RunBatch(lines);
+            oJobCount += int(lines.size());
+        }
+
+        reader.join();
+        return failed;
+    }
+
+private:
+
+    struct Job
+    {
+        std::string mLine;
+        Config      mConfig;
+        double      mCost;   //!< Pixel samples, for scheduling
+        bool        mFailed;
+    };
+
+    void ReadJobs(std::istream &aInput)
+    {
+        std::string line;
+        while(std::getline(aInput, line))
+        {
+            // Empty lines and comments are skipped
+            const size_t start = line.find_first_not_of(" \t\r");
+            if(start == std::string::npos || line[start] == '#')
+                continue;
+
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mQueue.push_back(line);
+            }
+            mJobArrived.notify_one();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mInputDone = true;
+        }
+        mJobArrived.notify_one();
+    }
+
+    // Parses the job line like a command line, the scene comes from the cache
+    bool ParseJob(Job &aoJob)
+    {
+        std::istringstream iss(aoJob.mLine);
+        std::vector<std::string> tokens;
+        std::string token;
+        while(iss >> token)
+            tokens.push_back(token);
+
+        std::vector<const char*> argv(1, "pg3render");
+        for(size_t i=0; i<tokens.size(); i++)
+            argv.push_back(tokens[i].c_str());
+
+        ParseCommandline(int(argv.size()), argv.data(), aoJob.mConfig, &mSceneCache);
+
+        Config &config = aoJob.mConfig;
+        if(config.mScene == NULL || config.mServer || config.mWorkerIndex >= 0 || !config.mMergeNames.empty())
+            return false;
+
+        // Jobs run inside the server, anything that writes on its own or forks stays off
+        config.mShowProgress       = false;
+        config.mPreviewInterval    = 0.f;
+        config.mCheckpointInterval = 0.f;
+        config.mResume             = false;
+        config.mProcessCount       = 1;
+
+        aoJob.mCost = double(config.mIterations) * config.mResolution.x * config.mResolution.y;
+        return true;
+    }
+
+    // Renderers of one scene for the threads of one job; new ones are NULL,
+    // render creates them on the threads that first use them
+    AbstractRenderer** GetRenderers(
+        int          aSlot,
+        const Config &aConfig)
+    {
+        std::vector<AbstractRenderer*> &renderers = mRenderers[aSlot][aConfig.mScene];
+
+        if(int(renderers.size()) < aConfig.mNumThreads)
+            renderers.resize(aConfig.mNumThreads, NULL);
+
+        return renderers.data();
+    }
+
+    int RunBatch(const std::vector<std::string> &aLines)
+    {
+        std::vector<Job> jobs(aLines.size());
+        for(size_t i=0; i<jobs.size(); i++)
+        {
+            jobs[i].mLine   = aLines[i];
+            jobs[i].mCost   = 0.0;
+            jobs[i].mFailed = !ParseJob(jobs[i]);
+        }
+
+        // Largest jobs first keeps the threads busy until the end of the batch
+        std::vector<int> order(jobs.size());
+        for(size_t i=0; i<order.size(); i++)
+            order[i] = int(i);
+        std::stable_sort(order.begin(), order.end(),
+            [&jobs](int a, int b) { return jobs[a].mCost > jobs[b].mCost; });
+
+        const int jobThreads    = std::min(mThreadCount, std::max(1, int(jobs.size())));
+        const int threadsPerJob = std::max(1, mThreadCount / jobThreads);
+
+        // Every runner owns a slot (renderers and framebuffer) and takes the
+        // next job in order until none is left
+        std::atomic<int> nextJob(0);
+        std::mutex       outputMutex;
+
+        TaskGroup runners;
+        for(int slot=0; slot<jobThreads; slot++)
+        {
+            runners.Run([&, slot]
+            {
+                for(int i=nextJob++; i<int(order.size()); i=nextJob++)
+                {
+                    Job &job = jobs[order[i]];
+
+                    if(!job.mFailed)
+                    {
+                        auto startT = std::chrono::high_resolution_clock::now();
+
+                        job.mConfig.mNumThreads = threadsPerJob;
+                        job.mFailed = !mRunJob(job.mConfig, GetRenderers(slot, job.mConfig), mFramebuffers[slot]);
+
+                        auto endT = std::chrono::high_resolution_clock::now();
+                        const float time = float(std::chrono::duration_cast<std::chrono::microseconds>(endT - startT).count()) / 1e6f;
+
+                        if(!job.mFailed)
+                        {
+                            std::lock_guard<std::mutex> lock(outputMutex);
+                            printf("ok %s %.3f\n", job.mConfig.mOutputName.c_str(), time);
+                            fflush(stdout);
+                            continue;
+                        }
+                    }
+
+                    std::lock_guard<std::mutex> lock(outputMutex);
+                    printf("failed %s\n", job.mLine.c_str());
+                    fflush(stdout);
+                }
+            });
+        }
+        runners.Wait();
+
+        int failed = 0;
+        for(size_t i=0; i<jobs.size(); i++)
+            failed += jobs[i].mFailed ? 1 : 0;
+
+        return failed;
+    }
+
+private:
+
+    int          mThreadCount;
+    JobFunction  mRunJob;
+    SceneCache   mSceneCache;
+
+    //! Per batch thread, renderers by scene
+    std::vector<std::map<const Scene*, std::vector<AbstractRenderer*> > > mRenderers;
+    std::vector<Framebuffer> mFramebuffers; //!< Per batch thread, final images
+
+    std::mutex               mMutex;
+    std::condition_variable  mJobArrived;
+    std::deque<std::string>  mQueue;      //!< Guarded by mMutex
+    bool                     mInputDone;  //!< Guarded by mMutex
+};
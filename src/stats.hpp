@@ -0,0 +1,168 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <cstdio>
+#include <stdint.h>
+
+//////////////////////////////////////////////////////////////////////////
+// Ray tracing statistics
+//
+// Counting is compiled in with -DPG3_STATS. Every thread counts into its
+// own cache-line-aligned block, found through a thread_local pointer, so
+// the counters are never shared between cores. Without PG3_STATS the
+// PG3_STAT_ADD macro expands to nothing and the build is unaffected.
+
+enum StatCounter
+{
+    kStatPrimaryRays = 0,
+    kStatShadowRays,
+    kStatSampleRays,     //!< Rays along sampled BRDF directions
+    kStatPrimitiveTests, //!< Ray-primitive intersection tests
+    kStatNodeVisits,     //!< Acceleration structure nodes (or geometry lists) traversed
+    kStatShadingCalls,   //!< BRDF samples and evaluations
+    kStatCount
+};
+
+struct alignas(64) RayStats
+{
+    RayStats()
+    {
+        Clear();
+    }
+
+    void Clear()
+    {
+        for(int i=0; i<kStatCount; i++)
+            mCounters[i] = 0;
+    }
+
+    uint64_t Rays() const
+    {
+        return mCounters[kStatPrimaryRays] + mCounters[kStatShadowRays] + mCounters[kStatSampleRays];
+    }
+
+    uint64_t mCounters[kStatCount];
+};
+
+class RayStatistics
+{
+public:
+
+    static bool Enabled()
+    {
+#if defined(PG3_STATS)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Counters of the calling thread
+    static RayStats& Local()
+    {
+        thread_local RayStats *stats = Register();
+        return *stats;
+    }
+
+    // Only while no thread is counting
+    static void Reset()
+    {
+        std::lock_guard<std::mutex> lock(Mutex());
+        for(size_t i=0; i<Registry().size(); i++)
+            Registry()[i]->Clear();
+    }
+
+    // Sum over all threads, only while no thread is counting
+    static RayStats Total()
+    {
+        RayStats total;
+
+        std::lock_guard<std::mutex> lock(Mutex());
+        for(size_t i=0; i<Registry().size(); i++)
+        {
+            for(int c=0; c<kStatCount; c++)
+                total.mCounters[c] += Registry()[i]->mCounters[c];
+        }
+
+        return total;
+    }
+
+    // End of render summary, aSeconds is the render time
+    static void PrintReport(float aSeconds)
+    {
+        const RayStats total = Total();
+        const uint64_t rays  = total.Rays();
+
+        printf("Rays:      %.2f M (%.2f M primary, %.2f M shadow, %.2f M BRDF sample), %.2f Mrays/s\n",
+            rays * 1e-6, total.mCounters[kStatPrimaryRays] * 1e-6, total.mCounters[kStatShadowRays] * 1e-6,
+            total.mCounters[kStatSampleRays] * 1e-6, aSeconds > 0.f ? rays * 1e-6 / aSeconds : 0.0);
+        printf("Per ray:   %.2f primitive tests, %.2f node visits, %.2f shading calls\n",
+            PerRay(total, kStatPrimitiveTests), PerRay(total, kStatNodeVisits), PerRay(total, kStatShadingCalls));
+    }
+
+    // The same numbers in a JSON object, for tracking regressions in scripts
+    static bool SaveJson(
+        const char *aFilename,
+        float      aSeconds)
+    {
+        FILE *file = fopen(aFilename, "w");
+        if(!file)
+            return false;
+
+        const RayStats total = Total();
+
+        fprintf(file, "{\n    \"seconds\": %.6f,\n", aSeconds);
+        for(int c=0; c<kStatCount; c++)
+            fprintf(file, "    \"%s\": %llu,\n", CounterName(c), (unsigned long long)total.mCounters[c]);
+        fprintf(file, "    \"rays\": %llu,\n", (unsigned long long)total.Rays());
+        fprintf(file, "    \"mrays_per_sec\": %.4f,\n", aSeconds > 0.f ? total.Rays() * 1e-6 / aSeconds : 0.0);
+        fprintf(file, "    \"tests_per_ray\": %.4f,\n", PerRay(total, kStatPrimitiveTests));
+        fprintf(file, "    \"nodes_per_ray\": %.4f\n}\n", PerRay(total, kStatNodeVisits));
+
+        return fclose(file) == 0;
+    }
+
+private:
+
+    static const char* CounterName(int aCounter)
+    {
+        static const char *names[kStatCount] = {
+            "primary_rays", "shadow_rays", "sample_rays", "primitive_tests", "node_visits", "shading_calls" };
+        return names[aCounter];
+    }
+
+    static double PerRay(const RayStats &aStats, int aCounter)
+    {
+        const uint64_t rays = aStats.Rays();
+        return rays > 0 ? double(aStats.mCounters[aCounter]) / rays : 0.0;
+    }
+
+    // Blocks live until the end of the program, so totals survive their threads
+    static RayStats* Register()
+    {
+        RayStats *stats = new RayStats();
+
+        std::lock_guard<std::mutex> lock(Mutex());
+        Registry().push_back(stats);
+        return stats;
+    }
+
+    static std::vector<RayStats*>& Registry()
+    {
+        static std::vector<RayStats*> registry;
+        return registry;
+    }
+
+    static std::mutex& Mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+};
+
+#if defined(PG3_STATS)
+#define PG3_STAT_ADD(aCounter, aValue) (RayStatistics::Local().mCounters[aCounter] += uint64_t(aValue))
+#else
+#define PG3_STAT_ADD(aCounter, aValue) ((void)0)
+#endif
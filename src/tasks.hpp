@@ -0,0 +1,576 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <condition_variable>
+#include "numa.hpp"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// Work-stealing task system
+//
+// The thread that calls Start becomes participant 0 and the system starts
+// the other participants as worker threads. Every participant has its own
+// deque: new tasks go to its back and are taken from there again (LIFO,
+// hot in cache), idle participants steal from the front of the others
+// (FIFO, the oldest and usually largest pieces of work). Workers sleep on
+// a condition variable when no task is queued anywhere. Waiting for a task
+// group does not block a participant, it runs queued tasks meanwhile, so
+// tasks can wait for tasks they spawned. A task that waits only runs tasks
+// of the group it waits for: anything else could be a long job of its own
+// (a server job, a node of a task graph) that would hold up the waiting one.
+//
+// Threads outside the system (previews, checkpoints, the server's job
+// reader) and everything before Start run their tasks themselves, in the
+// order they were added, and parallel loops in one piece.
+// Like the OpenMP threads before it, the workers do not survive a fork;
+// a forked child starts its own system.
+class TaskGroup;
+
+class TaskSystem
+{
+public:
+
+    typedef std::function<void()> Function;
+
+    // Thread placement, Linux only. Participants take the CPUs in the order
+    // of NumaTopology::GetCpuOrder, so they fill one NUMA node after another.
+    enum PinMode
+    {
+        kPinNone = 0,
+        kPinCpus,     //!< Each participant to its own CPU
+        kPinNodes     //!< Each participant to all CPUs of the node of that CPU
+    };
+
+    /**
+     * Starts the worker threads, stops the ones of an earlier Start
+     * Arguments:
+     *  - aThreadCount = participants including the calling thread
+     *  - aPin = placement of participant i, by CPU aFirstCpu + i of the CPU order (modulo the CPU count)
+     *  - aFirstCpu = CPU of participant 0, processes that split the machine pin to different CPUs
+     */
+    static void Start(
+        int     aThreadCount,
+        PinMode aPin = kPinNone,
+        int     aFirstCpu = 0)
+    {
+        Stop();
+
+        State *state = new State(std::max(1, aThreadCount));
+        Current() = state;
+        ThreadIndex() = 0;
+
+        PinCurrentThread(aPin, aFirstCpu);
+
+        for(int i=1; i<state->mThreadCount; i++)
+            state->mWorkers.push_back(std::thread(&TaskSystem::WorkerLoop, state, i, aPin, aFirstCpu + i));
+
+#if defined(__linux__)
+        static bool atForkRegistered = false;
+        if(!atForkRegistered)
+        {
+            pthread_atfork(NULL, NULL, &TaskSystem::AfterForkInChild);
+            atForkRegistered = true;
+        }
+#endif
+    }
+
+    // Joins the worker threads, only when no task is running
+    static void Stop()
+    {
+        State *state = Current();
+        if(!state)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(state->mSleepMutex);
+            state->mStop = true;
+        }
+        state->mWakeUp.notify_all();
+
+        for(size_t i=0; i<state->mWorkers.size(); i++)
+            state->mWorkers[i].join();
+
+        delete state;
+        Current() = NULL;
+        ThreadIndex() = -1;
+    }
+
+    // Participants, 1 when the system is not running
+    static int GetThreadCount()
+    {
+        return Current() ? Current()->mThreadCount : 1;
+    }
+
+    // Participant of the calling thread, -1 outside the system
+    static int GetThreadIndex()
+    {
+        return Current() ? ThreadIndex() : -1;
+    }
+
+    /**
+     * Runs aBody(begin, end) over subranges of [aBegin, aEnd) of at most aGrain
+     * items and returns when all are done. Ranges are halved into stealable
+     * tasks, so idle participants take the larger pieces first.
+     */
+    template<typename Body>
+    static void ParallelFor(
+        int        aBegin,
+        int        aEnd,
+        int        aGrain,
+        const Body &aBody);
+
+private:
+
+    friend class TaskGroup;
+
+    struct Task
+    {
+        Function  mFunction;
+        TaskGroup *mGroup;
+    };
+
+    struct alignas(64) Queue
+    {
+        std::mutex        mMutex;
+        std::deque<Task*> mTasks;
+    };
+
+    struct State
+    {
+        State(int aThreadCount) :
+            mThreadCount(aThreadCount),
+            mQueues(aThreadCount),
+            mQueued(0),
+            mStop(false)
+        {
+            for(int i=0; i<aThreadCount; i++)
+                mQueues[i].reset(new Queue);
+        }
+
+        int                                 mThreadCount;
+        std::vector<std::unique_ptr<Queue>> mQueues;
+        std::vector<std::thread>            mWorkers;
+        std::atomic<int>                    mQueued;     //!< Tasks in all queues
+        std::mutex                          mSleepMutex;
+        std::condition_variable             mWakeUp;
+        bool                                mStop;       //!< Guarded by mSleepMutex
+    };
+
+    static State*& Current()
+    {
+        static State *state = NULL;
+        return state;
+    }
+
+    static int& ThreadIndex()
+    {
+        thread_local int index = -1;
+        return index;
+    }
+
+    // Tasks running on the calling thread, nested through waits
+    static int& Depth()
+    {
+        thread_local int depth = 0;
+        return depth;
+    }
+
+    // The threads of the parent are gone, their state is left as it is
+    static void AfterForkInChild()
+    {
+        Current() = NULL;
+        ThreadIndex() = -1;
+    }
+
+    // aSlot is the position in the CPU order
+    static void PinCurrentThread(
+        PinMode aPin,
+        int     aSlot)
+    {
+#if defined(__linux__)
+        if(aPin == kPinNone)
+            return;
+
+        const NumaTopology &topology = NumaTopology::Get();
+        const std::vector<int> &order = topology.GetCpuOrder();
+        const int cpu = order[aSlot % int(order.size())];
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+
+        if(aPin == kPinCpus)
+            CPU_SET(cpu, &set);
+        else
+        {
+            const std::vector<int> &cpus = topology.GetNodeCpus(topology.GetNodeOfCpu(cpu));
+            for(size_t i=0; i<cpus.size(); i++)
+                CPU_SET(cpus[i], &set);
+        }
+
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+        (void)aPin;
+        (void)aSlot;
+#endif
+    }
+
+    // Queues at the back of a participant's deque, -1 for the calling one
+    static void Push(
+        Task *aTask,
+        int  aParticipant = -1);
+
+    /**
+     * Takes a task from the own queue from the back first, then from the
+     * others from the front
+     * Arguments:
+     *  - aGroup = only tasks of this group, any task when NULL
+     */
+    static Task* TryPop(
+        State     *aState,
+        int       aIndex,
+        TaskGroup *aGroup = NULL);
+
+    static void Execute(Task *aTask);
+
+    static void WorkerLoop(
+        State   *aState,
+        int     aIndex,
+        PinMode aPin,
+        int     aSlot)
+    {
+        ThreadIndex() = aIndex;
+        PinCurrentThread(aPin, aSlot);
+
+        for(;;)
+        {
+            Task *task = TryPop(aState, aIndex);
+            if(task)
+            {
+                Execute(task);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(aState->mSleepMutex);
+            aState->mWakeUp.wait(lock, [aState]{ return aState->mStop || aState->mQueued.load() > 0; });
+
+            if(aState->mStop)
+                return;
+        }
+    }
+
+    template<typename Body>
+    static void SplitRange(
+        TaskGroup  &aoGroup,
+        int        aBegin,
+        int        aEnd,
+        int        aGrain,
+        const Body &aBody);
+};
+
+// Tasks that are waited for together. Tasks may add more tasks to their
+// own group, Wait returns only when those are done as well.
+class TaskGroup
+{
+public:
+
+    TaskGroup() : mPending(0), mQueued(0)
+    {}
+
+    ~TaskGroup()
+    {
+        Wait();
+    }
+
+    /**
+     * Queues the function; outside the task system it runs in Wait
+     * Arguments:
+     *  - aParticipant = whose deque gets the task (modulo the participants), e.g. to spread
+     *    work that allocates memory over the threads (and NUMA nodes) in the order of the
+     *    participants; -1 for the calling one. The task can still be stolen
+     */
+    void Run(
+        TaskSystem::Function aFunction,
+        int                  aParticipant = -1)
+    {
+        if(TaskSystem::GetThreadIndex() < 0)
+        {
+            mInline.push_back(std::move(aFunction));
+            return;
+        }
+
+        TaskSystem::Task *task = new TaskSystem::Task;
+        task->mFunction = std::move(aFunction);
+        task->mGroup    = this;
+
+        mPending.fetch_add(1);
+        TaskSystem::Push(task, aParticipant);
+    }
+
+    // Runs queued tasks (of any group) until all tasks of this group are done
+    void Wait()
+    {
+        while(!mInline.empty())
+        {
+            TaskSystem::Function function = std::move(mInline.front());
+            mInline.pop_front();
+            function();
+        }
+
+        // Without a running system all tasks of the group ran inline above
+        TaskSystem::State *state = TaskSystem::Current();
+        if(!state)
+            return;
+
+        const int index = TaskSystem::GetThreadIndex();
+
+        // Outside of tasks any task helps, inside only the group's own
+        TaskGroup *only = TaskSystem::Depth() > 0 ? this : NULL;
+        const std::atomic<int> &queued = only ? mQueued : state->mQueued;
+
+        while(mPending.load() > 0)
+        {
+            TaskSystem::Task *task = TaskSystem::TryPop(state, index, only);
+            if(task)
+            {
+                TaskSystem::Execute(task);
+                continue;
+            }
+
+            // The rest runs elsewhere; a new task or the end of the group wakes us up
+            std::unique_lock<std::mutex> lock(state->mSleepMutex);
+            state->mWakeUp.wait(lock, [this, &queued]{ return mPending.load() == 0 || queued.load() > 0; });
+        }
+    }
+
+private:
+
+    friend class TaskSystem;
+
+    void TaskDone()
+    {
+        if(mPending.fetch_sub(1) > 1)
+            return;
+
+        // Waiting participants sleep on the shared condition variable
+        TaskSystem::State *state = TaskSystem::Current();
+        {
+            std::lock_guard<std::mutex> lock(state->mSleepMutex);
+        }
+        state->mWakeUp.notify_all();
+    }
+
+    std::atomic<int>                 mPending;  //!< Tasks not done yet
+    std::atomic<int>                 mQueued;   //!< Tasks still in the queues
+    std::deque<TaskSystem::Function> mInline;   //!< Added outside the task system
+};
+
+inline void TaskSystem::Push(
+    Task *aTask,
+    int  aParticipant)
+{
+    State *state = Current();
+    Queue &queue = *state->mQueues[aParticipant < 0 ? ThreadIndex() : aParticipant % state->mThreadCount];
+    {
+        std::lock_guard<std::mutex> lock(queue.mMutex);
+        queue.mTasks.push_back(aTask);
+        aTask->mGroup->mQueued.fetch_add(1);
+    }
+    state->mQueued.fetch_add(1);
+
+    // Taking the lock orders this with a participant that is about to sleep.
+    // Waiting tasks sleep on the same variable and may not take this task,
+    // so all are woken up.
+    {
+        std::lock_guard<std::mutex> lock(state->mSleepMutex);
+    }
+    state->mWakeUp.notify_all();
+}
+
+inline TaskSystem::Task* TaskSystem::TryPop(
+    State     *aState,
+    int       aIndex,
+    TaskGroup *aGroup)
+{
+    if((aGroup ? aGroup->mQueued.load() : aState->mQueued.load()) == 0)
+        return NULL;
+
+    for(int i=0; i<aState->mThreadCount; i++)
+    {
+        const int victim = (aIndex + i) % aState->mThreadCount;
+        Queue &queue = *aState->mQueues[victim];
+
+        std::lock_guard<std::mutex> lock(queue.mMutex);
+        if(queue.mTasks.empty())
+            continue;
+
+        Task *task = NULL;
+        if(i == 0)
+        {
+            // Back to front
+            for(size_t j=queue.mTasks.size(); j-- > 0; )
+            {
+                if(!aGroup || queue.mTasks[j]->mGroup == aGroup)
+                {
+                    task = queue.mTasks[j];
+                    queue.mTasks.erase(queue.mTasks.begin() + j);
+                    break;
+                }
+            }
+        }
+        else
+        {
+            for(size_t j=0; j<queue.mTasks.size(); j++)
+            {
+                if(!aGroup || queue.mTasks[j]->mGroup == aGroup)
+                {
+                    task = queue.mTasks[j];
+                    queue.mTasks.erase(queue.mTasks.begin() + j);
+                    break;
+                }
+            }
+        }
+
+        if(!task)
+            continue;
+
+        task->mGroup->mQueued.fetch_sub(1);
+        aState->mQueued.fetch_sub(1);
+        return task;
+    }
+
+    return NULL;
+}
+
+inline void TaskSystem::Execute(Task *aTask)
+{
+    Depth()++;
+    aTask->mFunction();
+    Depth()--;
+
+    aTask->mGroup->TaskDone();
+    delete aTask;
+}
+
+template<typename Body>
+void TaskSystem::ParallelFor(
+    int        aBegin,
+    int        aEnd,
+    int        aGrain,
+    const Body &aBody)
+{
+    aGrain = std::max(1, aGrain);
+
+    if(aBegin >= aEnd)
+        return;
+
+    if(aEnd - aBegin <= aGrain || GetThreadIndex() < 0 || GetThreadCount() == 1)
+    {
+        aBody(aBegin, aEnd);
+        return;
+    }
+
+    TaskGroup group;
+    SplitRange(group, aBegin, aEnd, aGrain, aBody);
+    group.Wait();
+}
+
+template<typename Body>
+void TaskSystem::SplitRange(
+    TaskGroup  &aoGroup,
+    int        aBegin,
+    int        aEnd,
+    int        aGrain,
+    const Body &aBody)
+{
+    // The upper halves are queued, the lower one is split further here
+    while(aEnd - aBegin > aGrain)
+    {
+        const int middle = aBegin + (aEnd - aBegin) / 2;
+        aoGroup.Run([&aoGroup, middle, aEnd, aGrain, &aBody]
+        {
+            SplitRange(aoGroup, middle, aEnd, aGrain, aBody);
+        });
+        aEnd = middle;
+    }
+
+    aBody(aBegin, aEnd);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Graph of dependent tasks
+//
+// Nodes are added with the nodes they depend on, which must have been
+// added before. Run queues the nodes without dependencies; a finished node
+// queues the successors it was the last dependency of. Independent nodes
+// run at the same time, and nodes use parallel loops of their own.
+class TaskGraph
+{
+public:
+
+    // Returns the node, for the dependencies of later nodes
+    int Add(
+        TaskSystem::Function    aFunction,
+        const std::vector<int>  &aDependencies = std::vector<int>())
+    {
+        const int node = int(mNodes.size());
+
+        mNodes.push_back(std::unique_ptr<Node>(new Node));
+        mNodes[node]->mFunction = std::move(aFunction);
+        mNodes[node]->mWaiting.store(int(aDependencies.size()));
+
+        for(size_t i=0; i<aDependencies.size(); i++)
+            mNodes[aDependencies[i]]->mSuccessors.push_back(node);
+
+        return node;
+    }
+
+    // Runs all nodes and returns when they are done
+    void Run()
+    {
+        for(size_t i=0; i<mNodes.size(); i++)
+        {
+            if(mNodes[i]->mWaiting.load() == 0)
+                Queue(int(i));
+        }
+
+        mGroup.Wait();
+    }
+
+private:
+
+    struct Node
+    {
+        TaskSystem::Function mFunction;
+        std::vector<int>     mSuccessors;
+        std::atomic<int>     mWaiting;    //!< Dependencies not done yet
+    };
+
+    void Queue(int aNode)
+    {
+        mGroup.Run([this, aNode]
+        {
+            Node &node = *mNodes[aNode];
+            node.mFunction();
+
+            for(size_t i=0; i<node.mSuccessors.size(); i++)
+            {
+                if(mNodes[node.mSuccessors[i]]->mWaiting.fetch_sub(1) == 1)
+                    Queue(node.mSuccessors[i]);
+            }
+        });
+    }
+
+    std::vector<std::unique_ptr<Node> > mNodes;
+    TaskGroup                           mGroup;
+};
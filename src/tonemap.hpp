@@ -0,0 +1,202 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <string>
+#include <algorithm>
+#include <stdint.h>
+#include "math.hpp"
+
+//////////////////////////////////////////////////////////////////////////
+// Tonemapping of linear radiance to 8-bit display values
+//
+// Exposure and the tone curve are plain arithmetic on planar rows, which the
+// compiler vectorizes. The display encoding (gamma or sRGB) goes through a
+// lookup table on the tone-mapped [0, 1] value, so there is no pow per pixel.
+class Tonemapper
+{
+public:
+
+    enum Curve
+    {
+        kCurveClamp = 0, //!< Values above 1 are clipped
+        kCurveReinhard,  //!< x / (1 + x)
+        kCurveFilmic,    //!< Hable's Uncharted 2 curve, white point 11.2
+        kCurveAces       //!< Narkowicz fit of the ACES reference rendering transform
+    };
+
+    enum Encoding
+    {
+        kEncodingGamma = 0, //!< Power function with mGamma
+        kEncodingSRGB       //!< Piecewise sRGB transfer function
+    };
+
+    Tonemapper(
+        float    aExposure = 0.f,
+        Curve    aCurve    = kCurveClamp,
+        Encoding aEncoding = kEncodingGamma,
+        float    aGamma    = 2.2f)
+    {
+        mExposure = aExposure;
+        mCurve    = aCurve;
+        mEncoding = aEncoding;
+        mGamma    = aGamma;
+        Setup();
+    }
+
+    // Rebuilds the lookup table, call after changing the public members
+    void Setup()
+    {
+        mScale = std::pow(2.f, mExposure);
+        mLut.resize(kLutSize);
+
+        for(int i=0; i<kLutSize; i++)
+        {
+            const float v = float(i) / (kLutSize - 1);
+            float encoded;
+
+            if(mEncoding == kEncodingSRGB)
+                encoded = (v <= 0.0031308f) ? 12.92f * v : 1.055f * std::pow(v, 1.f / 2.4f) - 0.055f;
+            else
+                encoded = std::pow(v, 1.f / mGamma);
+
+            mLut[i] = uint8_t(std::min(255.f, std::max(0.f, encoded * 255.f + 0.5f)));
+        }
+    }
+
+    static bool ParseCurve(const std::string &aName, Curve &oCurve)
+    {
+        static const char *names[] = { "clamp", "reinhard", "filmic", "aces" };
+
+        for(int i=0; i<4; i++)
+        {
+            if(aName == names[i])
+            {
+                oCurve = Curve(i);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Tonemaps one row
+     * Arguments:
+     *  - aR, aG, aB = planar linear radiance, aCount values each
+     *  - oPixels = interleaved 8-bit output, 3 bytes per pixel
+     *  - aBgr = whether to swap red and blue on output (BMP order)
+     */
+    void ApplyRow(
+        const float *aR,
+        const float *aG,
+        const float *aB,
+        int         aCount,
+        uint8_t     *oPixels,
+        bool        aBgr = false) const
+    {
+        // Small fixed-size batches keep the temporaries in L1
+        const int kBatch = 256;
+        int32_t index[3][kBatch];
+
+        const float *src[3] = { aR, aG, aB };
+
+        for(int start=0; start<aCount; start+=kBatch)
+        {
+            const int count = std::min(kBatch, aCount - start);
+
+            for(int c=0; c<3; c++)
+                MapToIndex(src[c] + start, count, index[c]);
+
+            uint8_t *dst = oPixels + size_t(start) * 3;
+            const int first = aBgr ? 2 : 0, last = 2 - first;
+
+            for(int i=0; i<count; i++)
+            {
+                dst[3*i + 0] = mLut[index[first][i]];
+                dst[3*i + 1] = mLut[index[1][i]];
+                dst[3*i + 2] = mLut[index[last][i]];
+            }
+        }
+    }
+
+public:
+
+    float    mExposure; //!< In stops, applied before the curve
+    Curve    mCurve;
+    Encoding mEncoding;
+    float    mGamma;    //!< Only used by kEncodingGamma
+
+private:
+
+    // 2^14 entries keep the step below one output level even in the steep dark end
+    static const int kLutSize = 1 << 14;
+
+    // Exposure, tone curve and quantization to the table index
+    void MapToIndex(
+        const float *aSrc,
+        int         aCount,
+        int32_t     *oIndex) const
+    {
+        const float scale    = mScale;
+        const float lutScale = float(kLutSize - 1);
+
+        switch(mCurve)
+        {
+        case kCurveReinhard:
+            for(int i=0; i<aCount; i++)
+            {
+                const float x = Clamp(aSrc[i] * scale);
+                oIndex[i] = int32_t(x / (1.f + x) * lutScale + 0.5f);
+            }
+            break;
+
+        case kCurveFilmic:
+            {
+                const float invWhite = 1.f / Hable(11.2f);
+                for(int i=0; i<aCount; i++)
+                {
+                    // Hable's curve expects an exposure bias of 2
+                    const float x = Clamp(aSrc[i] * scale * 2.f);
+                    const float y = std::min(1.f, Hable(x) * invWhite);
+                    oIndex[i] = int32_t(y * lutScale + 0.5f);
+                }
+            }
+            break;
+
+        case kCurveAces:
+            for(int i=0; i<aCount; i++)
+            {
+                const float x = Clamp(aSrc[i] * scale * 0.6f);
+                const float y = std::min(1.f, (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f));
+                oIndex[i] = int32_t(y * lutScale + 0.5f);
+            }
+            break;
+
+        default:
+            for(int i=0; i<aCount; i++)
+            {
+                const float y = std::min(1.f, std::max(0.f, aSrc[i] * scale));
+                oIndex[i] = int32_t(y * lutScale + 0.5f);
+            }
+            break;
+        }
+    }
+
+    // Keeps the curves away from NaN (negative, NaN and infinite input)
+    static float Clamp(float x)
+    {
+        return std::min(1e6f, std::max(0.f, x));
+    }
+
+    static float Hable(float x)
+    {
+        const float A = 0.15f, B = 0.50f, C = 0.10f, D = 0.20f, E = 0.02f, F = 0.30f;
+        return ((x * (A * x + C * B) + D * E) / (x * (A * x + B) + D * F)) - E / F;
+    }
+
+private:
+
+    float                mScale; //!< 2^mExposure
+    std::vector<uint8_t> mLut;
+};
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstdio>
+#include <stdint.h>
+
+//////////////////////////////////////////////////////////////////////////
+// Timeline of the render phases, written as a Chrome trace
+//
+// Each thread records complete events (name, start, duration) into its own
+// ring buffer; only the owning thread writes it, so recording takes no
+// locks. A full buffer overwrites its oldest events. The buffers are read
+// when the trace is saved, after all rendering threads are done. The file
+// opens in chrome://tracing and ui.perfetto.dev. When tracing is off, a
+// TraceScope costs one relaxed atomic load.
+class Tracer
+{
+public:
+
+    struct Event
+    {
+        const char *mName;   //!< String literal, not copied
+        int64_t    mStart;   //!< Nanoseconds since the program started
+        int64_t    mDuration;
+        int        mArg;     //!< E.g. the iteration, negative for none
+    };
+
+    static void Enable()
+    {
+        Epoch();
+        EnabledFlag().store(true, std::memory_order_relaxed);
+    }
+
+    static bool Enabled()
+    {
+        return EnabledFlag().load(std::memory_order_relaxed);
+    }
+
+    static int64_t Now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - Epoch()).count();
+    }
+
+    // Records an event on the calling thread
+    static void Record(
+        const char *aName,
+        int64_t    aStart,
+        int64_t    aEnd,
+        int        aArg = -1)
+    {
+        ThreadBuffer &buffer = Local();
+
+        Event &event    = buffer.mEvents[buffer.mCount & (kCapacity - 1)];
+        event.mName     = aName;
+        event.mStart    = aStart;
+        event.mDuration = aEnd - aStart;
+        event.mArg      = aArg;
+
+        buffer.mCount++;
+    }
+
+    // Writes all recorded events, only while no thread is recording
+    static bool Save(const char *aFilename)
+    {
+        FILE *file = fopen(aFilename, "w");
+        if(!file)
+            return false;
+
+        std::lock_guard<std::mutex> lock(Mutex());
+        std::vector<ThreadBuffer*> &buffers = Registry();
+
+        fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+        fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"pg3render\"}}");
+
+        for(size_t t=0; t<buffers.size(); t++)
+        {
+            fprintf(file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                "\"args\": {\"name\": \"%s %d\"}}", int(t), t == 0 ? "Main" : "Thread", int(t));
+
+            const ThreadBuffer &buffer = *buffers[t];
+            const uint64_t first = buffer.mCount > kCapacity ? buffer.mCount - kCapacity : 0;
+
+            for(uint64_t i=first; i<buffer.mCount; i++)
+            {
+                const Event &event = buffer.mEvents[i & (kCapacity - 1)];
+
+                fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"pg3\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                    "\"ts\": %.3f, \"dur\": %.3f", event.mName, int(t), event.mStart * 1e-3, event.mDuration * 1e-3);
+
+                if(event.mArg >= 0)
+                    fprintf(file, ", \"args\": {\"index\": %d}", event.mArg);
+
+                fprintf(file, "}");
+            }
+        }
+
+        fprintf(file, "\n]}\n");
+        return fclose(file) == 0;
+    }
+
+private:
+
+    static const uint64_t kCapacity = 1 << 16; //!< Events per thread, power of two
+
+    struct alignas(64) ThreadBuffer
+    {
+        ThreadBuffer() : mEvents(kCapacity), mCount(0)
+        {}
+
+        std::vector<Event> mEvents;
+        uint64_t           mCount;  //!< Events ever recorded
+    };
+
+    // Threads get their buffer on their first event, numbered in that order
+    static ThreadBuffer& Local()
+    {
+        thread_local ThreadBuffer *buffer = Register();
+        return *buffer;
+    }
+
+    // Buffers live until the end of the program, so events survive their threads
+    static ThreadBuffer* Register()
+    {
+        ThreadBuffer *buffer = new ThreadBuffer();
+
+        std::lock_guard<std::mutex> lock(Mutex());
+        Registry().push_back(buffer);
+        return buffer;
+    }
+
+    static std::vector<ThreadBuffer*>& Registry()
+    {
+        static std::vector<ThreadBuffer*> registry;
+        return registry;
+    }
+
+    static std::mutex& Mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::atomic<bool>& EnabledFlag()
+    {
+        static std::atomic<bool> enabled(false);
+        return enabled;
+    }
+
+    static std::chrono::steady_clock::time_point Epoch()
+    {
+        static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+        return epoch;
+    }
+};
+
+// Records the lifetime of the object as one event, when tracing is enabled
+class TraceScope
+{
+public:
+
+    TraceScope(
+        const char *aName,
+        int        aArg = -1) :
+        mName(aName),
+        mArg(aArg),
+        mStart(Tracer::Enabled() ? Tracer::Now() : -1)
+    {}
+
+    ~TraceScope()
+    {
+        if(mStart >= 0)
+            Tracer::Record(mName, mStart, Tracer::Now(), mArg);
+    }
+
+private:
+
+    const char *mName;
+    int        mArg;
+    int64_t    mStart;
+};